@@ -6,43 +6,76 @@
 #include<cassert>
 #include<string>
 #include<map>
+#include<vector>
+#include<pthread.h>
 
 #include <stdint.h>
 #include "htslib/sam.h"
 #include "sam_utils.h"
 #include "SamHeader.hpp"
+#include "BamReader.h"
+#include "BamSorter.h"
 
 #include "utils.h"
 #include "my_assert.h"
 #include "bc_aux.h"
 #include "Transcript.h"
 #include "Transcripts.h"
+#include "GenomeProjector.h"
+
+/*
+  The input is handled in batches of about BC_BATCH_SIZE records, cut at read boundaries. The main thread reads a batch
+  (inflated in parallel by BamReader) and checks the pairing of its records; nThreads threads then convert and collapse
+  disjoint ranges of reads, each into its own output list, and the lists are written out in input order.
+ */
+const int BC_BATCH_SIZE = 1 << 16;
 
 class BamConverter {
 public:
-  BamConverter(const char* inpF, const char* outF, const char* chr_list, Transcripts& transcripts, int nThreads, const std::string& command);
+  BamConverter(const char* inpF, const char* outF, const char* chr_list, Transcripts& transcripts, int nThreads, const std::string& command, const char* sortedF = NULL, size_t sortMem = 0);
 	~BamConverter();
 
 	void process();
 private:
+	// a range of reads [fr, to) of the batch and the records it produces
+	struct Params {
+		BamConverter *bc;
+		int fr, to;
+		std::vector<bam1_t*> outputs, collapsed; // collapsed, records created by collapsing, owned by the range
+	};
+
 	samFile *in, *out;
-	bam_hdr_t *in_header, *out_header;
+	bam_hdr_t *in_header, *out_header, *sorted_header;
+	BamReader *reader;
+	BamSorter *sorter; // if not NULL, also write a coordinate-sorted copy of the output
 	Transcripts& transcripts;
+	int nThreads;
 
-	std::map<std::string, int> refmap;
-	std::map<std::string, int>::iterator iter;
+	GenomeProjector *projector;
 
-	CollapseMap collapseMap;
+	std::vector<bam1_t*> records; // records of the batch, mates of a pair are adjacent with mate 1 first
+	std::vector<int> starts; // starts[i], index of the first record of the ith read of the batch
+
+	uint8_t flipTable[256]; // reverse complement of the two bases in a byte
 
-	void convert(bam1_t*, const Transcript&);
+	int readUnit(int k, HIT_INT_TYPE& cnt);
+	static void* convertReads(void* arg);
+	void convertBatch();
+
+	void convert(bam1_t*, int sid, const Transcript&);
+
+	void write(bam1_t* b) {
+		sam_write1(out, out_header, b);
+		if (sorter != NULL) sorter->add(b);
+	}
 
-	void writeCollapsedLines();
+	void collectCollapsedLines(CollapseMap& collapseMap, Params& params);
 	void flipSeq(uint8_t*, int);
 	void flipQual(uint8_t*, int);
 	void modifyTags(bam1_t*, const Transcript&); // modify MD tag and XS tag if needed
 };
 
-BamConverter::BamConverter(const char* inpF, const char* outF, const char* chr_list, Transcripts& transcripts, int nThreads, const std::string& command)
+BamConverter::BamConverter(const char* inpF, const char* outF, const char* chr_list, Transcripts& transcripts, int nThreads, const std::string& command, const char* sortedF, size_t sortMem)
 	: transcripts(transcripts)
 {
 	general_assert(transcripts.getType() == 0, "Genome information is not provided! RSEM cannot convert the transcript bam file!");
@@ -59,106 +92,195 @@ BamConverter::BamConverter(const char* inpF, const char* outF, const char* chr_l
 	hdr.insertPG("rsem-tbam2gbam", command);
 	//	hdr.addComment("This BAM file is processed by rsem-tbam2gam to convert from transcript coordinates into genomic coordinates.");
 	out_header = hdr.create_header();
-	
-	refmap.clear();
-	for (int i = 0; i < out_header->n_targets; ++i) {
-		refmap[out_header->target_name[i]] = i;
+
+	sorter = NULL; sorted_header = NULL;
+	if (sortedF != NULL) {
+		hdr.setSortOrder("coordinate");
+		sorted_header = hdr.create_header();
+		sorter = new BamSorter(sortedF, sorted_header, sortMem, nThreads);
 	}
+	
+	projector = new GenomeProjector(transcripts, out_header);
 
 	out = sam_open(outF, "wb");
 	assert(out != 0);
 	sam_hdr_write(out, out_header);
 
-	if (nThreads > 1) general_assert(hts_set_threads(out, nThreads) == 0, "Fail to create threads for writing the BAM file!");
+	int nInflate = bamReaderThreads(nThreads);
+	this->nThreads = nThreads - nInflate;
+	if (this->nThreads > 1) general_assert(hts_set_threads(out, this->nThreads) == 0, "Fail to create threads for writing the BAM file!");
+
+	reader = new BamReader(in, in_header, nInflate);
+
+	uint8_t comp[16];
+	for (int c = 0; c < 16; c++) comp[c] = (c & 1) << 3 | (c & 2) << 1 | (c & 4) >> 1 | (c & 8) >> 3;
+	for (int x = 0; x < 256; x++) flipTable[x] = comp[x & 15] << 4 | comp[x >> 4];
 }
 
 BamConverter::~BamConverter() {
+	if (sorter != NULL) {
+		delete sorter;
+		bam_hdr_destroy(sorted_header);
+	}
+	for (size_t i = 0; i < records.size(); i++) bam_destroy1(records[i]);
+	delete reader;
+	delete projector;
 	bam_hdr_destroy(in_header);
 	sam_close(in);
 	bam_hdr_destroy(out_header);
 	sam_close(out);
 }
 
+// Read the next single-end read or pair into records[k, k + 2), mate 1 first; return the number of records read
+int BamConverter::readUnit(int k, HIT_INT_TYPE& cnt) {
+	if (records.size() < size_t(k) + 2) {
+		size_t size = records.size();
+		records.resize(size_t(k) + 2 > 2 * size ? size_t(k) + 2 : 2 * size);
+		for (size_t i = size; i < records.size(); i++) records[i] = bam_init1();
+	}
+
+	bam1_t *b = records[k], *b2 = records[k + 1];
+
+	if (reader->read(b) < 0) return 0;
+	++cnt;
+	bool isPaired = bam_is_paired(b);
+	if (isPaired) {
+		assert(reader->read(b2) >= 0 && bam_is_paired(b2));
+		if (!bam_is_read1(b)) { records[k] = b2; records[k + 1] = b; b = records[k]; b2 = records[k + 1]; }
+		assert(bam_is_read1(b) && bam_is_read2(b2));
+		general_assert((bam_is_mapped(b) && bam_is_mapped(b2)) || (bam_is_unmapped(b) && bam_is_unmapped(b2)), \
+			       "Detected partial alignments for read " + bam_get_canonical_name(b) + ", which RSEM currently does not support!");
+		++cnt;
+	}
+
+	if (cnt % 1000000 == 0) { printf("."); fflush(stdout); }
+
+	return isPaired ? 2 : 1;
+}
+
 void BamConverter::process() {
-	bam1_t *b, *b2;
-	std::string cqname, qname;
-	bool isPaired = false;
+	int n, size;
+	int carry = 0, carryPos = 0; // the first read of the next batch, already in records[carryPos, carryPos + carry)
+	bool more = true;
 
 	HIT_INT_TYPE cnt = 0;
 
-	cqname = "";
-	b = bam_init1(); b2 = bam_init1();
+	while (more || carry > 0) {
+		starts.clear();
+		n = 0;
+		if (carry > 0) {
+			for (int i = 0; i < carry; i++) { bam1_t *tmp = records[i]; records[i] = records[carryPos + i]; records[carryPos + i] = tmp; }
+			starts.push_back(0);
+			n = carry;
+			carry = 0;
+		}
 
-	while (sam_read1(in, in_header, b) >= 0) {
-		++cnt;
-		isPaired = bam_is_paired(b);
-		if (isPaired) {
-		  assert(sam_read1(in, in_header, b2) >= 0 && bam_is_paired(b2));
-		  if (!bam_is_read1(b)) { bam1_t *tmp = b; b = b2; b2 = tmp; }
-		  assert(bam_is_read1(b) && bam_is_read2(b2));
-		  general_assert((bam_is_mapped(b) && bam_is_mapped(b2)) || (bam_is_unmapped(b) && bam_is_unmapped(b2)), \
-				 "Detected partial alignments for read " + bam_get_canonical_name(b) + ", which RSEM currently does not support!"); 
-		  ++cnt;
+		while (more && (size = readUnit(n, cnt)) > 0) {
+			if (starts.empty() || !bam_same_canonical_name(records[n], records[starts.back()])) {
+				if (n >= BC_BATCH_SIZE) { carry = size; carryPos = n; break; }
+				starts.push_back(n);
+			}
+			n += size;
 		}
+		if (size == 0) more = false;
+		starts.push_back(n);
+
+		if (starts.size() > 1) convertBatch();
+	}
 
-		if (cnt % 1000000 == 0) { printf("."); fflush(stdout); }
+	if (cnt >= 1000000) printf("\n");
 
-		qname = bam_get_canonical_name(b);
+	if (sorter != NULL) sorter->finish();
+}
 
-		if (bam_is_mapped(b)) {
+void* BamConverter::convertReads(void* arg) {
+	Params *params = (Params*)arg;
+	BamConverter *bc = params->bc;
+	CollapseMap collapseMap;
+	bam1_t *b, *b2;
+	bool isPaired;
 
-		  // for collapsing
-		  if (isPaired) general_assert(b->core.tid == b2->core.tid, qname + "'s two mates are aligned to two different transcripts!");
+	for (int i = params->fr; i < params->to; i++) {
+		for (int k = bc->starts[i]; k < bc->starts[i + 1]; k += (isPaired ? 2 : 1)) {
+			b = bc->records[k];
+			isPaired = bam_is_paired(b);
+			b2 = (isPaired ? bc->records[k + 1] : NULL);
 
-		  const Transcript& transcript = transcripts.getTranscriptViaEid(b->core.tid + 1);
+			if (k == bc->starts[i]) collapseMap.init(isPaired);
 
-		  convert(b, transcript);
-		  if (isPaired) {
-		    convert(b2, transcript);
-		    b->core.mpos = b2->core.pos;
-		    b2->core.mpos = b->core.pos;
-		  }
+			if (bam_is_mapped(b)) {
+				// for collapsing
+				if (isPaired) general_assert(b->core.tid == b2->core.tid, bam_get_canonical_name(b) + "'s two mates are aligned to two different transcripts!");
 
-		  if (cqname != qname) {
-		    writeCollapsedLines();
-		    cqname = qname;
-		    collapseMap.init(isPaired);
-		  }
-		  
-		  uint8_t *p = bam_aux_get(b, "ZW");
-		  float prb = (p != NULL? bam_aux2f(p) : 1.0);
-		  collapseMap.insert(b, b2, prb);
-		}
-		else {
-		  
-		  assert(cqname != qname);
-		  
-		  writeCollapsedLines();
-		  cqname = qname;
-		  collapseMap.init(isPaired);
-		  
-		  sam_write1(out, out_header, b);
-		  if (isPaired) sam_write1(out, out_header, b2);
+				int sid = bc->transcripts.getInternalSid(b->core.tid + 1);
+				const Transcript& transcript = bc->transcripts.getTranscriptAt(sid);
+
+				bc->convert(b, sid, transcript);
+				if (isPaired) {
+					bc->convert(b2, sid, transcript);
+					b->core.mpos = b2->core.pos;
+					b2->core.mpos = b->core.pos;
+				}
+
+				uint8_t *p = bam_aux_get(b, "ZW");
+				float prb = (p != NULL? bam_aux2f(p) : 1.0);
+				collapseMap.insert(b, b2, prb);
+			}
+			else {
+				assert(k == bc->starts[i]);
+
+				params->outputs.push_back(b);
+				if (isPaired) params->outputs.push_back(b2);
+			}
 		}
+
+		bc->collectCollapsedLines(collapseMap, *params);
 	}
 
-	writeCollapsedLines();
+	return NULL;
+}
+
+// convert and collapse the reads of the batch, then write them out in order
+void BamConverter::convertBatch() {
+	int nReads = starts.size() - 1;
+	int nt = (nThreads < nReads ? nThreads : nReads);
+	if (nt < 1) nt = 1;
+
+	std::vector<Params> params(nt);
+	for (int i = 0; i < nt; i++) {
+		params[i].bc = this;
+		params[i].fr = (long long)nReads * i / nt;
+		params[i].to = (long long)nReads * (i + 1) / nt;
+	}
 
-	bam_destroy1(b);
-	bam_destroy1(b2);
+	if (nt == 1) convertReads(&params[0]);
+	else {
+		int rc;
+		std::vector<pthread_t> threads(nt);
 
-	if (cnt >= 1000000) printf("\n");
+		for (int i = 0; i < nt; i++) {
+			rc = pthread_create(&threads[i], NULL, convertReads, &params[i]);
+			pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) when converting alignments!");
+		}
+		for (int i = 0; i < nt; i++) {
+			rc = pthread_join(threads[i], NULL);
+			pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) when converting alignments!");
+		}
+	}
+
+	for (int i = 0; i < nt; i++) {
+		for (size_t j = 0; j < params[i].outputs.size(); j++) write(params[i].outputs[j]);
+		for (size_t j = 0; j < params[i].collapsed.size(); j++) bam_destroy1(params[i].collapsed[j]);
+	}
 }
 
-void BamConverter::convert(bam1_t* b, const Transcript& transcript) {
+void BamConverter::convert(bam1_t* b, int sid, const Transcript& transcript) {
 	int pos = b->core.pos;
 	int readlen = b->core.l_qseq;
 
 	general_assert(readlen > 0, "One alignment line has SEQ field as *. RSEM does not support this currently!");
 
-	iter = refmap.find(transcript.getSeqName());
-	assert(iter != refmap.end());
-	b->core.tid = iter->second;
+	b->core.tid = projector->getTid(sid);
 	if (bam_is_paired(b)) { b->core.mtid = b->core.tid; }
 	b->core.qual = 255; // set to not available temporarily
 
@@ -176,7 +298,7 @@ void BamConverter::convert(bam1_t* b, const Transcript& transcript) {
 	data.clear();
 
 	int core_pos, core_n_cigar;
-	tr2chr(transcript, pos + 1, pos + readlen, core_pos, core_n_cigar, data);
+	projector->project(sid, pos + 1, pos + readlen, core_pos, core_n_cigar, data);
 	assert(core_pos >= 0);
 
 	int rest_len = b->l_data - b->core.l_qname - b->core.n_cigar * 4;
@@ -193,7 +315,7 @@ void BamConverter::convert(bam1_t* b, const Transcript& transcript) {
 	modifyTags(b, transcript); // check if need to add XS tag, if need, add it
 }
 
-inline void BamConverter::writeCollapsedLines() {
+inline void BamConverter::collectCollapsedLines(CollapseMap& collapseMap, Params& params) {
 	bam1_t *tmp_b = NULL,*tmp_b2 = NULL;
 	float prb;
 	bool isPaired;
@@ -208,39 +330,32 @@ inline void BamConverter::writeCollapsedLines() {
 			}
 			// otherwise, just use the MAPQ score of the orignal alignment
 
-			sam_write1(out, out_header, tmp_b);
+			params.outputs.push_back(tmp_b);
+			params.collapsed.push_back(tmp_b);
 			if (isPaired) {
 				if (p != NULL) memcpy(bam_aux_get(tmp_b2, "ZW") + 1, (uint8_t*)&(prb), bam_aux_type2size('f'));
 				tmp_b2->core.qual = tmp_b->core.qual;
-				sam_write1(out, out_header, tmp_b2);
+				params.outputs.push_back(tmp_b2);
+				params.collapsed.push_back(tmp_b2);
 			}
-			bam_destroy1(tmp_b);
-			if (isPaired) bam_destroy1(tmp_b2);
 		}
 	}
 }
 
+// Reverse complement a 4-bit encoded sequence a byte at a time; the complement of a 4-bit base code is its bit reversal
 inline void BamConverter::flipSeq(uint8_t* s, int readlen) {
-	uint8_t code, base;
-	std::vector<uint8_t> seq;
-
-	code = 0; base = 0;
-	seq.clear();
-	for (int i = 0; i < readlen; ++i) {
-		switch (bam_seqi(s, readlen - i - 1)) {
-		case 1: base = 8; break;
-		case 2: base = 4; break;
-		case 4: base = 2; break;
-		case 8: base = 1; break;
-		case 15: base = 15; break;
-		default: assert(false);
-		}
-		code |=  base << (4 * (1 - i % 2));
-		if (i % 2 == 1) { seq.push_back(code); code = 0; }
+	int n = (readlen + 1) / 2;
+	uint8_t tmp;
+
+	for (int i = 0, j = n - 1; i <= j; ++i, --j) {
+		tmp = flipTable[s[i]]; s[i] = flipTable[s[j]]; s[j] = tmp;
 	}
-	if (readlen % 2 == 1) { seq.push_back(code); }
 
-	for (int i = 0; i < (int)seq.size(); ++i) s[i] = seq[i];
+	// the padding half byte of an odd length sequence moved to the front, shift it out
+	if (readlen % 2 == 1) {
+		for (int i = 0; i < n - 1; ++i) s[i] = (uint8_t)(s[i] << 4 | s[i + 1] >> 4);
+		s[n - 1] = (uint8_t)(s[n - 1] << 4);
+	}
 }
 
 inline void BamConverter::flipQual(uint8_t* q, int readlen) {
@@ -0,0 +1,334 @@
+#ifndef BAMREADER_H_
+#define BAMREADER_H_
+
+#include<cstring>
+#include<cstdlib>
+#include<pthread.h>
+#include<stdint.h>
+#include<zlib.h>
+
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "htslib/hfile.h"
+
+#include "my_assert.h"
+
+// Fill b's core fields from the 32 bytes following block_len and make room for its variable-length data
+inline int bam_unpack_core(bam1_t* b, int32_t block_len, const uint32_t* x) {
+	bam1_core_t *c = &b->core;
+
+	c->tid = x[0]; c->pos = x[1];
+	c->bin = x[2] >> 16; c->qual = x[2] >> 8 & 0xff; c->l_qname = x[2] & 0xff;
+	c->flag = x[3] >> 16; c->n_cigar = x[3] & 0xffff;
+	c->l_qseq = x[4];
+	c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
+	b->l_data = block_len - 32;
+	if (b->l_data < 0 || c->l_qseq < 0 || c->l_qname < 1) return -4;
+	if ((char*)bam_get_aux(b) - (char*)b->data > b->l_data) return -4;
+	if (b->m_data < b->l_data) {
+		b->m_data = b->l_data;
+		kroundup32(b->m_data);
+		b->data = (uint8_t*)realloc(b->data, b->m_data);
+		if (b->data == NULL) return -4;
+	}
+
+	return 0;
+}
+
+inline void bam_pack_core(const bam1_t* b, uint32_t* x) {
+	const bam1_core_t *c = &b->core;
+
+	x[0] = c->tid; x[1] = c->pos;
+	x[2] = (uint32_t)c->bin << 16 | c->qual << 8 | c->l_qname;
+	x[3] = (uint32_t)c->flag << 16 | c->n_cigar;
+	x[4] = c->l_qseq;
+	x[5] = c->mtid; x[6] = c->mpos; x[7] = c->isize;
+}
+
+/*
+  Whole BAM records kept in memory in the BAM serialization, e.g. a chunk of name-grouped reads
+  handed from the reading thread to a parsing thread.
+ */
+class BamChunk {
+public:
+	BamChunk() : data(NULL), len(0), cap(0), pos(0) {}
+	~BamChunk() { if (data != NULL) free(data); }
+
+	void clear() { len = pos = 0; }
+
+	size_t size() const { return len; }
+
+	void append(const bam1_t* b) {
+		int32_t block_len = b->l_data + 32;
+		uint32_t x[8];
+
+		bam_pack_core(b, x);
+		if (cap < len + 4 + block_len) {
+			cap = (2 * cap > len + 4 + block_len ? 2 * cap : len + 4 + block_len);
+			data = (uint8_t*)realloc(data, cap);
+			general_assert(data != NULL, "Cannot allocate memory for a chunk of alignments!");
+		}
+		memcpy(data + len, &block_len, 4);
+		memcpy(data + len + 4, x, 32);
+		memcpy(data + len + 36, b->data, b->l_data);
+		len += 4 + block_len;
+	}
+
+	// Same return values as sam_read1
+	int read(bam1_t* b) {
+		int32_t block_len;
+		uint32_t x[8];
+
+		if (pos == len) return -1;
+		memcpy(&block_len, data + pos, 4);
+		if (block_len < 32 || len - pos - 4 < size_t(block_len)) return -2;
+		memcpy(x, data + pos + 4, 32);
+		if (bam_unpack_core(b, block_len, x) < 0) return -4;
+		memcpy(b->data, data + pos + 36, b->l_data);
+		pos += 4 + block_len;
+
+		return 4 + block_len;
+	}
+
+private:
+	uint8_t *data;
+	size_t len, cap, pos;
+};
+
+/*
+  How many of the nThreads threads a tool is given by -p inflate its BAM input through BamReader: a quarter of them, and
+  none below 4 threads, where the reading thread inflates the blocks itself. The tool does its own work on the others, so
+  the two together stay within -p.
+ */
+inline int bamReaderThreads(int nThreads) {
+	return nThreads >= 4 ? nThreads / 4 : 0;
+}
+
+/*
+  Reads BAM records like sam_read1, but inflates the BGZF blocks ahead of the caller with worker
+  threads (the bundled htslib only compresses with threads). A worker fetches the next compressed
+  block under ioLock, which keeps the file order, and inflates it outside of any lock into a ring
+  of nSlots slots. The caller consumes the slots strictly in block order, so at most nSlots blocks
+  are in flight at any time.
+
+  The reader must be constructed right after the header is read; it takes over the rest of the
+  BGZF stream, including the part of the current block not consumed by the header. SAM and CRAM
+  input, or nThreads < 1, fall back to sam_read1.
+ */
+class BamReader {
+public:
+	BamReader(samFile* fp, bam_hdr_t* header, int nThreads) : fp(fp), header(header), nThreads(nThreads) {
+		BGZF *bgzf = (fp->format.format == bam ? fp->fp.bgzf : NULL);
+		if (bgzf == NULL || !bgzf->is_compressed || bgzf->is_gzip || bgzf->is_be) this->nThreads = 0;
+		if (this->nThreads <= 0) return;
+
+		hfp = bgzf->fp;
+		nSlots = 4 * this->nThreads;
+		slots = new Slot[nSlots];
+		for (int i = 0; i < nSlots; i++) {
+			slots[i].cdata = new uint8_t[BGZF_MAX_BLOCK_SIZE];
+			slots[i].udata = new uint8_t[BGZF_MAX_BLOCK_SIZE];
+			slots[i].state = FREE;
+		}
+
+		// what is left of the block htslib was reading when the header ended
+		head.ulen = bgzf->block_length - bgzf->block_offset;
+		head.udata = new uint8_t[head.ulen > 0 ? head.ulen : 1];
+		if (head.ulen > 0) memcpy(head.udata, (uint8_t*)bgzf->uncompressed_block + bgzf->block_offset, head.ulen);
+		head.cdata = NULL;
+		cur = &head; pos = 0;
+
+		nextRead = nextUse = 0;
+		eof = stop = failed = ioError = false;
+
+		pthread_mutex_init(&lock, NULL);
+		pthread_mutex_init(&ioLock, NULL);
+		pthread_cond_init(&ready, NULL);
+		pthread_cond_init(&space, NULL);
+
+		threads = new pthread_t[this->nThreads];
+		for (int i = 0; i < this->nThreads; i++) {
+			int rc = pthread_create(&threads[i], NULL, inflateWorker, this);
+			pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) for decompressing the BAM file!");
+		}
+	}
+
+	~BamReader() {
+		if (nThreads <= 0) return;
+
+		pthread_mutex_lock(&lock);
+		stop = true;
+		pthread_cond_broadcast(&space);
+		pthread_mutex_unlock(&lock);
+
+		for (int i = 0; i < nThreads; i++) {
+			int rc = pthread_join(threads[i], NULL);
+			pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) for decompressing the BAM file!");
+		}
+		delete[] threads;
+
+		pthread_mutex_destroy(&lock);
+		pthread_mutex_destroy(&ioLock);
+		pthread_cond_destroy(&ready);
+		pthread_cond_destroy(&space);
+
+		for (int i = 0; i < nSlots; i++) {
+			delete[] slots[i].cdata;
+			delete[] slots[i].udata;
+		}
+		delete[] slots;
+		delete[] head.udata;
+	}
+
+	// Same return values as sam_read1: >= 0 on success, -1 at the end of the file, < -1 on errors
+	int read(bam1_t* b) {
+		if (nThreads <= 0) return sam_read1(fp, header, b);
+
+		bam1_core_t *c = &b->core;
+		int32_t block_len;
+		uint32_t x[8];
+		int ret = readBytes(&block_len, 4);
+
+		if (ret != 4) return (ret == 0 && !failed) ? -1 : -2;
+		if (readBytes(x, 32) != 32) return -3;
+		if (bam_unpack_core(b, block_len, x) < 0) return -4;
+		if (readBytes(b->data, b->l_data) != b->l_data) return -4;
+
+		if (c->tid >= header->n_targets || c->tid < -1 || c->mtid >= header->n_targets || c->mtid < -1) return -3;
+
+		return 4 + block_len;
+	}
+
+private:
+	enum SlotState { FREE, LOADING, READY };
+
+	struct Slot {
+		uint8_t *cdata, *udata; // compressed and inflated block
+		int clen, ulen; // ulen < 0 if the block is corrupted
+		SlotState state;
+	};
+
+	samFile *fp;
+	bam_hdr_t *header;
+	int nThreads;
+
+	hFILE *hfp;
+	int nSlots;
+	Slot *slots, head;
+	Slot *cur; // slot being consumed
+	int pos; // position in cur->udata
+
+	// blocks nextUse .. nextRead - 1 are in the ring; eof is set once no block nextRead exists
+	long long nextRead, nextUse;
+	bool eof, stop, failed, ioError;
+
+	pthread_t *threads;
+	pthread_mutex_t lock, ioLock;
+	pthread_cond_t ready, space;
+
+	// Copy n bytes of the inflated stream to dst, return the number of bytes copied
+	int readBytes(void* dst, int n) {
+		int got = 0;
+		while (got < n) {
+			if (pos == cur->ulen && !nextBlock()) break;
+			int m = (n - got < cur->ulen - pos ? n - got : cur->ulen - pos);
+			memcpy((uint8_t*)dst + got, cur->udata + pos, m);
+			pos += m; got += m;
+		}
+		return got;
+	}
+
+	// Release the current slot and wait for the next inflated block, false at the end of the stream
+	bool nextBlock() {
+		if (failed) return false;
+
+		pthread_mutex_lock(&lock);
+		do {
+			if (cur != &head) {
+				cur->state = FREE;
+				++nextUse;
+				pthread_cond_broadcast(&space);
+			}
+			cur = &slots[nextUse % nSlots];
+			while (!(eof && nextUse == nextRead) && !(nextUse < nextRead && cur->state == READY))
+				pthread_cond_wait(&ready, &lock);
+			if (nextUse == nextRead) { cur = &head; pos = head.ulen; failed = ioError; pthread_mutex_unlock(&lock); return false; }
+			pos = 0;
+		} while (cur->ulen == 0); // skip empty blocks, e.g. the EOF marker
+		pthread_mutex_unlock(&lock);
+
+		if (cur->ulen < 0) { failed = true; return false; }
+		return true;
+	}
+
+	// Read the next compressed block into slot s; 1 on success, 0 at the end of the file, -1 on errors
+	int fetchBlock(Slot& s) {
+		uint8_t *h = s.cdata;
+		ssize_t ret = hread(hfp, h, 18);
+		if (ret == 0) return 0;
+		if (ret != 18) return -1;
+		if (h[0] != 31 || h[1] != 139 || h[2] != 8 || (h[3] & 4) == 0 || (h[10] | h[11] << 8) != 6 || h[12] != 'B' || h[13] != 'C' || (h[14] | h[15] << 8) != 2) return -1;
+		s.clen = (h[16] | h[17] << 8) + 1;
+		if (s.clen < 26) return -1;
+		return hread(hfp, h + 18, s.clen - 18) == s.clen - 18 ? 1 : -1;
+	}
+
+	static int inflateBlock(z_stream& zs, Slot& s) {
+		zs.next_in = s.cdata + 18;
+		zs.avail_in = s.clen - 18;
+		zs.next_out = s.udata;
+		zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+		if (inflateReset(&zs) != Z_OK || inflate(&zs, Z_FINISH) != Z_STREAM_END) return -1;
+
+		const uint8_t *f = s.cdata + s.clen - 4; // ISIZE
+		uLong isize = f[0] | f[1] << 8 | f[2] << 16 | uLong(f[3]) << 24;
+		return zs.total_out == isize ? (int)zs.total_out : -1;
+	}
+
+	static void* inflateWorker(void* arg) {
+		BamReader *r = (BamReader*)arg;
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		bool ok = inflateInit2(&zs, -15) == Z_OK;
+
+		for (;;) {
+			pthread_mutex_lock(&r->ioLock);
+			pthread_mutex_lock(&r->lock);
+			while (!r->stop && !r->eof && r->nextRead - r->nextUse >= r->nSlots) pthread_cond_wait(&r->space, &r->lock);
+			if (r->stop || r->eof) {
+				pthread_mutex_unlock(&r->lock);
+				pthread_mutex_unlock(&r->ioLock);
+				break;
+			}
+			Slot &s = r->slots[r->nextRead % r->nSlots];
+			s.state = LOADING;
+			pthread_mutex_unlock(&r->lock);
+
+			int ret = r->fetchBlock(s);
+
+			pthread_mutex_lock(&r->lock);
+			if (ret > 0) ++r->nextRead;
+			else {
+				r->eof = true;
+				r->ioError = (ret < 0); // reported once the blocks before it are consumed
+				s.state = FREE;
+				pthread_cond_broadcast(&r->ready);
+			}
+			pthread_mutex_unlock(&r->lock);
+			pthread_mutex_unlock(&r->ioLock);
+			if (ret <= 0) break;
+
+			s.ulen = ok ? inflateBlock(zs, s) : -1;
+
+			pthread_mutex_lock(&r->lock);
+			s.state = READY;
+			pthread_cond_broadcast(&r->ready);
+			pthread_mutex_unlock(&r->lock);
+		}
+
+		if (ok) inflateEnd(&zs);
+		return NULL;
+	}
+};
+
+#endif /* BAMREADER_H_ */
@@ -0,0 +1,376 @@
+#ifndef BAMSORTER_H_
+#define BAMSORTER_H_
+
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<string>
+#include<set>
+#include<vector>
+#include<algorithm>
+#include<pthread.h>
+#include<stdint.h>
+
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "htslib/hts.h"
+
+#include "utils.h"
+#include "my_assert.h"
+#include "BamReader.h"
+
+/*
+  Writes a BAM file whose BGZF blocks are compressed by nThreads threads, a batch of blocks at a time. Since the blocks are
+  laid out by the writer itself, the virtual offset of every record is known once its batch is written, and a .bai index is
+  built on the fly for coordinate-sorted output.
+ */
+class BgzfWriter {
+public:
+	BgzfWriter(const char* outF, int nThreads, bool buildIndex) : outF(outF), nThreads(nThreads > 0 ? nThreads : 1), buildIndex(buildIndex) {
+		fo = fopen(outF, "wb");
+		general_assert(fo != NULL, "Cannot create " + this->outF + "!");
+		nBatch = 16 * this->nThreads;
+		blocks.resize(nBatch); cblocks.resize(nBatch); clens.resize(nBatch);
+		for (int i = 0; i < nBatch; i++) cblocks[i] = new uint8_t[BGZF_MAX_BLOCK_SIZE];
+		cur = 0; coffset = 0;
+		idx = NULL;
+	}
+
+	~BgzfWriter() {
+		if (fo != NULL) close();
+		for (int i = 0; i < nBatch; i++) delete[] cblocks[i];
+	}
+
+	void writeHeader(const bam_hdr_t* h) {
+		int32_t len;
+
+		append("BAM\1", 4);
+		append(&h->l_text, 4);
+		append(h->text, h->l_text);
+		append(&h->n_targets, 4);
+		for (int i = 0; i < h->n_targets; i++) {
+			len = strlen(h->target_name[i]) + 1;
+			append(&len, 4);
+			append(h->target_name[i], len);
+			append(&h->target_len[i], 4);
+		}
+		flush(); // records start in a new block, as with htslib
+
+		if (buildIndex) idx = hts_idx_init(h->n_targets, HTS_FMT_BAI, coffset << 16, 14, 5);
+	}
+
+	void write(const bam1_t* b) {
+		int32_t block_len = b->l_data + 32;
+		uint32_t x[8];
+
+		bam_pack_core(b, x);
+		if (blocks[cur].size() > 0 && blocks[cur].size() + 4 + block_len > (size_t)BGZF_BLOCK_SIZE) nextBlock();
+		append(&block_len, 4);
+		append(x, 32);
+		append(b->data, b->l_data);
+
+		if (buildIndex) {
+			Entry entry = { b->core.tid, b->core.pos, bam_endpos(b), !(b->core.flag & BAM_FUNMAP), cur, (int)blocks[cur].size() };
+			entries.push_back(entry);
+		}
+	}
+
+	void close() {
+		static const uint8_t eof[28] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 0x42, 0x43, 2, 0, 0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+		flush();
+		general_assert(fwrite(eof, 1, 28, fo) == 28 && fclose(fo) == 0, "Fail to write " + outF + "!");
+		fo = NULL;
+
+		if (idx != NULL) {
+			hts_idx_finish(idx, coffset << 16);
+			general_assert(hts_idx_save(idx, outF.c_str(), HTS_FMT_BAI) == 0, "Fail to write the index of " + outF + "!");
+			hts_idx_destroy(idx);
+			idx = NULL;
+		}
+	}
+
+private:
+	struct Entry {
+		int tid, beg, end, is_mapped;
+		int block, uoffset; // where the record ends
+	};
+
+	struct Params {
+		BgzfWriter *writer;
+		int id, step; // compress blocks id, id + step, ...
+	};
+
+	std::string outF;
+	FILE *fo;
+	int nThreads, nBatch;
+	bool buildIndex;
+
+	std::vector<std::string> blocks; // uncompressed blocks of the current batch
+	std::vector<uint8_t*> cblocks;
+	std::vector<size_t> clens;
+	int cur; // the block being filled
+	uint64_t coffset; // file offset of the batch
+
+	hts_idx_t *idx;
+	std::vector<Entry> entries; // records of the current batch
+
+	void append(const void* data, size_t len) {
+		const char *p = (const char*)data;
+		while (len > 0) {
+			if (blocks[cur].size() == (size_t)BGZF_BLOCK_SIZE) nextBlock();
+			size_t n = std::min(len, (size_t)BGZF_BLOCK_SIZE - blocks[cur].size());
+			blocks[cur].append(p, n);
+			p += n; len -= n;
+		}
+	}
+
+	void nextBlock() {
+		if (++cur == nBatch) flush();
+	}
+
+	static void* compress(void* arg) {
+		Params *params = (Params*)arg;
+		BgzfWriter *writer = params->writer;
+
+		for (int i = params->id; i < writer->cur; i += params->step) {
+			writer->clens[i] = BGZF_MAX_BLOCK_SIZE;
+			general_assert(bgzf_compress(writer->cblocks[i], &writer->clens[i], writer->blocks[i].data(), writer->blocks[i].size(), -1) == 0, "Fail to compress a BGZF block!");
+		}
+
+		return NULL;
+	}
+
+	// compress and write out the blocks of the batch, then index its records
+	void flush() {
+		if (cur < nBatch && blocks[cur].size() > 0) ++cur;
+		if (cur == 0) return;
+
+		if (nThreads == 1 || cur == 1) {
+			Params params = { this, 0, 1 };
+			compress(&params);
+		}
+		else {
+			int rc;
+			std::vector<pthread_t> threads(nThreads);
+			std::vector<Params> params(nThreads);
+			for (int i = 0; i < nThreads; i++) {
+				params[i].writer = this; params[i].id = i; params[i].step = nThreads;
+				rc = pthread_create(&threads[i], NULL, compress, &params[i]);
+				pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) when compressing " + outF + "!");
+			}
+			for (int i = 0; i < nThreads; i++) {
+				rc = pthread_join(threads[i], NULL);
+				pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) when compressing " + outF + "!");
+			}
+		}
+
+		std::vector<uint64_t> offsets(cur + 1);
+		for (int i = 0; i < cur; i++) {
+			offsets[i] = coffset;
+			general_assert(fwrite(cblocks[i], 1, clens[i], fo) == clens[i], "Fail to write " + outF + "!");
+			coffset += clens[i];
+		}
+		offsets[cur] = coffset;
+
+		// a record ending its block ends at the start of the next block, as htslib reports it; seeking to the end of a block reads EOF
+		for (size_t i = 0; i < entries.size(); i++) {
+			const Entry& e = entries[i];
+			uint64_t voffset = (e.uoffset == (int)blocks[e.block].size() ? offsets[e.block + 1] << 16 : offsets[e.block] << 16 | e.uoffset);
+			general_assert(hts_idx_push(idx, e.tid, e.beg, e.end, voffset, e.is_mapped) == 0, outF + " is not sorted by coordinate!");
+		}
+		entries.clear();
+
+		for (int i = 0; i < cur; i++) blocks[i].clear();
+
+		cur = 0;
+	}
+};
+
+/*
+  Sorts BAM records by coordinate with bounded memory, in the order of 'samtools sort': by tid with unmapped records last,
+  then position, then strand, keeping the input order otherwise. Records are buffered until they take up maxMem bytes; a full
+  buffer is sorted and written to a temporary BAM file (compressed by htslib's threads), and the files are merged at the end,
+  at most MAX_MERGE at a time so that the number of open files stays bounded. The output is written by BgzfWriter together
+  with its .bai index. Temporary files left behind by an error are removed at exit.
+ */
+class BamSorter {
+public:
+	BamSorter(const char* outF, bam_hdr_t* header, size_t maxMem, int nThreads) : outF(outF), header(header), maxMem(maxMem), nThreads(nThreads) {
+		mem = 0;
+		nRuns = 0;
+
+		static bool registered = false;
+		if (!registered) {
+			liveRuns(); // constructed before the handler is registered, so it is still alive when the handler runs
+			atexit(removeLiveRuns);
+			registered = true;
+		}
+	}
+
+	~BamSorter() {
+		for (size_t i = 0; i < buffer.size(); i++) bam_destroy1(buffer[i].b);
+		for (size_t i = 0; i < runs.size(); i++) removeRun(runs[i]);
+	}
+
+	void add(const bam1_t* b) {
+		Item item = { getKey(b), bam_dup1(b) };
+		buffer.push_back(item);
+		mem += sizeof(bam1_t) + item.b->m_data + sizeof(Item);
+		if (mem >= maxMem) writeRun();
+	}
+
+	void finish() {
+		BgzfWriter writer(outF.c_str(), nThreads, true);
+
+		writer.writeHeader(header);
+		std::stable_sort(buffer.begin(), buffer.end());
+
+		if (nRuns == 0) {
+			for (size_t i = 0; i < buffer.size(); i++) writer.write(buffer[i].b);
+		}
+		else {
+			if (!buffer.empty()) writeRun();
+
+			// merge runs MAX_MERGE at a time until one pass is left, consecutive runs are merged to keep the sort stable
+			while ((int)runs.size() > MAX_MERGE) {
+				std::vector<int> merged;
+				for (size_t i = 0; i < runs.size(); i += MAX_MERGE) {
+					size_t j = std::min(runs.size(), i + MAX_MERGE);
+					if (j - i == 1) { merged.push_back(runs[i]); continue; }
+					int id = nRuns++;
+					samFile *fo = openRun(id);
+					merge(std::vector<int>(runs.begin() + i, runs.begin() + j), fo, NULL);
+					sam_close(fo);
+					merged.push_back(id);
+				}
+				runs.swap(merged);
+			}
+			merge(runs, NULL, &writer);
+			runs.clear();
+		}
+
+		writer.close();
+	}
+
+private:
+	struct Item {
+		uint64_t key;
+		bam1_t *b;
+
+		bool operator< (const Item& o) const { return key < o.key; }
+	};
+
+	// a record from the id-th run being merged, ordered by key and then by id (the input order) on the heap
+	struct HeapItem {
+		uint64_t key;
+		int id;
+
+		bool operator< (const HeapItem& o) const { return key > o.key || (key == o.key && id > o.id); }
+	};
+
+	static const int MAX_MERGE = 32; // most runs open at once, leaving room for other files under a low descriptor limit
+
+	std::string outF;
+	bam_hdr_t *header;
+	size_t maxMem, mem;
+	int nThreads, nRuns;
+	std::vector<Item> buffer;
+	std::vector<int> runs; // runs not merged yet, in input order
+
+	static std::set<std::string>& liveRuns() {
+		static std::set<std::string> names;
+		return names;
+	}
+
+	static void removeLiveRuns() {
+		for (std::set<std::string>::iterator it = liveRuns().begin(); it != liveRuns().end(); ++it) remove(it->c_str());
+		liveRuns().clear();
+	}
+
+	static uint64_t getKey(const bam1_t* b) {
+		return (uint64_t)b->core.tid << 32 | (uint32_t)(b->core.pos + 1) << 1 | bam_is_rev(b);
+	}
+
+	std::string getRunName(int id) {
+		char name[STRLEN];
+		sprintf(name, "%s.tmp.%04d.bam", outF.c_str(), id);
+		return name;
+	}
+
+	samFile* openRun(int id) {
+		std::string runF = getRunName(id);
+		liveRuns().insert(runF);
+		samFile *fo = sam_open(runF.c_str(), "wb1");
+		general_assert(fo != NULL, "Cannot create " + runF + "!");
+		if (nThreads > 1) general_assert(hts_set_threads(fo, nThreads) == 0, "Fail to create threads for writing " + runF + "!");
+		sam_hdr_write(fo, header);
+		return fo;
+	}
+
+	void removeRun(int id) {
+		std::string runF = getRunName(id);
+		remove(runF.c_str());
+		liveRuns().erase(runF);
+	}
+
+	void writeRun() {
+		runs.push_back(nRuns);
+		samFile *fo = openRun(nRuns++);
+
+		std::stable_sort(buffer.begin(), buffer.end());
+		for (size_t i = 0; i < buffer.size(); i++) {
+			sam_write1(fo, header, buffer[i].b);
+			bam_destroy1(buffer[i].b);
+		}
+		sam_close(fo);
+
+		buffer.clear();
+		mem = 0;
+	}
+
+	// merge the runs ids into the run fo or into writer, then remove them
+	void merge(const std::vector<int>& ids, samFile* fo, BgzfWriter* writer) {
+		int n = ids.size();
+		std::vector<samFile*> fis(n);
+		std::vector<bam_hdr_t*> headers(n);
+		std::vector<bam1_t*> records(n);
+		std::vector<HeapItem> heap;
+
+		for (int i = 0; i < n; i++) {
+			std::string runF = getRunName(ids[i]);
+			fis[i] = sam_open(runF.c_str(), "r");
+			general_assert(fis[i] != NULL, "Cannot open " + runF + "!");
+			headers[i] = sam_hdr_read(fis[i]);
+			records[i] = bam_init1();
+			if (sam_read1(fis[i], headers[i], records[i]) >= 0) {
+				HeapItem item = { getKey(records[i]), i };
+				heap.push_back(item);
+			}
+		}
+		std::make_heap(heap.begin(), heap.end());
+
+		while (!heap.empty()) {
+			std::pop_heap(heap.begin(), heap.end());
+			int id = heap.back().id;
+			heap.pop_back();
+
+			if (writer != NULL) writer->write(records[id]);
+			else general_assert(sam_write1(fo, header, records[id]) >= 0, "Fail to write a temporary file of " + outF + "!");
+			if (sam_read1(fis[id], headers[id], records[id]) >= 0) {
+				HeapItem item = { getKey(records[id]), id };
+				heap.push_back(item);
+				std::push_heap(heap.begin(), heap.end());
+			}
+		}
+
+		for (int i = 0; i < n; i++) {
+			bam_destroy1(records[i]);
+			bam_hdr_destroy(headers[i]);
+			sam_close(fis[i]);
+			removeRun(ids[i]);
+		}
+	}
+};
+
+#endif /* BAMSORTER_H_ */
@@ -8,11 +8,14 @@
 #include<string>
 #include<sstream>
 #include<iostream>
+#include<vector>
+#include<pthread.h>
 
 #include <stdint.h>
 #include "htslib/sam.h"
 #include "sam_utils.h"
 #include "SamHeader.hpp"
+#include "BamReader.h"
 
 #include "utils.h"
 #include "my_assert.h"
@@ -24,6 +27,13 @@
 #include "Transcript.h"
 #include "Transcripts.h"
 
+/*
+  The input is handled in batches of BAM_BATCH_SIZE records: the batch is decoded (in parallel by BamReader), the hit of each
+  mapped record is looked up sequentially, nThreads threads then annotate disjoint ranges of the batch, and the batch is written
+  out in order, compressed by htslib's writing threads.
+ */
+const int BAM_BATCH_SIZE = 1 << 16; // must be even, so that a batch always holds whole pairs
+
 class BamWriter {
 public:
 	BamWriter(const char* inpF, const char* aux, const char* outF, Transcripts& transcripts, int nThreads);
@@ -32,10 +42,39 @@ public:
 	void work(HitWrapper<SingleHit> wrapper);
 	void work(HitWrapper<PairedEndHit> wrapper);
 private:
+	template<class HitType>
+	struct Params {
+		BamWriter *writer;
+		HitType **hits;
+		int fr, to;
+	};
+
 	samFile *in, *out;
 	bam_hdr_t *in_header, *out_header;
+	BamReader *reader;
 	Transcripts& transcripts;
-	
+	int nThreads;
+
+	bam1_t *records[BAM_BATCH_SIZE];
+	HIT_INT_TYPE cnt;
+
+	template<class HitType>
+	static void* annotate(void* arg) {
+		Params<HitType> *params = (Params<HitType>*)arg;
+		BamWriter *writer = params->writer;
+
+		for (int i = params->fr; i < params->to; i++)
+			if (params->hits[i] != NULL) {
+				assert(writer->transcripts.getInternalSid(writer->records[i]->core.tid + 1) == params->hits[i]->getSid());
+				writer->set_alignment_weight(writer->records[i], params->hits[i]->getConPrb());
+			}
+
+		return NULL;
+	}
+
+	template<class HitType>
+	void writeBatch(int n, HitType** hits);
+
 	void set_alignment_weight(bam1_t *b, double prb) {
 	  b->core.qual = bam_prb_to_mapq(prb);
 	  float val = (float)prb;
@@ -69,79 +108,98 @@ BamWriter::BamWriter(const char* inpF, const char* aux, const char* outF, Transc
   assert(out != 0);
   sam_hdr_write(out, out_header);
     
-  if (nThreads > 1) general_assert(hts_set_threads(out, nThreads) == 0, "Fail to create threads for writing the BAM file!");
+  int nInflate = bamReaderThreads(nThreads);
+  this->nThreads = nThreads - nInflate;
+  if (this->nThreads > 1) general_assert(hts_set_threads(out, this->nThreads) == 0, "Fail to create threads for writing the BAM file!");
+
+  reader = new BamReader(in, in_header, nInflate);
+  for (int i = 0; i < BAM_BATCH_SIZE; i++) records[i] = bam_init1();
 }
 
 BamWriter::~BamWriter() {
+	for (int i = 0; i < BAM_BATCH_SIZE; i++) bam_destroy1(records[i]);
+	delete reader;
 	bam_hdr_destroy(in_header);
 	sam_close(in);
 	bam_hdr_destroy(out_header);
 	sam_close(out);
 }
 
-void BamWriter::work(HitWrapper<SingleHit> wrapper) {
-	bam1_t *b;
-	SingleHit *hit;
-
-	HIT_INT_TYPE cnt = 0;
-
-	b = bam_init1();
+// annotate the first n records of the batch and write them out
+template<class HitType>
+void BamWriter::writeBatch(int n, HitType** hits) {
+	if (nThreads <= 1 || n < nThreads) {
+		Params<HitType> params = { this, hits, 0, n };
+		annotate<HitType>(&params);
+	}
+	else {
+		int rc;
+		std::vector<pthread_t> threads(nThreads);
+		std::vector<Params<HitType> > params(nThreads);
+
+		for (int i = 0; i < nThreads; i++) {
+			params[i].writer = this;
+			params[i].hits = hits;
+			params[i].fr = (long long)n * i / nThreads;
+			params[i].to = (long long)n * (i + 1) / nThreads;
+			rc = pthread_create(&threads[i], NULL, annotate<HitType>, &params[i]);
+			pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) when annotating the BAM file!");
+		}
+		for (int i = 0; i < nThreads; i++) {
+			rc = pthread_join(threads[i], NULL);
+			pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) when annotating the BAM file!");
+		}
+	}
 
-	while (sam_read1(in, in_header, b) >= 0) {
-		++cnt;
-		if (verbose && cnt % 1000000 == 0) { std::cout<< cnt<< " alignment lines are loaded!"<< std::endl; }
+	for (int i = 0; i < n; i++) sam_write1(out, out_header, records[i]);
 
-		if (bam_is_mapped(b)) {
-		  hit = wrapper.getNextHit();
-		  assert(hit != NULL);
+	HIT_INT_TYPE prev = cnt;
+	cnt += n;
+	if (verbose)
+		for (HIT_INT_TYPE k = prev / 1000000 + 1; k <= cnt / 1000000; k++) { std::cout<< k * 1000000<< " alignment lines are loaded!"<< std::endl; }
+}
 
-		  assert(transcripts.getInternalSid(b->core.tid + 1) == hit->getSid());
-		  set_alignment_weight(b, hit->getConPrb());
+void BamWriter::work(HitWrapper<SingleHit> wrapper) {
+	std::vector<SingleHit*> hits(BAM_BATCH_SIZE);
+	int n;
+
+	cnt = 0;
+	do {
+		for (n = 0; n < BAM_BATCH_SIZE && reader->read(records[n]) >= 0; n++) {
+			hits[n] = NULL;
+			if (bam_is_mapped(records[n])) {
+				hits[n] = wrapper.getNextHit();
+				assert(hits[n] != NULL);
+			}
 		}
-		sam_write1(out, out_header, b);
-	}
+		writeBatch(n, &hits[0]);
+	} while (n == BAM_BATCH_SIZE);
 
 	assert(wrapper.getNextHit() == NULL);
 
-	bam_destroy1(b);
 	if (verbose) { std::cout<< "Bam output file is generated!"<< std::endl; }
 }
 
 void BamWriter::work(HitWrapper<PairedEndHit> wrapper) {
-	bam1_t *b, *b2;
-	PairedEndHit *hit;
-
-	HIT_INT_TYPE cnt = 0;
-
-	b = bam_init1();
-	b2 = bam_init1();
-
-	while (sam_read1(in, in_header, b) >= 0 && sam_read1(in, in_header, b2) >= 0) {
-		cnt += 2;
-		if (verbose && cnt % 1000000 == 0) { std::cout<< cnt<< " alignment lines are loaded!"<< std::endl; }
-
-		if (!bam_is_read1(b)) { bam1_t * tmp = b; b = b2; b2 = tmp; }
-		
-		if (bam_is_mapped(b) && bam_is_mapped(b2)) {
-			hit = wrapper.getNextHit();
-			assert(hit != NULL);
-
-			assert(transcripts.getInternalSid(b->core.tid + 1) == hit->getSid());
-			assert(transcripts.getInternalSid(b2->core.tid + 1) == hit->getSid());
-
-			set_alignment_weight(b, hit->getConPrb());
-			set_alignment_weight(b2, hit->getConPrb());
+	std::vector<PairedEndHit*> hits(BAM_BATCH_SIZE);
+	int n;
+
+	cnt = 0;
+	do {
+		for (n = 0; n < BAM_BATCH_SIZE && reader->read(records[n]) >= 0 && reader->read(records[n + 1]) >= 0; n += 2) {
+			if (!bam_is_read1(records[n])) { bam1_t *tmp = records[n]; records[n] = records[n + 1]; records[n + 1] = tmp; }
+
+			hits[n] = hits[n + 1] = NULL;
+			if (bam_is_mapped(records[n]) && bam_is_mapped(records[n + 1])) {
+				hits[n] = hits[n + 1] = wrapper.getNextHit();
+				assert(hits[n] != NULL);
+			}
 		}
-
-		sam_write1(out, out_header, b);
-		sam_write1(out, out_header, b2);
-	}
+		writeBatch(n, &hits[0]);
+	} while (n == BAM_BATCH_SIZE);
 
 	assert(wrapper.getNextHit() == NULL);
 
-	bam_destroy1(b);
-	bam_destroy1(b2);
-
 	if (verbose) { std::cout<< "Bam output file is generated!"<< std::endl; }
 }
 
@@ -2,82 +2,109 @@
 #define BUFFER_H_
 
 #include<cstdio>
-#include<fstream>
-#include<pthread.h>
+#include<cstring>
+#include<cerrno>
+#include<unistd.h>
 
 #include "my_assert.h"
 
 typedef unsigned long long bufsize_type;
 const int FLOATSIZE = sizeof(float);
-
+const bufsize_type TILESIZE = 1 << 18; // floats in a transposition tile, 1MB
+
+/*
+  The temporary file is transcript-major: row i holds the nSamples values of transcript i.
+  Each sampling thread owns one Buffer and a fixed range of sample columns [start, start + nWrite),
+  so buffers never share state and need no lock. A flush transposes the buffered sample-major
+  vectors tile by tile and writes each transcript's run of columns with a single pwrite.
+ */
 class Buffer {
 public:
 	// in_mem_arr must be allocated memory before the Buffer is constructed
-	Buffer(int nMB, int nSamples, int vlen, float* in_mem_arr, const char* tmpF) {
+	// fd must be opened for writing and is shared by all Buffers of the same temporary file
+	Buffer(int nMB, int nSamples, int vlen, int start, int nWrite, float* in_mem_arr, int fd) {
 		cpos = 0;
 		size = bufsize_type(nMB) * 1024 * 1024 / FLOATSIZE / vlen;
-		if (size > (bufsize_type)nSamples) size = nSamples;
+		if (size > (bufsize_type)nWrite) size = nWrite;
 		general_assert(size > 0, "Memory allocated for credibility intervals is not enough!");
 		size *= vlen;
 
 		buffer = new float[size];
-		ftmpOut.open(tmpF, std::ios::binary);
-		pthread_mutex_init(&lock, NULL);
+		tile = new float[size / vlen > TILESIZE ? size / vlen : TILESIZE];
 
-		fr = to = 0;
+		fr = to = start;
+		end = start + nWrite;
 		this->nSamples = nSamples;
 		this->vlen = vlen;
 		this->in_mem_arr = in_mem_arr;
+		this->fd = fd;
 	}
 
 	~Buffer() {
 		if (fr < to) flushToTempFile();
 
 		delete[] buffer;
-		pthread_mutex_destroy(&lock);
-		ftmpOut.close();
+		delete[] tile;
 	}
 
 	void write(float value, float *vec) {
-		pthread_assert(pthread_mutex_lock(&lock), "pthread_mutex_lock", "Error occurred while acquiring the lock!");
+		general_assert(to < end, "More samples are generated than expected in the credibility interval calculation!");
 		if (size - cpos < bufsize_type(vlen)) flushToTempFile();
 		in_mem_arr[to] = value;
 		memcpy(buffer + cpos, vec, FLOATSIZE * vlen);
 		cpos += vlen;
 		++to;
-		pthread_assert(pthread_mutex_unlock(&lock), "pthread_mutex_unlock", "Error occurred while releasing the lock!");
 	}
 
 private:
 	bufsize_type size, cpos; // cpos : current position
 
-	float *buffer;
+	float *buffer, *tile;
 	float *in_mem_arr;
-	std::ofstream ftmpOut;
-	pthread_mutex_t lock;
+	int fd;
 
-	int fr, to; // each flush, sample fr .. to - 1
+	int fr, to, end; // each flush, sample fr .. to - 1; this buffer owns samples up to end - 1
 	int nSamples, vlen; // vlen : vector length
 
 	void flushToTempFile() {
-		std::streampos gap1 = std::streampos(fr) * FLOATSIZE;
-		std::streampos gap2 = std::streampos(nSamples - to) * FLOATSIZE;
-		float *p = NULL;
-
-		ftmpOut.seekp(0, std::ios::beg);
-		for (int i = 0; i < vlen; i++) {
-			p = buffer + i;
-			ftmpOut.seekp(gap1, std::ios::cur);
-			for (int j = fr; j < to; j++) {
-				ftmpOut.write((char*)p, FLOATSIZE);
-				p += vlen;
+		int ncol = to - fr;
+		int nrow = TILESIZE / ncol; // number of transcripts per tile
+		if (nrow < 1) nrow = 1;
+		if (nrow > vlen) nrow = vlen;
+
+		for (int r = 0; r < vlen; r += nrow) {
+			int nr = (vlen - r < nrow ? vlen - r : nrow);
+
+			// transpose the [r, r + nr) x [fr, to) block, reading the buffer row by row
+			for (int j = 0; j < ncol; j++) {
+				const float *p = buffer + bufsize_type(j) * vlen + r;
+				float *q = tile + j;
+				for (int i = 0; i < nr; i++, q += ncol) *q = p[i];
 			}
-			ftmpOut.seekp(gap2, std::ios::cur);
+
+			if (ncol == nSamples) writeAt(tile, bufsize_type(nr) * ncol, bufsize_type(r) * nSamples);
+			else
+				for (int i = 0; i < nr; i++)
+					writeAt(tile + bufsize_type(i) * ncol, ncol, bufsize_type(r + i) * nSamples + fr);
 		}
 
 		cpos = 0;
 		fr = to;
 	}
+
+	// write n floats starting at float offset pos of the temporary file
+	void writeAt(const float *p, bufsize_type n, bufsize_type pos) {
+		const char *data = (const char*)p;
+		size_t left = n * FLOATSIZE;
+		off_t offset = off_t(pos * FLOATSIZE);
+
+		while (left > 0) {
+			ssize_t ret = pwrite(fd, data, left, offset);
+			if (ret < 0 && errno == EINTR) continue;
+			general_assert(ret > 0, "Cannot write to the temporary file for credibility intervals!");
+			data += ret; left -= ret; offset += ret;
+		}
+	}
 };
 
 #endif /* BUFFER_H_ */
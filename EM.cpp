@@ -36,7 +36,6 @@
 #include "Refs.h"
 #include "GroupInfo.h"
 #include "HitContainer.h"
-#include "ReadIndex.h"
 #include "ReadReader.h"
 
 #include "ModelParams.h"
@@ -104,19 +103,13 @@ void init(ReadReader<ReadType> **&readers, HitContainer<HitType> **&hitvs, doubl
 	HIT_INT_TYPE nhT; // nhT : hit threshold per thread
 	char datF[STRLEN];
 
-	int s;
-	char readFs[2][STRLEN];
-	ReadIndex *indices[2];
+	char readF[STRLEN];
 	ifstream fin;
 
 	readers = new ReadReader<ReadType>*[nThreads];
-	genReadFileNames(imdName, 1, read_type, s, readFs);
-	for (int i = 0; i < s; i++) {
-		indices[i] = new ReadIndex(readFs[i]);
-	}
+	genReadFileName(imdName, 1, readF);
 	for (int i = 0; i < nThreads; i++) {
-		readers[i] = new ReadReader<ReadType>(s, readFs, refs.hasPolyA(), mparams.seedLen); // allow calculation of calc_lq() function
-		readers[i]->setIndices(indices);
+		readers[i] = new ReadReader<ReadType>(readF, refs.hasPolyA(), mparams.seedLen); // allow calculation of calc_lq() function
 	}
 
 	hitvs = new HitContainer<HitType>*[nThreads];
@@ -141,7 +134,7 @@ void init(ReadReader<ReadType> **&readers, HitContainer<HitType> **&hitvs, doubl
 	for (int i = 0; i < nThreads; i++) {
 		HIT_INT_TYPE ntLeft = nThreads - i - 1; // # of threads left
 
-		general_assert(readers[i]->locate(curnr), "Read indices files do not match!");
+		general_assert(readers[i]->locate(curnr), "Read file does not match the .dat file!");
 
 		while (nrLeft > ntLeft && (i == nThreads - 1 || hitvs[i]->getNHits() < nhT)) {
 			general_assert(hitvs[i]->read(fin), "Cannot read alignments from .dat file!");
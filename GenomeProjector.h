@@ -0,0 +1,119 @@
+#ifndef GENOMEPROJECTOR_H_
+#define GENOMEPROJECTOR_H_
+
+#include<cassert>
+#include<string>
+#include<vector>
+#include<map>
+#include<algorithm>
+#include<stdint.h>
+
+#include "htslib/sam.h"
+
+#include "utils.h"
+#include "my_assert.h"
+#include "Transcript.h"
+#include "Transcripts.h"
+
+/*
+  Projects transcript coordinates onto the genome. For every transcript, built once from the .ti information, it keeps the
+  genome tid of its chromosome and, in a flat array shared by all transcripts, the genomic start of each exon and the prefix
+  sums of the exon lengths. The exon holding a position is then found by binary search over the prefix sums, and the CIGAR
+  is emitted from the exons an alignment spans.
+ */
+class GenomeProjector {
+public:
+	// header, the genome BAM header whose target ids are used
+	GenomeProjector(Transcripts& transcripts, const bam_hdr_t* header) {
+		std::map<std::string, int> refmap;
+		std::map<std::string, int>::iterator iter;
+
+		for (int i = 0; i < header->n_targets; ++i) refmap[header->target_name[i]] = i;
+
+		int M = transcripts.getM();
+		tids.assign(M + 1, -1); strands.assign(M + 1, 0); firsts.assign(M + 2, 0);
+		starts.clear(); cums.clear();
+
+		for (int sid = 1; sid <= M; ++sid) {
+			const Transcript& transcript = transcripts.getTranscriptAt(sid);
+			const std::vector<Interval>& structure = transcript.getStructure();
+
+			iter = refmap.find(transcript.getSeqName());
+			general_assert(iter != refmap.end(), "Chromosome " + transcript.getSeqName() + " of transcript " + transcript.getTranscriptID() + " is not in the chromosome list!");
+			tids[sid] = iter->second;
+			strands[sid] = transcript.getStrand();
+
+			firsts[sid] = cums.size();
+			cums.push_back(0);
+			for (size_t i = 0; i < structure.size(); ++i) {
+				starts.push_back(structure[i].start - 1);
+				cums.push_back(cums.back() + structure[i].end - structure[i].start + 1);
+			}
+			starts.push_back(-1); // keeps starts parallel to cums
+		}
+		firsts[M + 1] = cums.size();
+	}
+
+	int getTid(int sid) const { return tids[sid]; }
+
+	/*
+	  Project transcript interval [sp, ep] (1-based, on the transcript's strand) of transcript sid onto the genome.
+	  pos, 0-based genomic start; the CIGAR operations are appended to data. Bases beyond the transcript (poly(A) tails)
+	  become insertions.
+	 */
+	void project(int sid, int sp, int ep, int& pos, int& n_cigar, std::vector<uint32_t>& data) const {
+		int s = firsts[sid + 1] - firsts[sid] - 1; // number of exons
+		const int *cum = &cums[firsts[sid]]; // cum[i], total length of the first i exons
+		const int *start = &starts[firsts[sid]]; // start[i], 0-based genomic start of exon i
+		int length = cum[s];
+
+		if (strands[sid] == '-') {
+			int tmp = sp;
+			sp = length - ep + 1;
+			ep = length - tmp + 1;
+		}
+
+		n_cigar = 0;
+
+		if (ep < 1 || sp > length) { // a read which align to polyA tails totally!
+			pos = (sp > length ? start[s - 1] + cum[s] - cum[s - 1] : start[0]);
+			push(data, n_cigar, ep - sp + 1, BAM_CINS);
+			return;
+		}
+
+		if (sp < 1) {
+			push(data, n_cigar, 1 - sp, BAM_CINS);
+			sp = 1;
+		}
+
+		// i, the exon containing sp
+		int i = std::lower_bound(cum + 1, cum + s + 1, sp) - cum - 1;
+		assert(i < s);
+		pos = start[i] + (sp - cum[i] - 1);
+
+		// exons ending before ep, each followed by an intron
+		while (i < s && cum[i + 1] < ep) {
+			push(data, n_cigar, cum[i + 1] - sp + 1, BAM_CMATCH);
+			++i;
+			if (i >= s) break;
+			push(data, n_cigar, start[i] - (start[i - 1] + cum[i] - cum[i - 1]), BAM_CREF_SKIP);
+			sp = cum[i] + 1;
+		}
+
+		if (i >= s) push(data, n_cigar, ep - length, BAM_CINS);
+		else push(data, n_cigar, ep - sp + 1, BAM_CMATCH);
+	}
+
+private:
+	std::vector<int> tids; // genome tid of each transcript
+	std::vector<char> strands;
+	std::vector<int> firsts; // firsts[sid], where the entries of transcript sid begin in starts and cums
+	std::vector<int> starts, cums; // per transcript, the exon starts padded by one entry and the s + 1 prefix sums of exon lengths
+
+	static void push(std::vector<uint32_t>& data, int& n_cigar, int len, int op) {
+		data.push_back((uint32_t)len << BAM_CIGAR_SHIFT | op);
+		++n_cigar;
+	}
+};
+
+#endif /* GENOMEPROJECTOR_H_ */
@@ -225,7 +225,7 @@ void init() {
 		sprintf(outF, "%s%d", cvsF, i);
 		paramsArray[i].fo = fopen(outF, "w");
 
-		paramsArray[i].engine = engineFactory::new_engine();
+		paramsArray[i].engine = engineFactory::new_engine(i); // chain i always uses stream i
 		paramsArray[i].pme_c = new double[M + 1];
 		memset(paramsArray[i].pme_c, 0, sizeof(double) * (M + 1));
 		paramsArray[i].pve_c = new double[M + 1];
@@ -244,7 +244,6 @@ void init() {
 		  memset(paramsArray[i].pve_c_trans, 0, sizeof(double) * m_trans);
 		}
 	}
-	engineFactory::finish();
 
 	/* set thread attribute to be joinable */
 	pthread_attr_init(&attr);
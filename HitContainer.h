@@ -90,18 +90,16 @@ void HitContainer<HitType>::write(std::ostream& out) {
 	}
 }
 
+// A read is a multi-gene read if any of its hits falls outside the gene of its first hit
 template<class HitType>
 READ_INT_TYPE HitContainer<HitType>::calcNumGeneMultiReads(const GroupInfo& gi) {
 	READ_INT_TYPE res = 0;
-	int *sortgids = NULL;
 
 	for (READ_INT_TYPE i = 0; i < n; i++) {
-		HIT_INT_TYPE num = s[i + 1] - s[i];
-		sortgids = new int[num];
-		for (HIT_INT_TYPE j = s[i]; j < s[i + 1]; j++) sortgids[j] = gi.gidAt(hits[j].getSid());
-		std::sort(sortgids, sortgids + num);
-		if (std::unique(sortgids, sortgids + num) - sortgids > 1) ++res;
-		delete[] sortgids;
+		int gid = gi.gidAt(hits[s[i]].getSid());
+		HIT_INT_TYPE j = s[i] + 1;
+		while (j < s[i + 1] && gi.gidAt(hits[j].getSid()) == gid) ++j;
+		if (j < s[i + 1]) ++res;
 	}
 
 	return res;
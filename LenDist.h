@@ -84,12 +84,16 @@ public:
 
 	void copyTo(double*&, double*&, int&, int&, int&) const;
 	
+	void startSimulation();
 	int simulate(simul*, int);
+	void finishSimulation();
 	
  private:
 	int lb, ub, span; // (lb, ub]
 	double *pdf, *cdf;
 
+	AliasTable table; // for simulation, over lengths lb + 1 .. ub
+
 	void trim();
 };
 
@@ -251,17 +255,32 @@ void LenDist::copyTo(double*& pdf, double*& cdf, int& lb, int& ub, int& span) co
 	memcpy(cdf, this->cdf, sizeof(double) * (span + 1));
 }
 
+void LenDist::startSimulation() {
+	table.build(pdf + 1, span);
+}
+
 //refL = -1 means that this length is generated for noise isoform
+//A length is drawn from the alias table and redrawn while it exceeds refL, which samples the truncated distribution
+//exactly; if less than half of the mass is kept, a binary search over cdf is expected to be cheaper.
 int LenDist::simulate(simul* sampler, int refL) {
 	int dlen;
 
 	if (refL == -1) refL = ub;
 	if (refL <= lb || cdf[(dlen = std::min(ub, refL) - lb)] <= 0.0) return -1;
-	int len = lb + 1 + sampler->sample(cdf + 1, dlen);
+	if (cdf[dlen] < 0.5 * cdf[span]) return lb + 1 + sampler->sample(cdf + 1, dlen);
+
+	int len;
+	do {
+		len = lb + 1 + table.sample(sampler);
+	} while (len > refL);
 
 	return len;
 }
 
+void LenDist::finishSimulation() {
+	table = AliasTable();
+}
+
 void LenDist::trim() {
   int newlb, newub;
   double *newpdf, *newcdf;
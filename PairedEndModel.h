@@ -194,8 +194,8 @@ public:
 
 	const LenDist& getGLD() { return *gld; }
 
-	void startSimulation(simul*, const std::vector<double>&);
-	bool simulate(READ_INT_TYPE, PairedEndRead&, int&);
+	void startSimulation(const std::vector<double>&);
+	bool simulate(simul*, READ_INT_TYPE, PairedEndRead&, int&);
 	void finishSimulation();
 
 	//Use it after function 'read' or 'estimateFromReads'
@@ -224,8 +224,7 @@ private:
 	Profile *pro;
 	NoiseProfile *npro;
 
-	simul *sampler; // for simulation
-	double *theta_cdf; // for simulation
+	AliasTable thetaTable; // for simulation
 
 	double *mw; // for masking
 
@@ -233,8 +232,7 @@ private:
 };
 
 void PairedEndModel::estimateFromReads(const char* readFN) {
-    int s;
-    char readFs[2][STRLEN];
+    char readF[STRLEN];
     PairedEndRead read;
 
     int n_warns = 0;
@@ -242,8 +240,8 @@ void PairedEndModel::estimateFromReads(const char* readFN) {
     mld->init();
     for (int i = 0; i < 3; i++)
     	if (N[i] > 0) {
-    		genReadFileNames(readFN, i, read_type, s, readFs);
-    		ReadReader<PairedEndRead> reader(s, readFs, refs->hasPolyA(), seedLen); // allow calculation of calc_lq() function
+    		genReadFileName(readFN, i, readF);
+    		ReadReader<PairedEndRead> reader(readF, refs->hasPolyA(), seedLen); // allow calculation of calc_lq() function
 
     		READ_INT_TYPE cnt = 0;
     		while (reader.next(read)) {
@@ -355,28 +353,23 @@ void PairedEndModel::write(const char* outF) {
 	fclose(fo);
 }
 
-void PairedEndModel::startSimulation(simul* sampler, const std::vector<double>& theta) {
-	this->sampler = sampler;
+void PairedEndModel::startSimulation(const std::vector<double>& theta) {
+	thetaTable.build(&theta[0], M + 1);
 
-	theta_cdf = new double[M + 1];
-	for (int i = 0; i <= M; i++) {
-		theta_cdf[i] = theta[i];
-		if (i > 0) theta_cdf[i] += theta_cdf[i - 1];
-	}
-
-	rspd->startSimulation(M, refs);
+	gld->startSimulation();
+	if (mld != NULL) mld->startSimulation();
 	pro->startSimulation();
 	npro->startSimulation();
 }
 
-bool PairedEndModel::simulate(READ_INT_TYPE rid, PairedEndRead& read, int& sid) {
+bool PairedEndModel::simulate(simul* sampler, READ_INT_TYPE rid, PairedEndRead& read, int& sid) {
 	int dir, pos;
 	int insertL, mateL1, mateL2;
 	std::string name;
 	std::string readseq1, readseq2;
 	std::ostringstream strout;
 
-	sid = sampler->sample(theta_cdf, M + 1);
+	sid = thetaTable.sample(sampler);
 
 	if (sid == 0) {
 		dir = pos = insertL = 0;
@@ -392,7 +385,7 @@ bool PairedEndModel::simulate(READ_INT_TYPE rid, PairedEndRead& read, int& sid)
 		insertL = gld->simulate(sampler, ref.getTotLen());
 		if (insertL < 0) return false;
 		int effL = std::min(ref.getFullLen(), ref.getTotLen() - insertL + 1);
-		pos = rspd->simulate(sampler, sid, effL);
+		pos = rspd->simulate(sampler, ref.getFullLen(), effL);
 		if (pos < 0) return false;
 		if (dir > 0) pos = ref.getTotLen() - pos - insertL;
 
@@ -415,9 +408,8 @@ bool PairedEndModel::simulate(READ_INT_TYPE rid, PairedEndRead& read, int& sid)
 }
 
 void PairedEndModel::finishSimulation() {
-	delete[] theta_cdf;
-
-	rspd->finishSimulation();
+	gld->finishSimulation();
+	if (mld != NULL) mld->finishSimulation();
 	pro->finishSimulation();
 	npro->finishSimulation();
 }
@@ -199,8 +199,8 @@ public:
 
 	const LenDist& getGLD() { return *gld; }
 
-	void startSimulation(simul*, const std::vector<double>&);
-	bool simulate(READ_INT_TYPE, PairedEndReadQ&, int&);
+	void startSimulation(const std::vector<double>&);
+	bool simulate(simul*, READ_INT_TYPE, PairedEndReadQ&, int&);
 	void finishSimulation();
 
 	//Use it after function 'read' or 'estimateFromReads'
@@ -230,8 +230,7 @@ private:
 	QProfile *qpro;
 	NoiseQProfile *nqpro;
 
-	simul *sampler; // for simulation
-	double *theta_cdf; // for simulation
+	AliasTable thetaTable; // for simulation
 
 	double *mw; // for masking
 
@@ -239,8 +238,7 @@ private:
 };
 
 void PairedEndQModel::estimateFromReads(const char* readFN) {
-    int s;
-    char readFs[2][STRLEN];
+    char readF[STRLEN];
     PairedEndReadQ read;
 
     int n_warns = 0;
@@ -248,8 +246,8 @@ void PairedEndQModel::estimateFromReads(const char* readFN) {
     mld->init();
     for (int i = 0; i < 3; i++)
     	if (N[i] > 0) {
-    		genReadFileNames(readFN, i, read_type, s, readFs);
-    		ReadReader<PairedEndReadQ> reader(s, readFs, refs->hasPolyA(), seedLen); // allow calculation of calc_lq() function
+    		genReadFileName(readFN, i, readF);
+    		ReadReader<PairedEndReadQ> reader(readF, refs->hasPolyA(), seedLen); // allow calculation of calc_lq() function
 
     		READ_INT_TYPE cnt = 0;
     		while (reader.next(read)) {
@@ -368,29 +366,24 @@ void PairedEndQModel::write(const char* outF) {
 	fclose(fo);
 }
 
-void PairedEndQModel::startSimulation(simul* sampler, const std::vector<double>& theta) {
-	this->sampler = sampler;
+void PairedEndQModel::startSimulation(const std::vector<double>& theta) {
+	thetaTable.build(&theta[0], M + 1);
 
-	theta_cdf = new double[M + 1];
-	for (int i = 0; i <= M; i++) {
-		theta_cdf[i] = theta[i];
-		if (i > 0) theta_cdf[i] += theta_cdf[i - 1];
-	}
-
-	rspd->startSimulation(M, refs);
+	gld->startSimulation();
+	if (mld != NULL) mld->startSimulation();
 	qd->startSimulation();
 	qpro->startSimulation();
 	nqpro->startSimulation();
 }
 
-bool PairedEndQModel::simulate(READ_INT_TYPE rid, PairedEndReadQ& read, int& sid) {
+bool PairedEndQModel::simulate(simul* sampler, READ_INT_TYPE rid, PairedEndReadQ& read, int& sid) {
 	int dir, pos;
 	int insertL, mateL1, mateL2;
 	std::string name;
 	std::string qual1, qual2, readseq1, readseq2;
 	std::ostringstream strout;
 
-	sid = sampler->sample(theta_cdf, M + 1);
+	sid = thetaTable.sample(sampler);
 
 	if (sid == 0) {
 		dir = pos = insertL = 0;
@@ -408,7 +401,7 @@ bool PairedEndQModel::simulate(READ_INT_TYPE rid, PairedEndReadQ& read, int& sid
 		insertL = gld->simulate(sampler, ref.getTotLen());
 		if (insertL < 0) return false;
 		int effL = std::min(ref.getFullLen(), ref.getTotLen() - insertL + 1);
-		pos = rspd->simulate(sampler, sid, effL);
+		pos = rspd->simulate(sampler, ref.getFullLen(), effL);
 		if (pos < 0) return false;
 		if (dir > 0) pos = ref.getTotLen() - pos - insertL;
 
@@ -433,9 +426,8 @@ bool PairedEndQModel::simulate(READ_INT_TYPE rid, PairedEndReadQ& read, int& sid
 }
 
 void PairedEndQModel::finishSimulation() {
-	delete[] theta_cdf;
-
-	rspd->finishSimulation();
+	gld->finishSimulation();
+	if (mld != NULL) mld->finishSimulation();
 	qd->finishSimulation();
 	qpro->finishSimulation();
 	nqpro->finishSimulation();
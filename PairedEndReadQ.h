@@ -17,9 +17,29 @@ public:
 		this->name = mate1.getName();
 	}
 
+	// See SingleReadQ::fill
+	void fill(std::string& name1, std::string& readseq1, std::string& qscore1, std::string& name2, std::string& readseq2, std::string& qscore2) {
+		mate1.fill(name1, readseq1, qscore1);
+		mate2.fill(name2, readseq2, qscore2);
+		name = mate1.getName();
+		low_quality = false;
+	}
+
 	bool read(int argc, std::istream* argv[], int flags = 7);
 	void write(int argc, std::ostream* argv[]);
 
+	void pack(std::string& buf) const {
+		mate1.pack(buf);
+		mate2.pack(buf);
+	}
+
+	void unpack(const char*& p, int flags = 7) {
+		mate1.unpack(p, flags);
+		mate2.unpack(p, flags);
+		name.clear();
+		if (flags & 4) name = mate1.getName();
+	}
+
 	const SingleReadQ& getMate1() const { return mate1; }
 	const SingleReadQ& getMate2() const { return mate2; }
 	const SingleReadQ& getMate(int i) const {
@@ -4,10 +4,9 @@
 #include<cstdio>
 #include<cstring>
 #include<cassert>
+#include<algorithm>
 
 #include "utils.h"
-#include "RefSeq.h"
-#include "Refs.h"
 #include "simul.h"
 
 const int RSPD_DEFAULT_B = 20;
@@ -79,17 +78,12 @@ public:
 	void read(FILE*);
 	void write(FILE*);
 
-	void startSimulation(int, Refs*);
 	int simulate(simul*, int, int);
-	void finishSimulation();
 
 private:
 	bool estRSPD;
 	int B; // number of bins
 	double *pdf, *cdf;
-
-	int M;
-	double **rspdDists;
 };
 
 RSPD& RSPD::operator=(const RSPD& rv) {
@@ -179,28 +173,29 @@ void RSPD::write(FILE *fo) {
 	}
 }
 
-void RSPD::startSimulation(int M, Refs* refs) {
-	if (!estRSPD) return;
-	this->M = M;
-	rspdDists = new double*[M + 1];
-	rspdDists[0] = NULL;
-	for (int i = 1; i <= M; i++) {
-		int fullLen = refs->getRef(i).getFullLen();
-		rspdDists[i] = new double[fullLen];
-		memset(rspdDists[i], 0, sizeof(double) * fullLen);
-		for (int j = 0; j < fullLen; j++) rspdDists[i][j] = evalCDF(j + 1, fullLen);
-	}
-}
-
-int RSPD::simulate(simul *sampler, int sid, int effL) {
-	if (estRSPD) return (rspdDists[sid][effL - 1] > 0.0 ? sampler->sample(rspdDists[sid], effL) : -1);
-	return int(sampler->random() * effL);
-}
-
-void RSPD::finishSimulation() {
-	if (!estRSPD) return;
-	for (int i = 1; i <= M; i++) delete[] rspdDists[i];
-	delete[] rspdDists;
+/*
+  Draws a start position in [0, effL) of a transcript of length fullLen, with probability proportional to
+  evalCDF(pos + 1) - evalCDF(pos). Since evalCDF is piecewise linear over the B bins, the inverse of a uniform draw is found
+  by locating its bin in cdf and interpolating, so only the B bins are kept instead of a CDF per transcript position.
+ */
+int RSPD::simulate(simul *sampler, int fullLen, int effL) {
+	if (!estRSPD) return int(sampler->random() * effL);
+
+	double total = evalCDF(effL, fullLen);
+	if (total <= 0.0) return -1;
+	double prb = sampler->random() * total;
+
+	// bin i holds prb: cdf[i - 1] <= prb < cdf[i]
+	int i = std::upper_bound(cdf + 1, cdf + B + 1, prb) - cdf;
+	if (i > B) i = B;
+	double x = (pdf[i] > 0.0 ? (prb - cdf[i - 1]) / pdf[i] : 0.0) + i - 1; // in units of bins
+
+	// the smallest pos with evalCDF(pos + 1) > prb; interpolation only needs rounding errors fixed
+	int pos = std::max(0, std::min(effL - 1, int(x * fullLen / B)));
+	while (pos > 0 && evalCDF(pos, fullLen) > prb) --pos;
+	while (pos < effL - 1 && evalCDF(pos + 1, fullLen) <= prb) ++pos;
+
+	return pos;
 }
 
 #endif /* RSPD_H_ */
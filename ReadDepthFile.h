@@ -0,0 +1,135 @@
+#ifndef READDEPTHFILE_H_
+#define READDEPTHFILE_H_
+
+#include<cstdio>
+#include<cstring>
+#include<string>
+#include<vector>
+#include<map>
+#include<stdint.h>
+
+#include "utils.h"
+#include "my_assert.h"
+
+/*
+  Binary read depth file written by rsem-bam2readdepth:
+
+    magic "RSEMDP1\n"
+    records: per transcript with alignments, a uint8 encoding followed by
+             0, raw: one float depth per base
+             1, runs: uint32 number of runs, then (uint32 run length, float depth) pairs
+    index  : per transcript, in the order written, uint32 name length, the name, uint32 transcript length and
+             uint64 record offset (0 if the transcript has no alignment)
+    trailer: uint64 number of transcripts, uint64 index offset, magic "RSEMDPIX"
+
+  Only the index is loaded when the file is opened; the depths of a transcript are read by one seek.
+ */
+
+const char READ_DEPTH_MAGIC[] = "RSEMDP1\n";
+const char READ_DEPTH_INDEX_MAGIC[] = "RSEMDPIX";
+const int READ_DEPTH_MAGIC_LEN = 8;
+const int READ_DEPTH_TRAILER_SIZE = 24;
+
+// Append the record of depths to buf, as runs if that is smaller
+inline void encodeReadDepth(const std::vector<double>& depths, std::string& buf) {
+	size_t len = depths.size(), nRuns = 0;
+	for (size_t i = 0; i < len; i++)
+		if (i == 0 || (float)depths[i] != (float)depths[i - 1]) ++nRuns;
+
+	bool useRuns = nRuns * 8 + 4 < len * 4;
+	buf.push_back(useRuns ? 1 : 0);
+	if (!useRuns) {
+		for (size_t i = 0; i < len; i++) {
+			float value = depths[i];
+			buf.append((const char*)&value, 4);
+		}
+		return;
+	}
+
+	uint32_t n = nRuns;
+	buf.append((const char*)&n, 4);
+	for (size_t i = 0, j; i < len; i = j) {
+		float value = depths[i];
+		for (j = i + 1; j < len && (float)depths[j] == value; j++);
+		uint32_t runLen = j - i;
+		buf.append((const char*)&runLen, 4);
+		buf.append((const char*)&value, 4);
+	}
+}
+
+class ReadDepthReader {
+public:
+	ReadDepthReader(const char* depthF) {
+		uint64_t trailer[2];
+		char magic[READ_DEPTH_MAGIC_LEN];
+
+		this->depthF = depthF;
+		fi = fopen(depthF, "rb");
+		general_assert(fi != NULL, "Cannot open " + this->depthF + "! It may not exist.");
+		general_assert(fread(magic, 1, READ_DEPTH_MAGIC_LEN, fi) == (size_t)READ_DEPTH_MAGIC_LEN && !memcmp(magic, READ_DEPTH_MAGIC, READ_DEPTH_MAGIC_LEN), \
+			       this->depthF + " is not a read depth file!");
+		general_assert(fseeko(fi, -READ_DEPTH_TRAILER_SIZE, SEEK_END) == 0 && fread(trailer, 8, 2, fi) == 2 && \
+			       fread(magic, 1, READ_DEPTH_MAGIC_LEN, fi) == (size_t)READ_DEPTH_MAGIC_LEN && !memcmp(magic, READ_DEPTH_INDEX_MAGIC, READ_DEPTH_MAGIC_LEN), \
+			       this->depthF + " is truncated!");
+
+		general_assert(fseeko(fi, trailer[1], SEEK_SET) == 0, "Cannot read the index of " + this->depthF + "!");
+		int n = trailer[0];
+		names.resize(n); lengths.resize(n); offsets.resize(n);
+		for (int i = 0; i < n; i++) {
+			uint32_t len;
+			general_assert(fread(&len, 4, 1, fi) == 1, "Cannot read the index of " + this->depthF + "!");
+			names[i].resize(len);
+			general_assert((len == 0 || fread(&names[i][0], 1, len, fi) == len) && fread(&lengths[i], 4, 1, fi) == 1 && fread(&offsets[i], 8, 1, fi) == 1, \
+				       "Cannot read the index of " + this->depthF + "!");
+			dict[names[i]] = i;
+		}
+	}
+
+	~ReadDepthReader() { fclose(fi); }
+
+	int getNumTranscripts() const { return names.size(); }
+	const std::string& getName(int i) const { return names[i]; }
+	uint32_t getLength(int i) const { return lengths[i]; }
+	bool hasDepths(int i) const { return offsets[i] > 0; }
+
+	// the index of transcript name, -1 if not in the file
+	int find(const std::string& name) const {
+		std::map<std::string, int>::const_iterator iter = dict.find(name);
+		return iter != dict.end() ? iter->second : -1;
+	}
+
+	// depths of transcript i, all 0 if it has no alignment
+	void getDepths(int i, std::vector<float>& depths) {
+		depths.assign(lengths[i], 0.0);
+		if (offsets[i] == 0 || lengths[i] == 0) return;
+
+		uint8_t encoding;
+		general_assert(fseeko(fi, offsets[i], SEEK_SET) == 0 && fread(&encoding, 1, 1, fi) == 1, "Fail to read the depths of " + names[i] + " from " + depthF + "!");
+		if (encoding == 0) {
+			general_assert(fread(&depths[0], 4, lengths[i], fi) == lengths[i], "Fail to read the depths of " + names[i] + " from " + depthF + "!");
+			return;
+		}
+
+		uint32_t nRuns;
+		general_assert(fread(&nRuns, 4, 1, fi) == 1, "Fail to read the depths of " + names[i] + " from " + depthF + "!");
+		std::vector<uint32_t> runs(nRuns * 2); // run lengths and the bits of their float depths
+		general_assert(nRuns == 0 || fread(&runs[0], 4, nRuns * 2, fi) == nRuns * 2, "Fail to read the depths of " + names[i] + " from " + depthF + "!");
+		for (uint32_t k = 0, pos = 0; k < nRuns; k++) {
+			float value;
+			memcpy(&value, &runs[2 * k + 1], 4);
+			general_assert(pos + runs[2 * k] <= lengths[i], depthF + " is corrupted!");
+			for (uint32_t j = 0; j < runs[2 * k]; j++) depths[pos++] = value;
+		}
+	}
+
+private:
+	std::string depthF;
+	FILE *fi;
+
+	std::vector<std::string> names;
+	std::vector<uint32_t> lengths;
+	std::vector<uint64_t> offsets;
+	std::map<std::string, int> dict;
+};
+
+#endif /* READDEPTHFILE_H_ */
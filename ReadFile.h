@@ -0,0 +1,126 @@
+#ifndef READFILE_H_
+#define READFILE_H_
+
+#include<cstdio>
+#include<cstring>
+#include<string>
+#include<vector>
+#include<stdint.h>
+#include<zlib.h>
+
+#include "utils.h"
+#include "my_assert.h"
+
+/*
+  Binary read file written by rsem-parse-alignments (imdName_{un,alignable,max}.reads):
+
+    magic "RSEMRD1\n"
+    blocks: uint32 compressed size, uint32 raw size, uint32 number of reads, zlib data of the
+            packed reads (ReadType::pack, see pack_utils.h)
+    index : per block, uint64 file offset and uint64 id of its first read
+    trailer: uint64 number of reads, uint64 number of blocks, uint64 index offset, magic "RSEMRDIX"
+
+  Both mates of a paired-end read are stored together in one record, so one file serves all read types.
+ */
+
+const char READ_FILE_MAGIC[] = "RSEMRD1\n";
+const char READ_FILE_INDEX_MAGIC[] = "RSEMRDIX";
+const int READ_FILE_MAGIC_LEN = 8;
+const int READ_BLOCK_HEADER_SIZE = 12;
+const int READ_FILE_TRAILER_SIZE = 32;
+const size_t READ_BLOCK_SIZE = 1 << 16; // raw bytes of packed reads per block
+
+// Compressed blocks of reads, built independently of any file so that they can be encoded in parallel
+class ReadBlocks {
+public:
+	ReadBlocks() { nRaw = 0; }
+
+	template<class ReadType>
+	void add(const ReadType& read) {
+		read.pack(raw);
+		++nRaw;
+		if (raw.size() >= READ_BLOCK_SIZE) flush();
+	}
+
+	// close the current block, if it has any read
+	void flush() {
+		if (nRaw == 0) return;
+
+		uLongf clen = compressBound(raw.size());
+		size_t pos = data.size();
+		data.resize(pos + READ_BLOCK_HEADER_SIZE + clen);
+		int ret = compress2((Bytef*)&data[pos + READ_BLOCK_HEADER_SIZE], &clen, (const Bytef*)raw.data(), raw.size(), 1);
+		general_assert(ret == Z_OK, "Fail to compress a block of reads!");
+		data.resize(pos + READ_BLOCK_HEADER_SIZE + clen);
+
+		uint32_t header[3] = { (uint32_t)clen, (uint32_t)raw.size(), nRaw };
+		memcpy(&data[pos], header, READ_BLOCK_HEADER_SIZE);
+
+		offsets.push_back(pos);
+		counts.push_back(nRaw);
+		raw.clear();
+		nRaw = 0;
+	}
+
+	void clear() {
+		data.clear(); raw.clear(); nRaw = 0;
+		offsets.clear(); counts.clear();
+	}
+
+	const std::string& getData() const { return data; }
+	int getNumBlocks() const { return offsets.size(); }
+	size_t getOffset(int i) const { return offsets[i]; }
+	uint32_t getNumReads(int i) const { return counts[i]; }
+
+private:
+	std::string data, raw; // data, finished blocks; raw, packed reads of the current block
+	uint32_t nRaw; // number of reads in raw
+	std::vector<size_t> offsets; // offsets of the finished blocks in data
+	std::vector<uint32_t> counts;
+};
+
+class ReadFileWriter {
+public:
+	ReadFileWriter() { fo = NULL; offset = nReads = 0; }
+	~ReadFileWriter() { if (fo != NULL) close(); }
+
+	void open(const char* readF) {
+		fo = fopen(readF, "wb");
+		general_assert(fo != NULL, "Cannot create " + cstrtos(readF) + "!");
+		general_assert(fwrite(READ_FILE_MAGIC, 1, READ_FILE_MAGIC_LEN, fo) == (size_t)READ_FILE_MAGIC_LEN, "Fail to write to " + cstrtos(readF) + "!");
+		offset = READ_FILE_MAGIC_LEN;
+		nReads = 0;
+		index.clear();
+	}
+
+	// write blocks out, after closing their last block
+	void write(ReadBlocks& blocks) {
+		blocks.flush();
+		const std::string& data = blocks.getData();
+		general_assert(fwrite(data.data(), 1, data.size(), fo) == data.size(), "Fail to write a read file!");
+		for (int i = 0; i < blocks.getNumBlocks(); i++) {
+			index.push_back(offset + blocks.getOffset(i));
+			index.push_back(nReads);
+			nReads += blocks.getNumReads(i);
+		}
+		offset += data.size();
+	}
+
+	void close() {
+		uint64_t trailer[3] = { nReads, index.size() / 2, offset };
+		if (!index.empty()) fwrite(&index[0], sizeof(uint64_t), index.size(), fo);
+		fwrite(trailer, sizeof(uint64_t), 3, fo);
+		fwrite(READ_FILE_INDEX_MAGIC, 1, READ_FILE_MAGIC_LEN, fo);
+		general_assert(fclose(fo) == 0, "Fail to close a read file!");
+		fo = NULL;
+	}
+
+	READ_INT_TYPE getNumReads() const { return nReads; }
+
+private:
+	FILE *fo;
+	uint64_t offset, nReads;
+	std::vector<uint64_t> index; // (offset, first read id) pairs
+};
+
+#endif /* READFILE_H_ */
@@ -4,115 +4,181 @@
 #include<cstdio>
 #include<cstring>
 #include<cstdlib>
-#include<iostream>
-#include<cassert>
-#include<fstream>
+#include<string>
 #include<vector>
+#include<stdint.h>
+#include<zlib.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
 
 #include "utils.h"
+#include "my_assert.h"
 #include "SingleRead.h"
 #include "SingleReadQ.h"
 #include "PairedEndRead.h"
 #include "PairedEndReadQ.h"
-#include "ReadIndex.h"
-
+#include "ReadFile.h"
 
+/*
+  Reads a binary read file (see ReadFile.h) through a read-only memory mapping. Each reader decodes its own blocks, thus several readers
+  of the same file can run in parallel. Whenever a block is decoded, the kernel is asked to page in the next one, so that its bytes are
+  in memory by the time the current block is used up. The block located last is kept decoded apart, so reset() costs nothing.
+ */
 template<class ReadType>
 class ReadReader {
 public:
-	ReadReader() { s = 0; indices = NULL; arr = NULL; hasPolyA = false; seedLen = -1; }
-	ReadReader(int s, char readFs[][STRLEN], bool hasPolyA = false, int seedLen = -1);
+	ReadReader(const char* readF, bool hasPolyA = false, int seedLen = -1);
 	~ReadReader();
 
-	void setIndices(ReadIndex** indices) {
-		this->indices = indices;
-	}
+	READ_INT_TYPE getNumReads() const { return nReads; }
 
-	bool locate(READ_INT_TYPE); // You should guarantee that indices exist and rid is valid, otherwise return false; If it fails, you should reset it manually!
+	bool locate(READ_INT_TYPE); // rid should be valid, otherwise return false; If it fails, you should reset it manually!
 	void reset();
 
 	bool next(ReadType& read, int flags = 7) {
-		bool success = read.read(s, (std::istream**)arr, flags);
-		if (success && seedLen > 0) { read.calc_lq(hasPolyA, seedLen); }
-		return success;
+		if (left == 0) {
+			if (curBlock + 1 >= nBlocks) return false;
+			loadBlock(curBlock + 1, raw);
+		}
+		read.unpack(p, flags);
+		--left;
+		if (seedLen > 0) { read.calc_lq(hasPolyA, seedLen); }
+		return true;
 	}
 
 private:
-	int s; // number of files
-	ReadIndex **indices;
-	std::ifstream** arr;
-	std::streampos *locations;
+	std::string readF;
+	const char *data; // the mapped file
+	size_t size;
+	READ_INT_TYPE nReads;
+	int nBlocks;
+	std::vector<uint64_t> offsets, firsts; // offsets and first read ids of the blocks
+
+	int curBlock; // the decoded block, -1 if none
+	std::string raw, startRaw; // startRaw holds the block located last
+	const char *p; // next read
+	uint32_t left; // reads left in the current block
+
+	int startBlock; // where reset() goes back to
+	size_t startPos;
+	uint32_t startLeft;
 
 	bool hasPolyA;
 	int seedLen;
+
+	void loadBlock(int bid, std::string& buf);
+	void prefetch(int bid);
 };
 
 template<class ReadType>
-ReadReader<ReadType>::ReadReader(int s, char readFs[][STRLEN], bool hasPolyA, int seedLen) {
-	assert(s > 0);
-	this->s = s;
-	arr = new std::ifstream*[s];
-	locations = new std::streampos[s];
-	indices = NULL;
-	for (int i = 0; i < s; i++) {
-		arr[i] = new std::ifstream(readFs[i]);
-		if (!arr[i]->is_open()) { fprintf(stderr, "Cannot open %s! It may not exist.\n", readFs[i]); exit(-1); }
-		locations[i] = arr[i]->tellg();
+ReadReader<ReadType>::ReadReader(const char* readF, bool hasPolyA, int seedLen) {
+	struct stat st;
+	uint64_t trailer[3];
+
+	this->readF = readF;
+	int fd = open(readF, O_RDONLY);
+	general_assert(fd >= 0, "Cannot open " + this->readF + "! It may not exist.");
+	general_assert(fstat(fd, &st) == 0 && st.st_size >= READ_FILE_MAGIC_LEN + READ_FILE_TRAILER_SIZE, this->readF + " is truncated!");
+	size = st.st_size;
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	general_assert(addr != MAP_FAILED, "Cannot map " + this->readF + " into memory!");
+	close(fd);
+	data = (const char*)addr;
+
+	general_assert(!memcmp(data, READ_FILE_MAGIC, READ_FILE_MAGIC_LEN), this->readF + " is not a read file!");
+	general_assert(!memcmp(data + size - READ_FILE_MAGIC_LEN, READ_FILE_INDEX_MAGIC, READ_FILE_MAGIC_LEN), this->readF + " is truncated!");
+	memcpy(trailer, data + size - READ_FILE_TRAILER_SIZE, sizeof(trailer));
+
+	nReads = trailer[0];
+	nBlocks = trailer[1];
+	general_assert(trailer[2] + trailer[1] * 2 * sizeof(uint64_t) + READ_FILE_TRAILER_SIZE == size, "Cannot read the index of " + this->readF + "!");
+	std::vector<uint64_t> index(nBlocks * 2);
+	if (nBlocks > 0) memcpy(&index[0], data + trailer[2], index.size() * sizeof(uint64_t)); // the index may not be 8-byte aligned
+	offsets.resize(nBlocks); firsts.resize(nBlocks);
+	for (int i = 0; i < nBlocks; i++) {
+		offsets[i] = index[2 * i];
+		firsts[i] = index[2 * i + 1];
 	}
+
 	this->hasPolyA = hasPolyA;
 	this->seedLen = seedLen;
+
+	curBlock = -1; p = NULL; left = 0;
+	startBlock = -1; startPos = 0; startLeft = 0;
+
+	posix_madvise(addr, size, POSIX_MADV_SEQUENTIAL);
+	prefetch(0);
 }
 
 template<class ReadType>
 ReadReader<ReadType>::~ReadReader() {
-	indices = NULL;
-	if (arr != NULL) {
-		for (int i = 0; i < s; i++) {
-			arr[i]->close();
-			delete arr[i];
-		}
-		delete[] arr;
-	}
-	if (locations != NULL) {
-		delete[] locations;
-	}
+	munmap((void*)data, size);
 }
 
 template<class ReadType>
-bool ReadReader<ReadType>::locate(READ_INT_TYPE rid) {
-	READ_INT_TYPE crid = -1;
-	ReadType read;
-
-	if (indices == NULL) return false;
+void ReadReader<ReadType>::loadBlock(int bid, std::string& buf) {
+	uint32_t header[3];
+	uint64_t offset = offsets[bid];
+
+	general_assert(offset + READ_BLOCK_HEADER_SIZE <= size, "Block " + itos(bid) + " of " + readF + " is corrupted!");
+	memcpy(header, data + offset, READ_BLOCK_HEADER_SIZE);
+	buf.resize(header[1]);
+	uLongf len = header[1];
+	general_assert(offset + READ_BLOCK_HEADER_SIZE + header[0] <= size && \
+		       uncompress((Bytef*)&buf[0], &len, (const Bytef*)(data + offset + READ_BLOCK_HEADER_SIZE), header[0]) == Z_OK && len == header[1], \
+		       "Block " + itos(bid) + " of " + readF + " is corrupted!");
+
+	curBlock = bid;
+	p = buf.data();
+	left = header[2];
+
+	prefetch(bid + 1);
+}
 
-	//We should make sure that crid returned by each indices is the same
-	for (int i = 0; i < s; i++) {
-		READ_INT_TYPE val = indices[i]->locate(rid, *arr[i]);
-		if (i == 0) { crid = val; } else { assert(crid == val); }
-	}
-	assert(crid <= rid);
-	while (crid < rid && read.read(s, (std::istream**)arr, 0)) ++crid;
+template<class ReadType>
+void ReadReader<ReadType>::prefetch(int bid) {
+	if (bid >= nBlocks) return;
+	static const size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t from = offsets[bid] / pageSize * pageSize;
+	size_t to = (bid + 1 < nBlocks ? offsets[bid + 1] : size);
+	posix_madvise((void*)(data + from), to - from, POSIX_MADV_WILLNEED);
+}
 
-	if (crid < rid) return false;
+template<class ReadType>
+bool ReadReader<ReadType>::locate(READ_INT_TYPE rid) {
+	if (rid >= nReads) return false;
 
-	std::vector<std::streampos> tmp(s);
-	for (int i = 0; i < s; i++) { tmp[i] = arr[i]->tellg(); }
+	// first read ids are increasing, find the last block starting at or before rid
+	int l = 0, r = nBlocks - 1;
+	while (l < r) {
+		int mid = (l + r + 1) / 2;
+		if (firsts[mid] <= rid) l = mid; else r = mid - 1;
+	}
 
-	if (!read.read(s, (std::istream**)arr, 0)) return false;
+	ReadType read;
+	if (startBlock != l) loadBlock(l, startRaw);
+	else { curBlock = l; p = startRaw.data(); left = (l + 1 < nBlocks ? firsts[l + 1] : nReads) - firsts[l]; }
+	for (READ_INT_TYPE crid = firsts[l]; crid < rid; ++crid) { read.unpack(p, 0); --left; }
 
-	for (int i = 0; i < s; i++) {
-		locations[i] = tmp[i];
-		arr[i]->seekg(locations[i]);
-	}
+	startBlock = l;
+	startPos = p - startRaw.data();
+	startLeft = left;
 
 	return true;
 }
 
 template<class ReadType>
 void ReadReader<ReadType>::reset() {
-	for (int i = 0; i < s; i++) {
-		arr[i]->seekg(locations[i]);
+	if (startBlock < 0) { // never located, go back to the first read
+		curBlock = -1; p = NULL; left = 0;
+		return;
 	}
+	curBlock = startBlock;
+	p = startRaw.data() + startPos;
+	left = startLeft;
+	prefetch(startBlock + 1);
 }
 
 #endif /* READREADER_H_ */
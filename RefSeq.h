@@ -68,7 +68,7 @@ public:
 
 	const std::string& getName() const { return name; }
 
-	std::string getSeq() const { return seq; }
+	const std::string& getSeq() const { return seq; }
 
 	std::string getRSeq() const {
 		std::string rseq = "";
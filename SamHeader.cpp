@@ -45,6 +45,16 @@ void SamHeader::replaceSQ(const char* faiF) {
   fin.close();
 }
 
+void SamHeader::setSortOrder(const std::string& so) {
+  if (HDstr == "") { HDstr = "@HD\tVN:1.3\tSO:" + so + "\n"; return; }
+
+  size_t fr = HDstr.find("\tSO:"), to;
+  if (fr == std::string::npos) { HDstr.insert(HDstr.length() - 1, "\tSO:" + so); return; }
+  fr += 4;
+  to = HDstr.find_first_of("\t\n", fr);
+  HDstr.replace(fr, to - fr, so);
+}
+
 std::map<std::string, std::string> SamHeader::parse_line(const std::string& line) {
   size_t len = line.length();
   assert(line.substr(0, 3) != "@CO" && len > 4);
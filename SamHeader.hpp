@@ -45,6 +45,8 @@ public:
     }
   }
 
+  void setSortOrder(const std::string& so); // set SO in @HD, adding @HD if needed
+
   void addComment(const std::string& comment) {
     COstr += "@CO\t" + comment + "\n";
   }
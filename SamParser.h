@@ -11,6 +11,7 @@
 #include <stdint.h>
 #include "htslib/sam.h"
 #include "sam_utils.h"
+#include "BamReader.h"
 
 #include "utils.h"
 #include "my_assert.h"
@@ -27,9 +28,18 @@
 
 class SamParser {
 public:
-	SamParser(const char* inpF, const char* aux, Transcripts& transcripts, const char* imdName);
+	// nThreads : number of threads decompressing BAM input, 0 reads on the calling thread
+	SamParser(const char* inpF, const char* aux, Transcripts& transcripts, const char* imdName, int nThreads = 0);
+	// A parser of the chunks read by master, sharing master's header and mappings
+	explicit SamParser(SamParser* master);
 	~SamParser();
 
+	// Fill chunk with whole reads until it holds at least nBytes, false if no alignment is left
+	bool readChunk(BamChunk& chunk, size_t nBytes, bool paired);
+
+	// Parse the alignments in chunk instead of the input file
+	void setChunk(BamChunk* chunk) { this->chunk = chunk; lastName.clear(); }
+
 	/**
 	 * return value
 	 * -1 : no more alignment
@@ -43,6 +53,9 @@ public:
 	int parseNext(PairedEndRead& read, PairedEndHit& hit);
 	int parseNext(PairedEndReadQ& read, PairedEndHit& hit);
 
+	// Number of read pairs whose mates have different names, including those found by chunk parsers already destroyed
+	int getNumWarnings() const { return n_warns; }
+
 	static void setReadTypeTag(const char* tag) {
 		strcpy(rtTag, tag);
 	}
@@ -50,15 +63,42 @@ public:
 private:
 	samFile *sam_in;
 	bam_hdr_t *header;
+	BamReader *reader;
 	bam1_t *b, *b2;
 
 	Transcripts& transcripts;
 
 	int n_warns; // Number of warnings
+
+	SamParser *master; // NULL if this parser reads the input file
+	BamChunk *chunk;
+	bool pending; // b (and b2) hold the first read of the next chunk
+	std::string key, nextKey;
+
+	// the read parseNext returned last; parseNext fills a read only for its first alignment
+	std::string lastName;
+	int lastLen, lastLen2;
+
+	// buffers swapped in and out of the reads, see SingleRead::fill
+	std::string name, name2, seq, seq2, qual, qual2;
 	
 	//tag used by aligner
 	static char rtTag[STRLEN];
 
+	int nextRecord(bam1_t* b) {
+		return chunk != NULL ? chunk->read(b) : reader->read(b);
+	}
+
+	bool readUnit(bool paired) {
+		return reader->read(b) >= 0 && (!paired || reader->read(b2) >= 0);
+	}
+
+	// The name parseNext gives to the read in b (and b2)
+	const std::string& getUnitName(bool paired, std::string& name) {
+		bam_get_canonical_name(paired && !bam_is_read1(b) ? b2 : b, name);
+		return name;
+	}
+
 	//0 ~ N0, 1 ~ N1, 2 ~ N2
 	int getReadType(const bam1_t* b) {
 	  if (bam_is_mapped(b)) return 1;
@@ -85,8 +125,8 @@ private:
 char SamParser::rtTag[STRLEN] = ""; // default : no tag, thus no Type 2 reads
 
 // aux, if not 0, points to the file name of fn_list
-SamParser::SamParser(const char* inpF, const char* aux, Transcripts& transcripts, const char* imdName)
-	: transcripts(transcripts), n_warns(0)
+SamParser::SamParser(const char* inpF, const char* aux, Transcripts& transcripts, const char* imdName, int nThreads)
+	: transcripts(transcripts), n_warns(0), master(NULL), chunk(NULL), pending(false)
 {
 	sam_in = sam_open(inpF, "r");
 	general_assert(sam_in != 0, "Cannot open " + cstrtos(inpF) + "! It may not exist.");
@@ -97,42 +137,71 @@ SamParser::SamParser(const char* inpF, const char* aux, Transcripts& transcripts
 
 	transcripts.buildMappings(header->n_targets, header->target_name, imdName);
 
+	reader = new BamReader(sam_in, header, nThreads);
+	b = bam_init1();
+	b2 = bam_init1();
+}
+
+SamParser::SamParser(SamParser* master)
+	: sam_in(NULL), header(master->header), reader(NULL), transcripts(master->transcripts), n_warns(0), master(master), chunk(NULL), pending(false)
+{
 	b = bam_init1();
 	b2 = bam_init1();
 }
 
 SamParser::~SamParser() {
-	if (n_warns > 0) fprintf(stderr, "Warning: Detected %d lines containing read pairs whose two mates have different names.\n", n_warns);
-	
-  	bam_hdr_destroy(header);
-	sam_close(sam_in);
+	if (master != NULL) master->n_warns += n_warns;
+	else {
+		if (n_warns > 0) fprintf(stderr, "Warning: Detected %d lines containing read pairs whose two mates have different names.\n", n_warns);
+
+		delete reader;
+		bam_hdr_destroy(header);
+		sam_close(sam_in);
+	}
 	bam_destroy1(b);
 	bam_destroy1(b2);
 }
 
+// A chunk ends at a read boundary, i.e. where parseNext would see a new read name
+bool SamParser::readChunk(BamChunk& chunk, size_t nBytes, bool paired) {
+	chunk.clear();
+	if (!pending && !readUnit(paired)) return false;
+
+	for (;;) {
+		getUnitName(paired, key);
+		chunk.append(b);
+		if (paired) chunk.append(b2);
+		pending = readUnit(paired);
+		if (!pending) return true;
+		if (chunk.size() >= nBytes && getUnitName(paired, nextKey) != key) return true;
+	}
+}
+
 // If sam_read1 returns 0 , what does it mean?
 //Assume b.core.tid is 0-based
 int SamParser::parseNext(SingleRead& read, SingleHit& hit) {
 	int val; // return value
 
-	if (sam_read1(sam_in, header, b) < 0) return -1;
+	if (nextRecord(b) < 0) return -1;
 
-	std::string name = bam_get_canonical_name(b);
-	
-	general_assert(!bam_is_paired(b), "Read " + name + ": Find a paired end read in the file!");
+	general_assert(!bam_is_paired(b), "Read " + bam_get_canonical_name(b) + ": Find a paired end read in the file!");
 
 	int readType = getReadType(b);
-	if (readType != 1 || (readType == 1 && read.getName().compare(name) != 0)) {
+	if (readType != 1 || !bam_has_canonical_name(b, lastName)) {
 		val = readType;
-		read = SingleRead(name, bam_get_read_seq(b));
+		bam_get_canonical_name(b, lastName);
+		lastLen = b->core.l_qseq;
+		name = lastName;
+		bam_get_read_seq(b, seq);
+		read.fill(name, seq);
 	}
 	else {
-		general_assert(read.getReadLength() == b->core.l_qseq, "Read " + name + " has alignments with inconsistent read lengths!");
+		general_assert(lastLen == b->core.l_qseq, "Read " + lastName + " has alignments with inconsistent read lengths!");
 		val = 5;
 	}
 
 	if (readType == 1) {
-	  general_assert(bam_check_cigar(b), "Read " + name + ": RSEM currently does not support gapped alignments, sorry!\n");
+	  general_assert(bam_check_cigar(b), "Read " + lastName + ": RSEM currently does not support gapped alignments, sorry!\n");
 	  if (bam_is_rev(b)) {
 	    hit = SingleHit(-transcripts.getInternalSid(b->core.tid + 1), header->target_len[b->core.tid] - b->core.pos - b->core.l_qseq);
 	  }
@@ -147,24 +216,27 @@ int SamParser::parseNext(SingleRead& read, SingleHit& hit) {
 int SamParser::parseNext(SingleReadQ& read, SingleHit& hit) {
 	int val;
 
-	if (sam_read1(sam_in, header, b) < 0) return -1;
+	if (nextRecord(b) < 0) return -1;
 
-	std::string name = bam_get_canonical_name(b);
-	
-	general_assert(!bam_is_paired(b), "Read " + name + ": Find a paired end read in the file!");
+	general_assert(!bam_is_paired(b), "Read " + bam_get_canonical_name(b) + ": Find a paired end read in the file!");
 
 	int readType = getReadType(b);
-	if (readType != 1 || (readType == 1 && read.getName().compare(name) != 0)) {
+	if (readType != 1 || !bam_has_canonical_name(b, lastName)) {
 		val = readType;
-		read = SingleReadQ(name, bam_get_read_seq(b), bam_get_qscore(b));
+		bam_get_canonical_name(b, lastName);
+		lastLen = b->core.l_qseq;
+		name = lastName;
+		bam_get_read_seq(b, seq);
+		bam_get_qscore(b, qual);
+		read.fill(name, seq, qual);
 	}
 	else {
-		general_assert(read.getReadLength() == b->core.l_qseq, "Read " + name + " has alignments with inconsistent read lengths!");
+		general_assert(lastLen == b->core.l_qseq, "Read " + lastName + " has alignments with inconsistent read lengths!");
 		val = 5;
 	}
 
 	if (readType == 1) {
-	  general_assert(bam_check_cigar(b), "Read " + name + ": RSEM currently does not support gapped alignments, sorry!\n");
+	  general_assert(bam_check_cigar(b), "Read " + lastName + ": RSEM currently does not support gapped alignments, sorry!\n");
 	  if (bam_is_rev(b)) {
 	    hit = SingleHit(-transcripts.getInternalSid(b->core.tid + 1), header->target_len[b->core.tid] - b->core.pos - b->core.l_qseq);
 	  }
@@ -180,36 +252,38 @@ int SamParser::parseNext(SingleReadQ& read, SingleHit& hit) {
 int SamParser::parseNext(PairedEndRead& read, PairedEndHit& hit) {
 	int val;
 
-	if ((sam_read1(sam_in, header, b) < 0) || (sam_read1(sam_in, header, b2) < 0)) return -1;
+	if ((nextRecord(b) < 0) || (nextRecord(b2) < 0)) return -1;
 
 	if (!bam_is_read1(b)) { bam1_t * tmp = b; b = b2; b2 = tmp; }
-	std::string name = bam_get_canonical_name(b);
-	
-	general_assert(bam_is_paired(b) && bam_is_paired(b2), "Read " + name + ": One of the mate is not paired-end! (RSEM assumes the two mates of a paired-end read should be adjacent)");
-	general_assert((bam_is_read1(b) && bam_is_read2(b2)), "Read " + name + ": The adjacent two lines do not represent the two mates of a paired-end read! (RSEM assumes the two mates of a paired-end read should be adjacent)");
-	general_assert((bam_is_mapped(b) && bam_is_mapped(b2)) || (!bam_is_mapped(b) && !bam_is_mapped(b2)), "Read " + name + ": RSEM currently does not support partial alignments!");
+
+	general_assert(bam_is_paired(b) && bam_is_paired(b2), "Read " + bam_get_canonical_name(b) + ": One of the mate is not paired-end! (RSEM assumes the two mates of a paired-end read should be adjacent)");
+	general_assert((bam_is_read1(b) && bam_is_read2(b2)), "Read " + bam_get_canonical_name(b) + ": The adjacent two lines do not represent the two mates of a paired-end read! (RSEM assumes the two mates of a paired-end read should be adjacent)");
+	general_assert((bam_is_mapped(b) && bam_is_mapped(b2)) || (!bam_is_mapped(b) && !bam_is_mapped(b2)), "Read " + bam_get_canonical_name(b) + ": RSEM currently does not support partial alignments!");
 	
-	std::string name2 = bam_get_canonical_name(b2);	
-	if (name != name2) 
-	  if (++n_warns <= MAX_WARNS) 
-	    fprintf(stderr, "Warning: Detected a read pair whose two mates have different names--%s and %s!\n", name.c_str(), name2.c_str());
+	if (!bam_same_canonical_name(b, b2))
+	  if (++n_warns <= MAX_WARNS)
+	    fprintf(stderr, "Warning: Detected a read pair whose two mates have different names--%s and %s!\n", bam_get_canonical_name(b).c_str(), bam_get_canonical_name(b2).c_str());
 
 	int readType = getReadType(b, b2);
 
-	if (readType != 1 || (readType == 1 && read.getName().compare(name) != 0)) {
+	if (readType != 1 || !bam_has_canonical_name(b, lastName)) {
 		val = readType;
-		SingleRead mate1(name, bam_get_read_seq(b));
-		SingleRead mate2(name2, bam_get_read_seq(b2));
-		read = PairedEndRead(mate1, mate2);
+		bam_get_canonical_name(b, lastName);
+		lastLen = b->core.l_qseq; lastLen2 = b2->core.l_qseq;
+		name = lastName;
+		bam_get_canonical_name(b2, name2);
+		bam_get_read_seq(b, seq);
+		bam_get_read_seq(b2, seq2);
+		read.fill(name, seq, name2, seq2);
 	}
 	else {
-		general_assert(read.getMate1().getReadLength() == b->core.l_qseq && read.getMate2().getReadLength() == b2->core.l_qseq, "Paired-end read " + name + " has alignments with inconsistent mate lengths!");
+		general_assert(lastLen == b->core.l_qseq && lastLen2 == b2->core.l_qseq, "Paired-end read " + lastName + " has alignments with inconsistent mate lengths!");
 		val = 5;
 	}
 
 	if (readType == 1) {
-	  general_assert(bam_check_cigar(b) && bam_check_cigar(b2), "Read " + name + ": RSEM currently does not support gapped alignments, sorry!");
-	  general_assert(b->core.tid == b2->core.tid, "Read " + name + ": The two mates do not align to a same transcript! RSEM does not support discordant alignments.");
+	  general_assert(bam_check_cigar(b) && bam_check_cigar(b2), "Read " + lastName + ": RSEM currently does not support gapped alignments, sorry!");
+	  general_assert(b->core.tid == b2->core.tid, "Read " + lastName + ": The two mates do not align to a same transcript! RSEM does not support discordant alignments.");
 	  if (bam_is_rev(b)) {
 	    hit = PairedEndHit(-transcripts.getInternalSid(b->core.tid + 1), header->target_len[b->core.tid] - b->core.pos - b->core.l_qseq, b->core.pos + b->core.l_qseq - b2->core.pos);
 	  }
@@ -224,36 +298,40 @@ int SamParser::parseNext(PairedEndRead& read, PairedEndHit& hit) {
 int SamParser::parseNext(PairedEndReadQ& read, PairedEndHit& hit) {
 	int val;
 	
-	if ((sam_read1(sam_in, header, b) < 0) || (sam_read1(sam_in, header, b2) < 0)) return -1;
+	if ((nextRecord(b) < 0) || (nextRecord(b2) < 0)) return -1;
 
 	if (!bam_is_read1(b)) { bam1_t *tmp = b; b = b2; b2 = tmp; } // swap if the first read is not read 1
-	std::string name = bam_get_canonical_name(b);
-	
-	general_assert(bam_is_paired(b) && bam_is_paired(b2), "Read " + name + ": One of the mate is not paired-end! (RSEM assumes the two mates of a paired-end read should be adjacent)");
-	general_assert(bam_is_read1(b) && bam_is_read2(b2), "Read " + name + ": The adjacent two lines do not represent the two mates of a paired-end read! (RSEM assumes the two mates of a paired-end read should be adjacent)");
-	general_assert((bam_is_mapped(b) && bam_is_mapped(b2)) || (!bam_is_mapped(b) && !bam_is_mapped(b2)), "Read " + name + ": RSEM currently does not support partial alignments!");
+
+	general_assert(bam_is_paired(b) && bam_is_paired(b2), "Read " + bam_get_canonical_name(b) + ": One of the mate is not paired-end! (RSEM assumes the two mates of a paired-end read should be adjacent)");
+	general_assert(bam_is_read1(b) && bam_is_read2(b2), "Read " + bam_get_canonical_name(b) + ": The adjacent two lines do not represent the two mates of a paired-end read! (RSEM assumes the two mates of a paired-end read should be adjacent)");
+	general_assert((bam_is_mapped(b) && bam_is_mapped(b2)) || (!bam_is_mapped(b) && !bam_is_mapped(b2)), "Read " + bam_get_canonical_name(b) + ": RSEM currently does not support partial alignments!");
 	
-	std::string name2 = bam_get_canonical_name(b2);	
-	if (name != name2)
+	if (!bam_same_canonical_name(b, b2))
 	  if (++n_warns <= MAX_WARNS)
-	    fprintf(stderr, "Warning: Detected a read pair whose two mates have different names--%s and %s!\n", name.c_str(), name2.c_str());
+	    fprintf(stderr, "Warning: Detected a read pair whose two mates have different names--%s and %s!\n", bam_get_canonical_name(b).c_str(), bam_get_canonical_name(b2).c_str());
 
 	int readType = getReadType(b, b2);
 
-	if (readType != 1 || (readType == 1 && read.getName().compare(name) != 0)) {
+	if (readType != 1 || !bam_has_canonical_name(b, lastName)) {
 		val = readType;
-		SingleReadQ mate1(name, bam_get_read_seq(b), bam_get_qscore(b));
-		SingleReadQ mate2(name2, bam_get_read_seq(b2), bam_get_qscore(b2));
-		read = PairedEndReadQ(mate1, mate2);
+		bam_get_canonical_name(b, lastName);
+		lastLen = b->core.l_qseq; lastLen2 = b2->core.l_qseq;
+		name = lastName;
+		bam_get_canonical_name(b2, name2);
+		bam_get_read_seq(b, seq);
+		bam_get_read_seq(b2, seq2);
+		bam_get_qscore(b, qual);
+		bam_get_qscore(b2, qual2);
+		read.fill(name, seq, qual, name2, seq2, qual2);
 	}
 	else {
-		general_assert(read.getMate1().getReadLength() == b->core.l_qseq && read.getMate2().getReadLength() == b2->core.l_qseq, "Paired-end read " + name + " has alignments with inconsistent mate lengths!");
+		general_assert(lastLen == b->core.l_qseq && lastLen2 == b2->core.l_qseq, "Paired-end read " + lastName + " has alignments with inconsistent mate lengths!");
 		val = 5;
 	}
 
 	if (readType == 1) {
-	  general_assert(bam_check_cigar(b) && bam_check_cigar(b2), "Read " + name + ": RSEM currently does not support gapped alignments, sorry!");
-	  general_assert(b->core.tid == b2->core.tid, "Read " + name + ": The two mates do not align to a same transcript! RSEM does not support discordant alignments.");
+	  general_assert(bam_check_cigar(b) && bam_check_cigar(b2), "Read " + lastName + ": RSEM currently does not support gapped alignments, sorry!");
+	  general_assert(b->core.tid == b2->core.tid, "Read " + lastName + ": The two mates do not align to a same transcript! RSEM does not support discordant alignments.");
 	  if (bam_is_rev(b)) {
 	    hit = PairedEndHit(-transcripts.getInternalSid(b->core.tid + 1), header->target_len[b->core.tid] - b->core.pos - b->core.l_qseq, b->core.pos + b->core.l_qseq - b2->core.pos);
 	  }
@@ -0,0 +1,217 @@
+#ifndef SIMULATEDALIGNMENTS_H_
+#define SIMULATEDALIGNMENTS_H_
+
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<string>
+#include<vector>
+#include<stdint.h>
+
+#include "htslib/sam.h"
+
+#include "utils.h"
+#include "my_assert.h"
+#include "RefSeq.h"
+#include "Refs.h"
+#include "GroupInfo.h"
+#include "SingleRead.h"
+#include "SingleReadQ.h"
+#include "PairedEndRead.h"
+#include "PairedEndReadQ.h"
+
+/*
+  Builds the transcript BAM records of simulated reads, as an aligner would report them against the RSEM reference: the
+  true alignment and, if gi is given, one alignment to every other transcript of the same gene that contains the fragment's
+  sequence exactly. The origin of a read is taken from its name (rid_dir_sid_pos[_insertL], see rsem-simulate-reads) and
+  stored in every record as tags ZT (sid, 0 for noise), ZD (dir), ZP (pos) and, for paired-end reads, ZI (insertL). NH and
+  HI give the number of alignments and the index of each. Noise reads are reported unaligned.
+ */
+class SimulatedAlignments {
+public:
+	SimulatedAlignments(Refs& refs, const GroupInfo* gi = NULL) : refs(refs), gi(gi) {}
+
+	// The header, with the transcripts (and their poly(A) tails) as references
+	bam_hdr_t* createHeader() {
+		std::string text = "@HD\tVN:1.4\tSO:unsorted\n";
+		for (int i = 1; i <= refs.getM(); i++)
+			text += "@SQ\tSN:" + refs.getRef(i).getName() + "\tLN:" + itos(refs.getRef(i).getTotLen()) + "\n";
+		text += "@PG\tID:rsem-simulate-reads\tPN:rsem-simulate-reads\n";
+
+		bam_hdr_t *h = sam_hdr_parse(text.length(), text.c_str());
+		h->l_text = text.length();
+		h->text = (char*)calloc(h->l_text + 1, 1);
+		strcpy(h->text, text.c_str());
+
+		return h;
+	}
+
+	// Append the records of read, simulated from sid, to records[n ..], allocating records as needed
+	void add(const SingleRead& read, int sid, std::vector<bam1_t*>& records, int& n) {
+		addSingle(read.getName(), read.getReadSeq(), empty, sid, records, n);
+	}
+
+	void add(const SingleReadQ& read, int sid, std::vector<bam1_t*>& records, int& n) {
+		addSingle(read.getName(), read.getReadSeq(), read.getQScore(), sid, records, n);
+	}
+
+	void add(const PairedEndRead& read, int sid, std::vector<bam1_t*>& records, int& n) {
+		const SingleRead &mate1 = read.getMate1(), &mate2 = read.getMate2();
+		addPaired(mate1.getName(), mate1.getReadSeq(), empty, mate2.getReadSeq(), empty, sid, records, n);
+	}
+
+	void add(const PairedEndReadQ& read, int sid, std::vector<bam1_t*>& records, int& n) {
+		const SingleReadQ &mate1 = read.getMate1(), &mate2 = read.getMate2();
+		addPaired(mate1.getName(), mate1.getReadSeq(), mate1.getQScore(), mate2.getReadSeq(), mate2.getQScore(), sid, records, n);
+	}
+
+private:
+	// A read (or mate) laid out on the forward strand of a fragment
+	struct Mate {
+		const std::string *seq, *qual; // as sequenced
+		int offset; // leftmost position, relative to the fragment's start
+		bool rev;
+	};
+
+	struct Truth {
+		int sid, dir, pos, insertL;
+	};
+
+	Refs& refs;
+	const GroupInfo* gi;
+	std::string empty;
+
+	static void parseName(const std::string& name, int sid, Truth& truth) {
+		truth.sid = sid; truth.insertL = 0;
+		general_assert(sscanf(name.c_str(), "%*[0-9]_%d_%*d_%d_%d", &truth.dir, &truth.pos, &truth.insertL) >= 2, "Cannot parse simulated read name " + name + "!");
+	}
+
+	static std::string baseName(const std::string& name) {
+		return name.substr(0, name.find_first_of('/'));
+	}
+
+	// start positions on other transcripts of the gene sharing [fr, fr + len) of transcript sid, in order of sid
+	void findHits(int sid, int fr, int len, std::vector<std::pair<int, int> >& hits) {
+		hits.clear();
+		if (gi == NULL) { hits.push_back(std::make_pair(sid, fr)); return; }
+
+		const std::string& seq = refs.getRef(sid).getSeq();
+		int gid = gi->gidAt(sid);
+		for (int i = gi->spAt(gid); i < gi->spAt(gid + 1); i++) {
+			if (i == sid) { hits.push_back(std::make_pair(sid, fr)); continue; }
+			const std::string& other = refs.getRef(i).getSeq();
+			for (size_t p = other.find(seq.c_str() + fr, 0, len); p != std::string::npos; p = other.find(seq.c_str() + fr, p + 1, len))
+				hits.push_back(std::make_pair(i, (int)p));
+		}
+	}
+
+	void addSingle(const std::string& name, const std::string& seq, const std::string& qual, int sid, std::vector<bam1_t*>& records, int& n) {
+		Truth truth;
+		Mate mate = { &seq, &qual, 0, false };
+		std::string qname = baseName(name);
+
+		parseName(name, sid, truth);
+		if (sid == 0) {
+			fill(next(records, n), qname, BAM_FUNMAP, -1, -1, -1, -1, 0, 0, mate, 1, 1, truth);
+			return;
+		}
+
+		int len = seq.length(), totLen = refs.getRef(sid).getTotLen();
+		mate.rev = truth.dir != 0;
+		std::vector<std::pair<int, int> > hits;
+		findHits(sid, truth.dir == 0 ? truth.pos : totLen - truth.pos - len, len, hits);
+		for (size_t i = 0; i < hits.size(); i++)
+			fill(next(records, n), qname, mate.rev ? BAM_FREVERSE : 0, hits[i].first - 1, hits[i].second, -1, -1, 0, hits.size() == 1 ? 255 : 0, mate, hits.size(), i + 1, truth);
+	}
+
+	void addPaired(const std::string& name, const std::string& seq1, const std::string& qual1, const std::string& seq2, const std::string& qual2, int sid,
+		       std::vector<bam1_t*>& records, int& n) {
+		Truth truth;
+		Mate mate1 = { &seq1, &qual1, 0, false }, mate2 = { &seq2, &qual2, 0, false };
+		std::string qname = baseName(name);
+
+		parseName(name, sid, truth);
+		if (sid == 0) {
+			fill(next(records, n), qname, BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP | BAM_FREAD1, -1, -1, -1, -1, 0, 0, mate1, 1, 1, truth);
+			fill(next(records, n), qname, BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP | BAM_FREAD2, -1, -1, -1, -1, 0, 0, mate2, 1, 1, truth);
+			return;
+		}
+
+		int len = truth.insertL, totLen = refs.getRef(sid).getTotLen();
+		if (truth.dir == 0) { mate2.offset = len - seq2.length(); mate2.rev = true; }
+		else { mate1.offset = len - seq1.length(); mate1.rev = true; }
+
+		std::vector<std::pair<int, int> > hits;
+		findHits(sid, truth.dir == 0 ? truth.pos : totLen - truth.pos - len, len, hits);
+		for (size_t i = 0; i < hits.size(); i++) {
+			int tid = hits[i].first - 1, pos1 = hits[i].second + mate1.offset, pos2 = hits[i].second + mate2.offset, mapq = hits.size() == 1 ? 255 : 0;
+			uint16_t flag = BAM_FPAIRED | BAM_FPROPER_PAIR;
+			fill(next(records, n), qname, flag | BAM_FREAD1 | (mate1.rev ? BAM_FREVERSE : 0) | (mate2.rev ? BAM_FMREVERSE : 0), tid, pos1, tid, pos2,
+			     mate1.offset == 0 ? len : -len, mapq, mate1, hits.size(), i + 1, truth);
+			fill(next(records, n), qname, flag | BAM_FREAD2 | (mate2.rev ? BAM_FREVERSE : 0) | (mate1.rev ? BAM_FMREVERSE : 0), tid, pos2, tid, pos1,
+			     mate2.offset == 0 ? len : -len, mapq, mate2, hits.size(), i + 1, truth);
+		}
+	}
+
+	static bam1_t* next(std::vector<bam1_t*>& records, int& n) {
+		if ((int)records.size() == n) records.push_back(bam_init1());
+		return records[n++];
+	}
+
+	static void appendInt(std::vector<uint8_t>& data, const char* tag, int32_t value) {
+		data.push_back(tag[0]); data.push_back(tag[1]); data.push_back('i');
+		for (int i = 0; i < 4; i++) data.push_back((uint32_t)value >> (8 * i) & 0xff);
+	}
+
+	static void fill(bam1_t* b, const std::string& qname, uint16_t flag, int tid, int pos, int mtid, int mpos, int isize, int mapq, const Mate& mate,
+			 int nh, int hi, const Truth& truth) {
+		static const char rbase[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 }; // complements of the 4-bit codes
+		const std::string &seq = *mate.seq, &qual = *mate.qual;
+		int len = seq.length();
+		bool mapped = !(flag & BAM_FUNMAP);
+		std::vector<uint8_t> data;
+
+		data.reserve(qname.length() + 1 + 4 + (len + 1) / 2 + len + 28);
+		data.insert(data.end(), qname.begin(), qname.end());
+		data.push_back(0);
+		if (mapped) {
+			uint32_t cigar = (uint32_t)len << BAM_CIGAR_SHIFT | BAM_CMATCH;
+			for (int i = 0; i < 4; i++) data.push_back(cigar >> (8 * i) & 0xff);
+		}
+		size_t fr = data.size();
+		data.resize(fr + (len + 1) / 2 + len, 0);
+		for (int i = 0; i < len; i++) {
+			int j = (mate.rev ? len - i - 1 : i), code = seq_nt16_table[(uint8_t)seq[j]];
+			if (mate.rev) code = rbase[code];
+			data[fr + i / 2] |= code << ((~i & 1) << 2);
+			data[fr + (len + 1) / 2 + i] = (qual.empty() ? 0xff : qual[j] - 33);
+		}
+		appendInt(data, "NH", nh);
+		appendInt(data, "HI", hi);
+		appendInt(data, "ZT", truth.sid);
+		appendInt(data, "ZD", truth.dir);
+		appendInt(data, "ZP", truth.pos);
+		if (flag & BAM_FPAIRED) appendInt(data, "ZI", truth.insertL);
+
+		b->core.tid = tid; b->core.pos = pos;
+		b->core.bin = hts_reg2bin(pos, mapped ? pos + len : pos + 1, 14, 5);
+		b->core.qual = mapq;
+		b->core.l_qname = qname.length() + 1;
+		b->core.flag = flag;
+		b->core.n_cigar = mapped ? 1 : 0;
+		b->core.l_qseq = len;
+		b->core.mtid = mtid; b->core.mpos = mpos;
+		b->core.isize = isize;
+
+		b->l_data = data.size();
+		if (b->m_data < b->l_data) {
+			b->m_data = b->l_data;
+			kroundup32(b->m_data);
+			b->data = (uint8_t*)realloc(b->data, b->m_data);
+			general_assert(b->data != NULL, "Cannot allocate memory for BAM records!");
+		}
+		memcpy(b->data, &data[0], b->l_data);
+	}
+};
+
+#endif /* SIMULATEDALIGNMENTS_H_ */
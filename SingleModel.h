@@ -231,8 +231,8 @@ public:
 
 	const LenDist& getGLD() { return *gld; }
 
-	void startSimulation(simul*, const std::vector<double>&);
-	bool simulate(READ_INT_TYPE, SingleRead&, int&);
+	void startSimulation(const std::vector<double>&);
+	bool simulate(simul*, READ_INT_TYPE, SingleRead&, int&);
 	void finishSimulation();
 
 	const double* getMW() { 
@@ -262,8 +262,7 @@ private:
 	Profile *pro;
 	NoiseProfile *npro;
 
-	simul *sampler; // for simulation
-	double *theta_cdf; // for simulation
+	AliasTable thetaTable; // for simulation
 
 	double *mw; // for masking
 
@@ -271,8 +270,7 @@ private:
 };
 
 void SingleModel::estimateFromReads(const char* readFN) {
-	int s;
-	char readFs[2][STRLEN];
+	char readF[STRLEN];
 	SingleRead read;
 
 	int n_warns = 0;
@@ -281,8 +279,8 @@ void SingleModel::estimateFromReads(const char* readFN) {
 	
 	for (int i = 0; i < 3; i++)
 		if (N[i] > 0) {
-			genReadFileNames(readFN, i, read_type, s, readFs);
-			ReadReader<SingleRead> reader(s, readFs, refs->hasPolyA(), seedLen); // allow calculation of calc_lq() function
+			genReadFileName(readFN, i, readF);
+			ReadReader<SingleRead> reader(readF, refs->hasPolyA(), seedLen); // allow calculation of calc_lq() function
 
 			READ_INT_TYPE cnt = 0;
 			while (reader.next(read)) {
@@ -396,27 +394,22 @@ void SingleModel::write(const char* outF) {
 	fclose(fo);
 }
 
-void SingleModel::startSimulation(simul* sampler, const std::vector<double>& theta) {
-	this->sampler = sampler;
+void SingleModel::startSimulation(const std::vector<double>& theta) {
+	thetaTable.build(&theta[0], M + 1);
 
-	theta_cdf = new double[M + 1];
-	for (int i = 0; i <= M; i++) {
-		theta_cdf[i] = theta[i];
-		if (i > 0) theta_cdf[i] += theta_cdf[i - 1];
-	}
-
-	rspd->startSimulation(M, refs);
+	gld->startSimulation();
+	if (mld != NULL) mld->startSimulation();
 	pro->startSimulation();
 	npro->startSimulation();
 }
 
-bool SingleModel::simulate(READ_INT_TYPE rid, SingleRead& read, int& sid) {
+bool SingleModel::simulate(simul* sampler, READ_INT_TYPE rid, SingleRead& read, int& sid) {
 	int dir, pos, readLen, fragLen;
 	std::string name;
 	std::string readseq;
 	std::ostringstream strout;
 
-	sid = sampler->sample(theta_cdf, M + 1);
+	sid = thetaTable.sample(sampler);
 
 	if (sid == 0) {
 		dir = pos = 0;
@@ -429,7 +422,7 @@ bool SingleModel::simulate(READ_INT_TYPE rid, SingleRead& read, int& sid) {
 		fragLen = gld->simulate(sampler, ref.getTotLen());
 		if (fragLen < 0) return false;
 		int effL = std::min(ref.getFullLen(), ref.getTotLen() - fragLen + 1);
-		pos = rspd->simulate(sampler, sid, effL);
+		pos = rspd->simulate(sampler, ref.getFullLen(), effL);
 		if (pos < 0) return false;
 		if (dir > 0) pos = ref.getTotLen() - pos - fragLen;
 
@@ -452,9 +445,8 @@ bool SingleModel::simulate(READ_INT_TYPE rid, SingleRead& read, int& sid) {
 }
 
 void SingleModel::finishSimulation() {
-	delete[] theta_cdf;
-
-	rspd->finishSimulation();
+	gld->finishSimulation();
+	if (mld != NULL) mld->finishSimulation();
 	pro->finishSimulation();
 	npro->finishSimulation();
 }
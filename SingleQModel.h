@@ -239,8 +239,8 @@ public:
 
 	const LenDist& getGLD() { return *gld; }
 
-	void startSimulation(simul*, const std::vector<double>&);
-	bool simulate(READ_INT_TYPE, SingleReadQ&, int&);
+	void startSimulation(const std::vector<double>&);
+	bool simulate(simul*, READ_INT_TYPE, SingleReadQ&, int&);
 	void finishSimulation();
 
 	//Use it after function 'read' or 'estimateFromReads'
@@ -272,8 +272,7 @@ private:
 	QProfile *qpro;
 	NoiseQProfile *nqpro;
 
-	simul *sampler; // for simulation
-	double *theta_cdf; // for simulation
+	AliasTable thetaTable; // for simulation
 
 	double *mw; // for masking
 
@@ -281,8 +280,7 @@ private:
 };
 
 void SingleQModel::estimateFromReads(const char* readFN) {
-	int s;
-	char readFs[2][STRLEN];
+	char readF[STRLEN];
 	SingleReadQ read;
 
 	int n_warns = 0;
@@ -291,8 +289,8 @@ void SingleQModel::estimateFromReads(const char* readFN) {
 	
 	for (int i = 0; i < 3; i++)
 		if (N[i] > 0) {
-			genReadFileNames(readFN, i, read_type, s, readFs);
-			ReadReader<SingleReadQ> reader(s, readFs, refs->hasPolyA(), seedLen); // allow calculation of calc_lq() function
+			genReadFileName(readFN, i, readF);
+			ReadReader<SingleReadQ> reader(readF, refs->hasPolyA(), seedLen); // allow calculation of calc_lq() function
 
 			READ_INT_TYPE cnt = 0;
 			while (reader.next(read)) {
@@ -410,28 +408,23 @@ void SingleQModel::write(const char* outF) {
 	fclose(fo);
 }
 
-void SingleQModel::startSimulation(simul* sampler, const std::vector<double>& theta) {
-	this->sampler = sampler;
+void SingleQModel::startSimulation(const std::vector<double>& theta) {
+	thetaTable.build(&theta[0], M + 1);
 
-	theta_cdf = new double[M + 1];
-	for (int i = 0; i <= M; i++) {
-		theta_cdf[i] = theta[i];
-		if (i > 0) theta_cdf[i] += theta_cdf[i - 1];
-	}
-
-	rspd->startSimulation(M, refs);
+	gld->startSimulation();
+	if (mld != NULL) mld->startSimulation();
 	qd->startSimulation();
 	qpro->startSimulation();
 	nqpro->startSimulation();
 }
 
-bool SingleQModel::simulate(READ_INT_TYPE rid, SingleReadQ& read, int& sid) {
+bool SingleQModel::simulate(simul* sampler, READ_INT_TYPE rid, SingleReadQ& read, int& sid) {
 	int dir, pos, readLen, fragLen;
 	std::string name;
 	std::string qual, readseq;
 	std::ostringstream strout;
 
-	sid = sampler->sample(theta_cdf, M + 1);
+	sid = thetaTable.sample(sampler);
 
 	if (sid == 0) {
 		dir = pos = 0;
@@ -446,7 +439,7 @@ bool SingleQModel::simulate(READ_INT_TYPE rid, SingleReadQ& read, int& sid) {
 		if (fragLen < 0) return false;
 
 		int effL = std::min(ref.getFullLen(), ref.getTotLen() - fragLen + 1);
-		pos = rspd->simulate(sampler, sid, effL);
+		pos = rspd->simulate(sampler, ref.getFullLen(), effL);
 		if (pos < 0) return false;
 		if (dir > 0) pos = ref.getTotLen() - pos - fragLen;
 
@@ -471,9 +464,8 @@ bool SingleQModel::simulate(READ_INT_TYPE rid, SingleReadQ& read, int& sid) {
 }
 
 void SingleQModel::finishSimulation() {
-	delete[] theta_cdf;
-
-	rspd->finishSimulation();
+	gld->finishSimulation();
+	if (mld != NULL) mld->finishSimulation();
 	qd->finishSimulation();
 	qpro->finishSimulation();
 	nqpro->finishSimulation();
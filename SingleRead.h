@@ -10,6 +10,7 @@
 
 #include "utils.h"
 #include "Read.h"
+#include "pack_utils.h"
 
 class SingleRead : public Read {
 public:
@@ -20,9 +21,30 @@ public:
 		this->len = readseq.length();
 	}
 
+	// Take over the contents of name and readseq, which receive the old buffers for reuse
+	void fill(std::string& name, std::string& readseq) {
+		this->name.swap(name);
+		this->readseq.swap(readseq);
+		len = this->readseq.length();
+		low_quality = false;
+	}
+
 	bool read(int argc, std::istream* argv[], int flags = 7);
 	void write(int argc, std::ostream* argv[]);
 
+	// binary record, see pack_utils.h; unpack loads the same fields as read() does
+	void pack(std::string& buf) const {
+		pack_string(buf, name);
+		pack_bases(buf, readseq);
+	}
+
+	void unpack(const char*& p, int flags = 7) {
+		unpack_string(p, (flags & 4) ? &name : NULL);
+		if (!(flags & 4)) name.clear();
+		len = unpack_bases(p, (flags & 1) ? &readseq : NULL);
+		if (!(flags & 1)) readseq.clear();
+	}
+
 	const int getReadLength() const { return len; /*readseq.length();*/ } // If need memory and .length() are guaranteed O(1), use statement in /* */
 	const std::string& getReadSeq() const { return readseq; }
 
@@ -10,6 +10,7 @@
 
 #include "utils.h"
 #include "Read.h"
+#include "pack_utils.h"
 
 class SingleReadQ : public Read {
 public:
@@ -21,9 +22,34 @@ public:
 		this->len = readseq.length();
 	}
 
+	// Take over the contents of name, readseq and qscore, which receive the old buffers for reuse
+	void fill(std::string& name, std::string& readseq, std::string& qscore) {
+		this->name.swap(name);
+		this->readseq.swap(readseq);
+		this->qscore.swap(qscore);
+		len = this->readseq.length();
+		low_quality = false;
+	}
+
 	bool read(int argc, std::istream* argv[], int flags = 7);
 	void write(int argc, std::ostream* argv[]);
 
+	// binary record, see pack_utils.h; unpack loads the same fields as read() does
+	void pack(std::string& buf) const {
+		pack_string(buf, name);
+		pack_bases(buf, readseq);
+		pack_quals(buf, qscore);
+	}
+
+	void unpack(const char*& p, int flags = 7) {
+		unpack_string(p, (flags & 4) ? &name : NULL);
+		if (!(flags & 4)) name.clear();
+		len = unpack_bases(p, (flags & 1) ? &readseq : NULL);
+		if (!(flags & 1)) readseq.clear();
+		unpack_quals(p, len, (flags & 2) ? &qscore : NULL);
+		if (!(flags & 2)) qscore.clear();
+	}
+
 	int getReadLength() const { return len; }
 	const std::string& getReadSeq() const { return readseq; }
 	const std::string& getQScore() const { return qscore; }
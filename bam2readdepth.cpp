@@ -1,7 +1,6 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
-#include <fstream>
 
 #include "my_assert.h"
 #include "wiggle.h"
@@ -9,19 +8,18 @@
 using namespace std;
 
 int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    printf("Usage: rsem-bam2readdepth sorted_bam_input readdepth_output\n");
+  int num_threads = 1;
+
+  if (argc == 5 && !strcmp(argv[3], "-p")) num_threads = atoi(argv[4]);
+  if ((argc != 3 && argc != 5) || num_threads < 1) {
+    printf("Usage: rsem-bam2readdepth sorted_bam_input readdepth_output [-p num_threads]\n");
+    printf("readdepth_output is a binary file, use rsem-query-readdepth to read it. -p builds the read depths of num_threads transcripts in parallel if sorted_bam_input is indexed.\n");
     exit(-1);
   }
 
-  ofstream fout(argv[2]);
-  general_assert(fout.is_open(), "Cannot write to " + cstrtos(argv[2]) + "!");
-
-  ReadDepthWriter depth_writer(fout);
+  ReadDepthWriter depth_writer(argv[2]);
   
-  build_wiggles(argv[1], depth_writer);
-
-  fout.close();
+  build_wiggles(argv[1], depth_writer, num_threads);
 
   return 0;
 }
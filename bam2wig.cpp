@@ -7,21 +7,37 @@
 using namespace std;
 
 void printUsage() {
-  printf("Usage: rsem-bam2wig sorted_alignment_file wig_output wiggle_name [--no-fractional-weight]\n");
+  printf("Usage: rsem-bam2wig sorted_alignment_file wig_output wiggle_name [--no-fractional-weight] [--bigwig] [-p num_threads]\n");
   printf("sorted_alignment_file\t: Can be either in SAM/BAM/CRAM format, must be sorted\n");
   printf("wig_output\t\t: Output wiggle file's name, e.g. output.wig\n");
   printf("wiggle_name\t\t: the name of this wiggle plot\n");
-  printf("--no-fractional-weight\t: If this is set, RSEM will not look for \"ZW\" tag and each alignment appeared in the BAM file has weight 1. Set this if your BAM file is not generated by RSEM. Please note that this option must be at the end of the command line.\n");
+  printf("--no-fractional-weight\t: If this is set, RSEM will not look for \"ZW\" tag and each alignment appeared in the BAM file has weight 1. Set this if your BAM file is not generated by RSEM. \n");
+  printf("--bigwig\t\t: Write wig_output in bigWig format, e.g. output.bw. wiggle_name is not used\n");
+  printf("-p num_threads\t\t: Build the wiggles of num_threads chromosomes in parallel. This requires sorted_alignment_file to be indexed. Each thread holds the wiggle of a whole chromosome (8 bytes per base), so memory grows num_threads times (default: 1)\n");
   exit(-1);
 }
 
 int main(int argc, char* argv[]) {
-	if (argc < 4 || argc > 5) { printf("Number of arguments is not correct!\n"); printUsage(); }
-	if (argc == 5 && strcmp(argv[4], "--no-fractional-weight")) { printf("Cannot recognize option %s!\n", argv[4]); printUsage(); }
+	if (argc < 4) { printf("Number of arguments is not correct!\n"); printUsage(); }
 
-	no_fractional_weight = (argc == 5 && !strcmp(argv[4], "--no-fractional-weight"));
-	UCSCWiggleTrackWriter track_writer(argv[2], argv[3]);
-	build_wiggles(argv[1], track_writer);
+	bool bigwig = false;
+	int num_threads = 1;
+	for (int i = 4; i < argc; i++) {
+		if (!strcmp(argv[i], "--no-fractional-weight")) no_fractional_weight = true;
+		else if (!strcmp(argv[i], "--bigwig")) bigwig = true;
+		else if (!strcmp(argv[i], "-p") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else { printf("Cannot recognize option %s!\n", argv[i]); printUsage(); }
+	}
+	if (num_threads < 1) { printf("Number of threads must be positive!\n"); printUsage(); }
+
+	if (bigwig) {
+		BigWigWriter bigwig_writer(argv[2]);
+		build_wiggles(argv[1], bigwig_writer, num_threads);
+	}
+	else {
+		UCSCWiggleTrackWriter track_writer(argv[2], argv[3]);
+		build_wiggles(argv[1], track_writer, num_threads);
+	}
 
 	return 0;
 }
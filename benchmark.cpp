@@ -0,0 +1,383 @@
+#include<cmath>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<cassert>
+#include<string>
+#include<vector>
+#include<fstream>
+#include<sys/time.h>
+
+#include "utils.h"
+#include "my_assert.h"
+#include "simul.h"
+
+#include "Read.h"
+#include "SingleRead.h"
+#include "SingleReadQ.h"
+#include "PairedEndRead.h"
+#include "PairedEndReadQ.h"
+
+#include "SingleHit.h"
+#include "PairedEndHit.h"
+
+#include "Orientation.h"
+#include "LenDist.h"
+#include "RSPD.h"
+#include "Profile.h"
+#include "NoiseProfile.h"
+#include "QualDist.h"
+#include "QProfile.h"
+#include "NoiseQProfile.h"
+
+#include "ModelParams.h"
+#include "Model.h"
+#include "SingleModel.h"
+#include "SingleQModel.h"
+#include "PairedEndModel.h"
+#include "PairedEndQModel.h"
+
+#include "Refs.h"
+#include "Transcript.h"
+#include "Transcripts.h"
+#include "HitContainer.h"
+#include "ReadReader.h"
+
+using namespace std;
+
+/*
+  Helper of rsem-run-benchmarks. It generates the synthetic inputs of the benchmarked pipeline (transcripts, a model to
+  simulate reads from and the expression levels) and times the per-alignment kernels, getConPrb and the profile
+  probabilities, on the reads and alignments rsem-parse-alignments produced. Everything is deterministic given the seed.
+ */
+
+bool verbose = false;
+
+const int READLEN = 76; // length of simulated reads (mates)
+const double FRAGMENT_MEAN = 250.0, FRAGMENT_SD = 50.0;
+const int NQUALS = 2000; // quality strings used to build the quality score distribution
+
+void printUsage() {
+	printf("Usage: rsem-benchmark reference number_of_genes seed output_prefix\n");
+	printf("       rsem-benchmark model model_type seed output_model_file\n");
+	printf("       rsem-benchmark expression reference_name seed output_isoform_results\n");
+	printf("       rsem-benchmark kernels reference_name read_type imdName statName [--max-reads n] [--min-time seconds]\n\n");
+	printf("reference : write output_prefix.fa and output_prefix.gene_map, genes of 1 to 8 random exons and 1 to 4 isoforms each\n");
+	printf("model : write a model of type model_type (0 to 3, as read_type of rsem-run-em) for rsem-simulate-reads\n");
+	printf("expression : write log-normal TPMs over the transcripts of reference_name, 10%% of them unexpressed, in the layout of an isoforms.results file\n");
+	printf("kernels : time getConPrb and the profile probabilities over the first n (default: 200000) reads of imdName, repeating each pass until it takes at least the given seconds (default: 1) in total, and print the best time per call as JSON\n");
+	exit(-1);
+}
+
+double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+char randomBase(simul& sampler) {
+	return "ACGT"[int(sampler.random() * 4)];
+}
+
+string randomSeq(simul& sampler, int len) {
+	string seq(len, 'N');
+	for (int i = 0; i < len; i++) seq[i] = randomBase(sampler);
+	return seq;
+}
+
+// Quality strings decaying along the read, as Illumina's do
+string randomQual(simul& sampler, int len) {
+	string qual(len, ' ');
+	double q = 36.0 + sampler.random() * 5.0;
+	for (int i = 0; i < len; i++) {
+		q += (sampler.random() - 0.6) * 2.0;
+		q = max(2.0, min(41.0, q));
+		qual[i] = char(int(q) + 33);
+	}
+	return qual;
+}
+
+void genReference(int nGenes, unsigned int seed, const char* outPrefix) {
+	char faF[STRLEN], mapF[STRLEN];
+	simul sampler(seed);
+
+	sprintf(faF, "%s.fa", outPrefix);
+	sprintf(mapF, "%s.gene_map", outPrefix);
+	FILE *fa = fopen(faF, "w"), *fm = fopen(mapF, "w");
+	general_assert(fa != NULL && fm != NULL, "Cannot create " + cstrtos(faF) + " or " + cstrtos(mapF) + "!");
+
+	for (int g = 1; g <= nGenes; g++) {
+		int nExons = 1 + int(sampler.random() * 8), nIsoforms = 1 + int(sampler.random() * 4);
+		vector<string> exons(nExons);
+		for (int i = 0; i < nExons; i++) exons[i] = randomSeq(sampler, 50 + int(sampler.random() * 350));
+
+		// the first isoform keeps all exons, others skip each exon with probability 0.3
+		for (int k = 1; k <= nIsoforms; k++) {
+			string seq;
+			for (int i = 0; i < nExons; i++)
+				if (k == 1 || sampler.random() >= 0.3) seq += exons[i];
+			if (seq.empty()) seq = exons[int(sampler.random() * nExons)];
+
+			fprintf(fa, ">G%d.T%d\n", g, k);
+			for (size_t p = 0; p < seq.length(); p += 70) fprintf(fa, "%s\n", seq.substr(p, 70).c_str());
+			fprintf(fm, "G%d\tG%d.T%d\n", g, g, k);
+		}
+	}
+
+	fclose(fa);
+	fclose(fm);
+}
+
+void genModel(int model_type, unsigned int seed, const char* modelF) {
+	simul sampler(seed);
+	bool paired = model_type >= 2, hasQual = model_type % 2 == 1;
+	FILE *fo = fopen(modelF, "w");
+	general_assert(fo != NULL, "Cannot create " + cstrtos(modelF) + "!");
+
+	Orientation ori;
+	LenDist gld, mld;
+	RSPD rspd(false);
+
+	// gld is the fragment length distribution for paired-end models and the read length distribution otherwise
+	if (paired) {
+		gld.setAsNormal(FRAGMENT_MEAN, FRAGMENT_SD, READLEN, 1000);
+		mld.setAsNormal(READLEN, 0.0, 1, 1000);
+	}
+	else gld.setAsNormal(READLEN, 0.0, 1, 1000);
+
+	// same layout as the write() functions of the models
+	fprintf(fo, "%d\n\n", model_type);
+	ori.write(fo); fprintf(fo, "\n");
+	gld.write(fo); fprintf(fo, "\n");
+	if (paired) { mld.write(fo); fprintf(fo, "\n"); }
+	else { fprintf(fo, "0\n\n"); }
+	rspd.write(fo); fprintf(fo, "\n");
+
+	if (hasQual) {
+		QualDist qd;
+		QProfile qpro;
+		NoiseQProfile nqpro;
+		// strings longer than the reads, so that every quality a simulated read can reach has been seen followed by another
+		for (int i = 0; i < NQUALS; i++) {
+			string qual = randomQual(sampler, 4 * READLEN);
+			qd.update(qual);
+			nqpro.updateC(randomSeq(sampler, 4 * READLEN), qual);
+		}
+		qd.finish();
+		nqpro.calcInitParams();
+		qd.write(fo); fprintf(fo, "\n");
+		qpro.write(fo); fprintf(fo, "\n");
+		nqpro.write(fo);
+	}
+	else {
+		Profile pro;
+		NoiseProfile npro;
+		for (int i = 0; i < NQUALS; i++) npro.updateC(randomSeq(sampler, READLEN));
+		npro.calcInitParams();
+		pro.write(fo); fprintf(fo, "\n");
+		npro.write(fo);
+	}
+
+	fclose(fo);
+}
+
+void genExpression(const char* refName, unsigned int seed, const char* outF) {
+	char tiF[STRLEN];
+	Transcripts transcripts;
+	simul sampler(seed);
+
+	sprintf(tiF, "%s.ti", refName);
+	transcripts.readFrom(tiF);
+
+	FILE *fo = fopen(outF, "w");
+	general_assert(fo != NULL, "Cannot create " + cstrtos(outF) + "!");
+
+	int M = transcripts.getM();
+	vector<double> tpm(M + 1, 0.0);
+	double sum = 0.0;
+	for (int i = 1; i <= M; i++) {
+		double u1 = sampler.random(), u2 = sampler.random();
+		if (sampler.random() < 0.1) continue;
+		tpm[i] = exp(2.0 + 2.0 * sqrt(-2.0 * log(1.0 - u1)) * cos(2.0 * M_PI * u2)); // log-normal by Box-Muller
+		sum += tpm[i];
+	}
+
+	fprintf(fo, "transcript_id\tgene_id\tlength\teffective_length\texpected_count\tTPM\tFPKM\tIsoPct\n");
+	for (int i = 1; i <= M; i++) {
+		const Transcript& transcript = transcripts.getTranscriptAt(i);
+		fprintf(fo, "%s\t%s\t%d\t0.00\t0.00\t%.2f\t0.00\t0.00\n", transcript.getTranscriptID().c_str(), transcript.getGeneID().c_str(), transcript.getLength(), tpm[i] / sum * 1e6);
+	}
+
+	fclose(fo);
+}
+
+/* kernels */
+
+Refs refs;
+ModelParams mparams;
+READ_INT_TYPE maxReads;
+double minTime;
+
+Profile *pro;
+QProfile *qpro;
+
+// profile probabilities of the read (both mates for paired-end reads) at hit, summed into sum; returns the number of calls
+int profileProbs(const SingleRead& read, const SingleHit& hit, double& sum) {
+	sum += pro->getProb(read.getReadSeq(), refs.getRef(hit.getSid()), hit.getPos(), hit.getDir());
+	return 1;
+}
+
+int profileProbs(const SingleReadQ& read, const SingleHit& hit, double& sum) {
+	sum += qpro->getProb(read.getReadSeq(), read.getQScore(), refs.getRef(hit.getSid()), hit.getPos(), hit.getDir());
+	return 1;
+}
+
+int profileProbs(const PairedEndRead& read, const PairedEndHit& hit, double& sum) {
+	const RefSeq& ref = refs.getRef(hit.getSid());
+	sum += pro->getProb(read.getMate1().getReadSeq(), ref, hit.getPos(), hit.getDir());
+	sum += pro->getProb(read.getMate2().getReadSeq(), ref, ref.getTotLen() - hit.getPos() - hit.getInsertL(), !hit.getDir());
+	return 2;
+}
+
+int profileProbs(const PairedEndReadQ& read, const PairedEndHit& hit, double& sum) {
+	const RefSeq& ref = refs.getRef(hit.getSid());
+	const SingleReadQ &mate1 = read.getMate1(), &mate2 = read.getMate2();
+	sum += qpro->getProb(mate1.getReadSeq(), mate1.getQScore(), ref, hit.getPos(), hit.getDir());
+	sum += qpro->getProb(mate2.getReadSeq(), mate2.getQScore(), ref, ref.getTotLen() - hit.getPos() - hit.getInsertL(), !hit.getDir());
+	return 2;
+}
+
+void printTiming(const char* name, long long calls, double best, bool last) {
+	printf("    \"%s\": { \"calls\": %lld, \"ns_per_call\": %.2f }%s\n", name, calls, calls > 0 ? best / calls * 1e9 : 0.0, last ? "" : ",");
+}
+
+template<class ReadType, class HitType, class ModelType>
+void timeKernels(const char* imdName, int read_type) {
+	char readF[STRLEN], datF[STRLEN];
+	READ_INT_TYPE nReads;
+	HIT_INT_TYPE nHits;
+	int rt;
+
+	ModelType model(mparams);
+	model.estimateFromReads(imdName);
+
+	sprintf(datF, "%s.dat", imdName);
+	ifstream fin(datF);
+	general_assert(fin.is_open(), "Cannot open " + cstrtos(datF) + "! It may not exist.");
+	fin>> nReads>> nHits>> rt;
+	general_assert(rt == read_type, "Data file (.dat) does not have the right read type!");
+
+	HitContainer<HitType> hitv;
+	READ_INT_TYPE N = min(nReads, maxReads);
+	for (READ_INT_TYPE i = 0; i < N; i++) general_assert(hitv.read(fin), "Cannot read alignments from .dat file!");
+	fin.close();
+
+	genReadFileName(imdName, 1, readF);
+	ReadReader<ReadType> reader(readF, refs.hasPolyA(), mparams.seedLen);
+	vector<ReadType> reads(N);
+	for (READ_INT_TYPE i = 0; i < N; i++) general_assert(reader.next(reads[i]), "Can not load a read!");
+
+	// getConPrb, as computed in the first E-step
+	long long calls = 0;
+	double sum = 0.0, best = 1e100, total = 0.0;
+	for (int rep = 0; rep < 3 || total < minTime; rep++) {
+		double start = now();
+		calls = 0; sum = 0.0;
+		for (READ_INT_TYPE i = 0; i < N; i++)
+			for (HIT_INT_TYPE j = hitv.getSAt(i); j < hitv.getSAt(i + 1); j++, calls++)
+				sum += model.getConPrb(reads[i], hitv.getHitAt(j));
+		double elapsed = now() - start;
+		best = min(best, elapsed); total += elapsed;
+	}
+	long long conPrbCalls = calls;
+	double conPrbBest = best, conPrbSum = sum;
+
+	pro = new Profile(mparams.maxL);
+	qpro = new QProfile();
+	best = 1e100; total = 0.0;
+	for (int rep = 0; rep < 3 || total < minTime; rep++) {
+		double start = now();
+		calls = 0; sum = 0.0;
+		for (READ_INT_TYPE i = 0; i < N; i++)
+			for (HIT_INT_TYPE j = hitv.getSAt(i); j < hitv.getSAt(i + 1); j++)
+				calls += profileProbs(reads[i], hitv.getHitAt(j), sum);
+		double elapsed = now() - start;
+		best = min(best, elapsed); total += elapsed;
+	}
+	delete pro;
+	delete qpro;
+
+	printf("{\n");
+	printf("  \"model_type\": %d,\n", read_type);
+	printf("  \"reads\": %lld,\n", (long long)N);
+	printf("  \"alignments\": %lld,\n", (long long)hitv.getNHits());
+	printf("  \"checksum\": %.10g,\n", conPrbSum + sum); // of one pass of each; also keeps the loops from being optimized away
+	printf("  \"kernels\": {\n");
+	printTiming("getConPrb", conPrbCalls, conPrbBest, false);
+	printTiming(read_type % 2 == 1 ? "QProfile::getProb" : "Profile::getProb", calls, best, true);
+	printf("  }\n");
+	printf("}\n");
+}
+
+void timeKernels(const char* refName, int read_type, const char* imdName, const char* statName) {
+	char refF[STRLEN], cntF[STRLEN], mparamsF[STRLEN];
+	READ_INT_TYPE N0, N1, N2, N_tot;
+	ifstream fin;
+
+	sprintf(refF, "%s.seq", refName);
+	refs.loadRefs(refF);
+
+	sprintf(cntF, "%s.cnt", statName);
+	fin.open(cntF);
+	general_assert(fin.is_open(), "Cannot open " + cstrtos(cntF) + "! It may not exist.");
+	fin>> N0>> N1>> N2>> N_tot;
+	fin.close();
+	general_assert(N1 > 0, "There are no alignable reads!");
+
+	mparams.M = refs.getM();
+	mparams.N[0] = N0; mparams.N[1] = N1; mparams.N[2] = N2;
+	mparams.refs = &refs;
+
+	sprintf(mparamsF, "%s.mparams", imdName);
+	fin.open(mparamsF);
+	general_assert(fin.is_open(), "Cannot open " + cstrtos(mparamsF) + "! It may not exist.");
+	fin>> mparams.minL>> mparams.maxL>> mparams.probF;
+	int val; // 0 or 1 , for estRSPD
+	fin>> val;
+	mparams.estRSPD = (val != 0);
+	fin>> mparams.B>> mparams.mate_minL>> mparams.mate_maxL>> mparams.mean>> mparams.sd;
+	fin>> mparams.seedLen;
+	fin.close();
+
+	switch(read_type) {
+	case 0 : timeKernels<SingleRead, SingleHit, SingleModel>(imdName, read_type); break;
+	case 1 : timeKernels<SingleReadQ, SingleHit, SingleQModel>(imdName, read_type); break;
+	case 2 : timeKernels<PairedEndRead, PairedEndHit, PairedEndModel>(imdName, read_type); break;
+	case 3 : timeKernels<PairedEndReadQ, PairedEndHit, PairedEndQModel>(imdName, read_type); break;
+	default : fprintf(stderr, "Unknown Read Type!\n"); exit(-1);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) printUsage();
+
+	if (!strcmp(argv[1], "reference") && argc == 5) genReference(atoi(argv[2]), strtoul(argv[3], NULL, 10), argv[4]);
+	else if (!strcmp(argv[1], "model") && argc == 5) {
+		int model_type = atoi(argv[2]);
+		general_assert(model_type >= 0 && model_type <= 3, "Unknown model type " + cstrtos(argv[2]) + "!");
+		genModel(model_type, strtoul(argv[3], NULL, 10), argv[4]);
+	}
+	else if (!strcmp(argv[1], "expression") && argc == 5) genExpression(argv[2], strtoul(argv[3], NULL, 10), argv[4]);
+	else if (!strcmp(argv[1], "kernels") && argc >= 6) {
+		maxReads = 200000;
+		minTime = 1.0;
+		for (int i = 6; i + 1 < argc; i++) {
+			if (!strcmp(argv[i], "--max-reads")) maxReads = atoll(argv[i + 1]);
+			if (!strcmp(argv[i], "--min-time")) minTime = atof(argv[i + 1]);
+		}
+		timeKernels(argv[2], atoi(argv[3]), argv[4], argv[5]);
+	}
+	else printUsage();
+
+	return 0;
+}
@@ -6,6 +6,8 @@
 #include<fstream>
 #include<algorithm>
 #include<vector>
+#include<fcntl.h>
+#include<unistd.h>
 #include<pthread.h>
 
 #include "utils.h"
@@ -23,16 +25,19 @@
 #include "WriteResults.h"
 
 #include "Buffer.h"
+#include "QuantileSketch.h"
 
 using namespace std;
 
 bool verbose = true;
 
 struct Params {
-	int no;
+	int no, nCV; // nCV: number of count vectors in fi
+	int num_threads;
 	FILE *fi;
 	engine_type *engine;
 	const double *mw;
+	Buffer *buffer;
 };
 
 struct CIParams {
@@ -76,8 +81,6 @@ GroupInfo ta;
 
 vector<double> eel; //expected effective lengths
 
-Buffer *buffer;
-
 bool quiet;
 
 Params *paramsArray;
@@ -90,75 +93,229 @@ seedType seed;
 
 CIParams *ciParamsArray;
 
+// Quantile sketch mode: samples are summarized on the fly instead of being written to the temporary file
+int sketchC; // compression of the sketches, 0 means the exact mode
+QuantileSketch *tpm_sk, *fpkm_sk, *gene_tpm_sk, *gene_fpkm_sk;
+QuantileSketch *iso_tpm_sk = NULL, *iso_fpkm_sk = NULL;
+int nStripes;
+int *stripes; // sketches of genes stripes[i] .. stripes[i + 1] - 1 are guarded by locks[i]
+pthread_mutex_t *locks;
+int *turns; // count vectors feed stripe i in the order of their tickets, turns[i] is the ticket due next
+pthread_cond_t *turn_changed;
+
+void init_sketches(int num_threads) {
+	tpm_sk = new QuantileSketch[M + 1];
+	fpkm_sk = new QuantileSketch[M + 1];
+	for (int j = 1; j <= M; j++) {
+		tpm_sk[j].init(sketchC);
+		fpkm_sk[j].init(sketchC);
+	}
+
+	// groups with only one member reuse the member's interval, they need no sketch
+	gene_tpm_sk = new QuantileSketch[m];
+	gene_fpkm_sk = new QuantileSketch[m];
+	for (int i = 0; i < m; i++)
+		if (gi.spAt(i + 1) - gi.spAt(i) > 1) {
+			gene_tpm_sk[i].init(sketchC);
+			gene_fpkm_sk[i].init(sketchC);
+		}
+
+	if (alleleS) {
+		iso_tpm_sk = new QuantileSketch[m_trans];
+		iso_fpkm_sk = new QuantileSketch[m_trans];
+		for (int i = 0; i < m_trans; i++)
+			if (ta.spAt(i + 1) - ta.spAt(i) > 1) {
+				iso_tpm_sk[i].init(sketchC);
+				iso_fpkm_sk[i].init(sketchC);
+			}
+	}
+
+	// cut genes into stripes of about the same number of transcripts
+	nStripes = min(m, 16 * num_threads);
+	stripes = new int[nStripes + 1];
+	locks = new pthread_mutex_t[nStripes];
+	turns = new int[nStripes];
+	turn_changed = new pthread_cond_t[nStripes];
+	stripes[0] = 0;
+	for (int i = 1, gid = 0; i < nStripes; i++) {
+		while (gid < m && gi.spAt(gid) - 1 < double(M) * i / nStripes) ++gid;
+		stripes[i] = max(gid, stripes[i - 1]);
+	}
+	stripes[nStripes] = m;
+	for (int i = 0; i < nStripes; i++) {
+		pthread_mutex_init(&locks[i], NULL);
+		pthread_cond_init(&turn_changed[i], NULL);
+		turns[i] = 0;
+	}
+}
+
+void release_sketches() {
+	delete[] tpm_sk;
+	delete[] fpkm_sk;
+	delete[] gene_tpm_sk;
+	delete[] gene_fpkm_sk;
+	if (alleleS) {
+		delete[] iso_tpm_sk;
+		delete[] iso_fpkm_sk;
+	}
+
+	for (int i = 0; i < nStripes; i++) {
+		pthread_mutex_destroy(&locks[i]);
+		pthread_cond_destroy(&turn_changed[i]);
+	}
+	delete[] stripes;
+	delete[] locks;
+	delete[] turns;
+	delete[] turn_changed;
+}
+
+// Add the nSpC samples drawn from the cnt-th count vector of thread no to the sketches. batch is sample-major, M values per sample.
+// A sketch depends on the order of its samples, so every stripe takes count vectors in the order of their tickets
+// cnt * num_threads + no, whichever thread comes first. Threads walk the stripes in the same order and follow each other.
+void update_sketches(int no, int num_threads, int cnt, const float *batch, const float *lbs, float *scratch) {
+	float *fsamples = scratch, *gtsamples = scratch + nSpC, *gfsamples = scratch + 2 * nSpC;
+	float *itsamples = scratch + 3 * nSpC, *ifsamples = scratch + 4 * nSpC;
+	int ticket = cnt * num_threads + no;
+
+	for (int sid = 0; sid < nStripes; sid++) {
+		pthread_assert(pthread_mutex_lock(&locks[sid]), "pthread_mutex_lock", "Error occurred while acquiring the lock!");
+		while (turns[sid] != ticket) pthread_cond_wait(&turn_changed[sid], &locks[sid]);
+		for (int i = stripes[sid]; i < stripes[sid + 1]; i++) {
+			int b = gi.spAt(i), e = gi.spAt(i + 1);
+			memset(gtsamples, 0, FLOATSIZE * nSpC);
+			memset(gfsamples, 0, FLOATSIZE * nSpC);
+			for (int j = b; j < e; j++) {
+				for (int k = 0; k < nSpC; k++) {
+					float tsample = batch[k * M + j - 1];
+					fsamples[k] = 1e3 / lbs[k] * tsample;
+					tpm_sk[j].add(tsample);
+					fpkm_sk[j].add(fsamples[k]);
+					gtsamples[k] += tsample;
+					gfsamples[k] += fsamples[k];
+				}
+
+				if (alleleS) {
+					int tid = ta.gidAt(j);
+					int ab = ta.spAt(tid), ae = ta.spAt(tid + 1);
+					if (ae - ab > 1) {
+						if (j == ab) {
+							memset(itsamples, 0, FLOATSIZE * nSpC);
+							memset(ifsamples, 0, FLOATSIZE * nSpC);
+						}
+						for (int k = 0; k < nSpC; k++) {
+							itsamples[k] += batch[k * M + j - 1];
+							ifsamples[k] += fsamples[k];
+						}
+						if (j == ae - 1)
+							for (int k = 0; k < nSpC; k++) {
+								iso_tpm_sk[tid].add(itsamples[k]);
+								iso_fpkm_sk[tid].add(ifsamples[k]);
+							}
+					}
+				}
+			}
+
+			if (e - b > 1)
+				for (int k = 0; k < nSpC; k++) {
+					gene_tpm_sk[i].add(gtsamples[k]);
+					gene_fpkm_sk[i].add(gfsamples[k]);
+				}
+		}
+		++turns[sid];
+		pthread_cond_broadcast(&turn_changed[sid]);
+		pthread_assert(pthread_mutex_unlock(&locks[sid]), "pthread_mutex_unlock", "Error occurred while releasing the lock!");
+	}
+}
+
 void* sample_theta_from_c(void* arg) {
 	int *cvec;
-	double *theta;
+	int *ids; // transcripts with a positive sampling probability
+	double *w, *val;
+	gamma_shape *shapes;
 	float *tpm;
-	gamma_dist **gammas;
-	gamma_generator **rgs;
+	float *batch = NULL, *lbs = NULL, *scratch = NULL; // sketch mode: samples of the current count vector
 
 	Params *params = (Params*)arg;
 	FILE *fi = params->fi;
 	const double *mw = params->mw;
 
 	cvec = new int[M + 1];
-	theta = new double[M + 1];
-	gammas = new gamma_dist*[M + 1];
-	rgs = new gamma_generator*[M + 1];
+	ids = new int[M];
+	w = new double[M + 1];
+	val = new double[M];
+	shapes = new gamma_shape[M];
 	tpm = new float[M + 1];
 	float l_bar; // the mean transcript length over the sample
 
+	if (sketchC > 0) {
+		batch = new float[nSpC * M];
+		lbs = new float[nSpC];
+		scratch = new float[5 * nSpC];
+	}
+
+	// theta[j] = gamma_j / mw[j] / sum and tpm[j] = theta[j] / eel[j] / sum', the two normalizations fold into one
+	for (int j = 1; j <= M; j++) w[j] = (eel[j] >= EPSILON && mw[j] >= EPSILON ? 1.0 / (mw[j] * eel[j]) : 0.0);
+
+	gamma_sampler rg(*params->engine);
+
 	int cnt = 0;
 	while (fscanf(fi, "%d", &cvec[0]) == 1) {
 		for (int j = 1; j <= M; j++) assert(fscanf(fi, "%d", &cvec[j]) == 1);
 		assert(cvec[0] >= 0);
 
+		// Each count vector has its own stream, addressed by its file and line number
+		params->engine->set_stream((streamType(params->no) << 32) | streamType(cnt));
+		rg.reset();
 		++cnt;
 
-		for (int j = 0; j <= M; j++) {
-		  gammas[j] = NULL; rgs[j] = NULL;
-		  if (cvec[j] >= 0) {
-		    gammas[j] = new gamma_dist(cvec[j] + pseudoC);
-		    rgs[j] = new gamma_generator(*(params->engine), *gammas[j]);
-		  }
-		}
-		  
+		// theta[0] only contributes to the normalization constant, which cancels out in tpm, so it is not sampled
+		int n = 0;
+		for (int j = 1; j <= M; j++)
+			if (cvec[j] >= 0 && w[j] > 0.0) {
+				ids[n] = j;
+				shapes[n] = gamma_shape(cvec[j] + pseudoC);
+				++n;
+			}
+		memset(tpm, 0, sizeof(float) * (M + 1));
+
 		for (int i = 0; i < nSpC; i++) {
 			double sum = 0.0;
-			for (int j = 0; j <= M; j++) {
-				theta[j] = ((j == 0 || (cvec[j] >= 0 && eel[j] >= EPSILON && mw[j] >= EPSILON)) ? (*rgs[j])() / mw[j] : 0.0);
-				sum += theta[j];
+			for (int k = 0; k < n; k++) {
+				val[k] = rg(shapes[k]) * w[ids[k]];
+				sum += val[k];
 			}
 			assert(sum >= EPSILON);
-			for (int j = 0; j <= M; j++) theta[j] /= sum;
-
-			sum = 0.0;
-			tpm[0] = 0.0;
-			for (int j = 1; j <= M; j++)
-				if (eel[j] >= EPSILON) {
-					tpm[j] = theta[j] / eel[j];
-					sum += tpm[j];
-				}
-				else assert(theta[j] < EPSILON);
-			assert(sum >= EPSILON);
-			l_bar = 0.0; // store mean effective length of the sample
-			for (int j = 1; j <= M; j++) { tpm[j] /= sum; l_bar += tpm[j] * eel[j]; tpm[j] *= 1e6; }
-			buffer->write(l_bar, tpm + 1); // ommit the first element in tpm
-		}
 
-		for (int j = 0; j <= M; j++) {
-		  if (gammas[j] != NULL) delete gammas[j];
-		  if (rgs[j] != NULL) delete rgs[j];
+			double lsum = 0.0; // store mean effective length of the sample
+			for (int k = 0; k < n; k++) {
+				double frac = val[k] / sum;
+				lsum += frac * eel[ids[k]];
+				tpm[ids[k]] = frac * 1e6;
+			}
+			l_bar = lsum;
+			if (sketchC > 0) {
+				lbs[i] = l_bar;
+				memcpy(batch + i * M, tpm + 1, FLOATSIZE * M);
+			}
+			else params->buffer->write(l_bar, tpm + 1); // ommit the first element in tpm
 		}
+		if (sketchC > 0) update_sketches(params->no, params->num_threads, cnt - 1, batch, lbs, scratch);
 
 		if (verbose && cnt % 100 == 0) { printf("Thread %d, %d count vectors are processed!\n", params->no, cnt); }
 	}
+	general_assert(cnt == params->nCV, "Thread " + itos(params->no) + " expects " + itos(params->nCV) + " count vectors but reads " + itos(cnt) + "! Please use the same number of threads as the Gibbs sampler.");
 
 	delete[] cvec;
-	delete[] theta;
-	delete[] gammas;
-	delete[] rgs;
+	delete[] ids;
+	delete[] w;
+	delete[] val;
+	delete[] shapes;
 	delete[] tpm;
+	if (sketchC > 0) {
+		delete[] batch;
+		delete[] lbs;
+		delete[] scratch;
+	}
 
 	return NULL;
 }
@@ -171,21 +328,32 @@ void sample_theta_vectors_from_count_vectors() {
 
 	int num_threads = min(nThreads, nCV);
 
-	buffer = new Buffer(nMB, nSamples, M, l_bars, tmpF);
+	int fd = -1;
+	if (sketchC > 0) init_sketches(num_threads);
+	else {
+		fd = open(tmpF, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		general_assert(fd >= 0, "Cannot create " + cstrtos(tmpF) + "!");
+	}
 
 	paramsArray = new Params[num_threads];
 	threads = new pthread_t[num_threads];
 
+	// The Gibbs sampler splits nCV count vectors over its threads this way, thread i owns sample columns from start on
+	int quotient = nCV / num_threads, left = nCV % num_threads, start = 0;
 	char inpF[STRLEN];
 	hasSeed ? engineFactory::init(seed) : engineFactory::init();
 	for (int i = 0; i < num_threads; i++) {
 		paramsArray[i].no = i;
+		paramsArray[i].num_threads = num_threads;
+		paramsArray[i].nCV = quotient + (i < left ? 1 : 0);
 		sprintf(inpF, "%s%d", cvsF, i);
 		paramsArray[i].fi = fopen(inpF, "r");
-		paramsArray[i].engine = engineFactory::new_engine();
+		general_assert(paramsArray[i].fi != NULL, "Cannot open " + cstrtos(inpF) + "!");
+		paramsArray[i].engine = engineFactory::new_engine(0);
 		paramsArray[i].mw = model.getMW();
+		paramsArray[i].buffer = (sketchC > 0 ? NULL : new Buffer(max(nMB / num_threads, 1), nSamples, M, start, paramsArray[i].nCV * nSpC, l_bars, fd));
+		start += paramsArray[i].nCV * nSpC;
 	}
-	engineFactory::finish();
 
 	/* set thread attribute to be joinable */
 	pthread_attr_init(&attr);
@@ -207,22 +375,59 @@ void sample_theta_vectors_from_count_vectors() {
 	for (int i = 0; i < num_threads; i++) {
 		fclose(paramsArray[i].fi);
 		delete paramsArray[i].engine;
+		if (paramsArray[i].buffer != NULL) delete paramsArray[i].buffer; // Must delete here, force the content left in the buffer be written into the disk
 	}
 	delete[] paramsArray;
 
-	delete buffer; // Must delete here, force the content left in the buffer be written into the disk
+	if (fd >= 0) close(fd);
 
 	if (verbose) { printf("Sampling is finished!\n"); }
 }
 
+const int MIN_SELECT = 64; // below this many samples, a full sort is cheaper than selection
+
+// Order samples so that samples[0..lo] and samples[hi..nSamples - 1] are exactly as after a full sort.
+// Values tied with samples[lo] (samples[hi]) are moved right after lo (right before hi), so that
+// scanning tie runs from either tail gives the same positions as on fully sorted samples.
+void sort_tails(int nSamples, float *samples, int& lo, int& hi) {
+	if (nSamples < MIN_SELECT || hi - lo < 2) {
+		sort(samples, samples + nSamples);
+		lo = nSamples - 1; hi = nSamples;
+		return;
+	}
+
+	nth_element(samples, samples + lo, samples + nSamples);
+	nth_element(samples + lo + 1, samples + hi, samples + nSamples);
+	sort(samples, samples + lo);
+	sort(samples + hi + 1, samples + nSamples);
+
+	float vlo = samples[lo], vhi = samples[hi];
+	int l = lo + 1, r = hi - 1;
+	for (int i = l; i <= r; ) {
+		if (samples[i] == vlo) swap(samples[i++], samples[l++]);
+		else if (samples[i] == vhi) swap(samples[i], samples[r--]);
+		else ++i;
+	}
+}
+
+// The value of rank r. samples[from, hi) is the part of the middle not yet ordered by earlier calls, ranks must be non-decreasing
+inline float select_rank(float *samples, int r, int lo, int hi, int& from) {
+	if (r > lo && r < hi && r >= from) {
+		nth_element(samples + from, samples + r, samples + hi);
+		from = r + 1;
+	}
+	return samples[r];
+}
+
 void calcCI(int nSamples, float *samples, CIType& ci) {
 	int p, q; // p pointer for lb, q pointer for ub;
 	int newp, newq;
 	int threshold = nSamples - (int(confidence * nSamples - 1e-8) + 1);
 	int nOutside = 0;
 
-	// sort values
-	sort(samples, samples + nSamples);
+	// only the threshold + 1 smallest and largest values are visited by the interval search
+	int lo = threshold, hi = nSamples - 1 - threshold;
+	sort_tails(nSamples, samples, lo, hi);
 
 	// calculate credibility interval
 	p = 0; q = nSamples - 1;
@@ -266,23 +471,132 @@ void calcCI(int nSamples, float *samples, CIType& ci) {
 	// calculate Tukey's hinges
 	int quotient = nSamples / 4;
 	int residue = nSamples % 4;
+	int from = lo + 1;
 
 	if (residue == 0) {
-	  Q1 = (samples[quotient - 1] + samples[quotient]) / 2.0;
-	  Q3 = (samples[3 * quotient - 1] + samples[3 * quotient]) / 2.0;
+	  Q1 = select_rank(samples, quotient - 1, lo, hi, from);
+	  Q1 = (Q1 + select_rank(samples, quotient, lo, hi, from)) / 2.0;
+	  Q3 = select_rank(samples, 3 * quotient - 1, lo, hi, from);
+	  Q3 = (Q3 + select_rank(samples, 3 * quotient, lo, hi, from)) / 2.0;
 	}
 	else if (residue == 3) {
-	  Q1 = (samples[quotient] + samples[quotient + 1]) / 2.0;
-	  Q3 = (samples[quotient * 3 + 1] + samples[quotient * 3 + 2]) / 2.0;
+	  Q1 = select_rank(samples, quotient, lo, hi, from);
+	  Q1 = (Q1 + select_rank(samples, quotient + 1, lo, hi, from)) / 2.0;
+	  Q3 = select_rank(samples, quotient * 3 + 1, lo, hi, from);
+	  Q3 = (Q3 + select_rank(samples, quotient * 3 + 2, lo, hi, from)) / 2.0;
 	}
 	else {
-	  Q1 = samples[quotient];
-	  Q3 = samples[3 * quotient];
+	  Q1 = select_rank(samples, quotient, lo, hi, from);
+	  Q3 = select_rank(samples, 3 * quotient, lo, hi, from);
 	}
 
 	ci.cqv = (Q3 - Q1 > 0.0 ? (Q3 - Q1) / (Q3 + Q1) : 0.0);
 }
 
+// Credibility interval and CQV from a sketch. The interval width Q(p + L) - Q(p) is piecewise linear in the rank p,
+// so its minimum is at p = 0, p = threshold, or where p or p + L crosses the center of a centroid.
+void calcCI(QuantileSketch& sketch, CIType& ci, vector<double>& xs, vector<float>& lbs, vector<float>& ubs) {
+	sketch.compress();
+
+	int threshold = nSamples - (int(confidence * nSamples - 1e-8) + 1);
+	int L = nSamples - 1 - threshold;
+
+	xs.clear();
+	xs.push_back(0.5);
+	xs.push_back(threshold + 0.5);
+	double w = 0.0;
+	for (int i = 0; i < sketch.size(); i++) {
+		double center = w + sketch.weightAt(i) / 2.0 - 0.5; // as a rank
+		double ps[2] = { center, center - L };
+		w += sketch.weightAt(i);
+		for (int k = 0; k < 2; k++)
+			if (ps[k] >= 0.0 && ps[k] <= threshold) {
+				xs.push_back(floor(ps[k]) + 0.5);
+				xs.push_back(ceil(ps[k]) + 0.5);
+			}
+	}
+	sort(xs.begin(), xs.end());
+	xs.erase(unique(xs.begin(), xs.end()), xs.end());
+
+	sketch.valuesAt(xs, lbs);
+	for (size_t k = 0; k < xs.size(); k++) xs[k] += L;
+	sketch.valuesAt(xs, ubs);
+
+	ci.lb = -1e30; ci.ub = 1e30;
+	for (size_t k = 0; k < xs.size(); k++)
+		if (ubs[k] - lbs[k] < ci.ub - ci.lb) {
+			ci.lb = lbs[k];
+			ci.ub = ubs[k];
+		}
+
+	// Tukey's hinges, at the same ranks as in the exact mode
+	int quotient = nSamples / 4;
+	int residue = nSamples % 4;
+	float Q1, Q3;
+
+	xs.clear();
+	if (residue == 0) {
+	  xs.push_back(quotient - 0.5); xs.push_back(quotient + 0.5);
+	  xs.push_back(3 * quotient - 0.5); xs.push_back(3 * quotient + 0.5);
+	}
+	else if (residue == 3) {
+	  xs.push_back(quotient + 0.5); xs.push_back(quotient + 1.5);
+	  xs.push_back(3 * quotient + 1.5); xs.push_back(3 * quotient + 2.5);
+	}
+	else {
+	  xs.push_back(quotient + 0.5); xs.push_back(quotient + 0.5);
+	  xs.push_back(3 * quotient + 0.5); xs.push_back(3 * quotient + 0.5);
+	}
+	sketch.valuesAt(xs, lbs);
+	Q1 = (lbs[0] + lbs[1]) / 2.0;
+	Q3 = (lbs[2] + lbs[3]) / 2.0;
+
+	ci.cqv = (Q3 - Q1 > 0.0 ? (Q3 - Q1) / (Q3 + Q1) : 0.0);
+}
+
+void* calcCI_sketch_batch(void* arg) {
+	CIParams *ciParams = (CIParams*)arg;
+	vector<double> xs;
+	vector<float> lbs, ubs;
+
+	int cnt = 0;
+	for (int i = ciParams->start_gene_id; i < ciParams->end_gene_id; i++) {
+		int b = gi.spAt(i), e = gi.spAt(i + 1);
+		for (int j = b; j < e; j++) {
+			calcCI(tpm_sk[j], tpm[j], xs, lbs, ubs);
+			calcCI(fpkm_sk[j], fpkm[j], xs, lbs, ubs);
+
+			if (alleleS) {
+			  int tid = ta.gidAt(j);
+			  if (ta.spAt(tid + 1) - ta.spAt(tid) > 1) {
+			    if (j == ta.spAt(tid + 1) - 1) {
+			      calcCI(iso_tpm_sk[tid], iso_tpm[tid], xs, lbs, ubs);
+			      calcCI(iso_fpkm_sk[tid], iso_fpkm[tid], xs, lbs, ubs);
+			    }
+			  }
+			  else {
+			    iso_tpm[tid] = tpm[j];
+			    iso_fpkm[tid] = fpkm[j];
+			  }
+			}
+		}
+
+		if (e - b > 1) {
+		  calcCI(gene_tpm_sk[i], gene_tpm[i], xs, lbs, ubs);
+		  calcCI(gene_fpkm_sk[i], gene_fpkm[i], xs, lbs, ubs);
+		}
+		else {
+			gene_tpm[i] = tpm[b];
+			gene_fpkm[i] = fpkm[b];
+		}
+
+		++cnt;
+		if (verbose && cnt % 1000 == 0) { printf("In thread %d, %d genes are processed for CI calculation!\n", ciParams->no, cnt); }
+	}
+
+	return NULL;
+}
+
 void* calcCI_batch(void* arg) {
 	float *tsamples, *fsamples;
 	float *itsamples = NULL, *ifsamples = NULL, *gtsamples, *gfsamples;
@@ -330,11 +644,13 @@ void* calcCI_batch(void* arg) {
 			    }
 			    curtid = tid;
 			    curaid = j;
+			    memset(itsamples, 0, FLOATSIZE * nSamples);
+			    memset(ifsamples, 0, FLOATSIZE * nSamples);
 			  }
 			}
 
+			fin.read((char*)tsamples, FLOATSIZE * nSamples);
 			for (int k = 0; k < nSamples; k++) {
-				fin.read((char*)(&tsamples[k]), FLOATSIZE);
 				fsamples[k] = 1e3 / l_bars[k] * tsamples[k];
 				if (alleleS) {
 				  itsamples[k] += tsamples[k];
@@ -427,7 +743,7 @@ void calculate_credibility_intervals(char* imdName) {
 
 	// paralleling
 	for (int i = 0; i < num_threads; i++) {
-		rc = pthread_create(&threads[i], &attr, &calcCI_batch, (void*)(&ciParamsArray[i]));
+		rc = pthread_create(&threads[i], &attr, (sketchC > 0 ? &calcCI_sketch_batch : &calcCI_batch), (void*)(&ciParamsArray[i]));
 		pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) in calculate_credibility_intervals!");
 	}
 	for (int i = 0; i < num_threads; i++) {
@@ -443,6 +759,8 @@ void calculate_credibility_intervals(char* imdName) {
 
 	delete[] ciParamsArray;
 
+	if (sketchC > 0) release_sketches();
+
 	alleleS ? sprintf(outF, "%s.allele_res", imdName) : sprintf(outF, "%s.iso_res", imdName);
 	fo = fopen(outF, "a");
 	for (int i = 1; i <= M; i++)
@@ -509,7 +827,9 @@ void calculate_credibility_intervals(char* imdName) {
 
 int main(int argc, char* argv[]) {
 	if (argc < 8) {
-		printf("Usage: rsem-calculate-credibility-intervals reference_name imdName statName confidence nCV nSpC nMB [-p #Threads] [--seed seed] [--pseudo-count pseudo_count] [-q]\n");
+		printf("Usage: rsem-calculate-credibility-intervals reference_name imdName statName confidence nCV nSpC nMB [-p #Threads] [--seed seed] [--pseudo-count pseudo_count] [--sketch compression] [-q]\n");
+		printf("\n");
+		printf("--sketch: summarize samples with quantile sketches of the given compression (e.g. 200) instead of a temporary file holding all samples. nMB is then ignored.\n");
 		exit(-1);
 	}
 
@@ -526,6 +846,7 @@ int main(int argc, char* argv[]) {
 	quiet = false;
 	hasSeed = false;
 	pseudoC = 1.0;
+	sketchC = 0;
 	for (int i = 8; i < argc; i++) {
 		if (!strcmp(argv[i], "-p")) nThreads = atoi(argv[i + 1]);
 		if (!strcmp(argv[i], "--seed")) {
@@ -535,9 +856,11 @@ int main(int argc, char* argv[]) {
 		  for (int k = 0; k < len; k++) seed = seed * 10 + (argv[i + 1][k] - '0');
 		}
 		if (!strcmp(argv[i], "--pseudo-count")) pseudoC = atof(argv[i + 1]);
+		if (!strcmp(argv[i], "--sketch")) sketchC = atoi(argv[i + 1]);
 		if (!strcmp(argv[i], "-q")) quiet = true;
 	}
 	verbose = !quiet;
+	general_assert(sketchC == 0 || sketchC >= 20, "The compression of quantile sketches must be at least 20!");
 
 	sprintf(refF, "%s.seq", refName);
 	refs.loadRefs(refF, 1);
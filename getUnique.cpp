@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include "htslib/sam.h"
 #include "sam_utils.h"
+#include "BamReader.h"
 
 #include "utils.h"
 #include "my_assert.h"
@@ -15,18 +16,18 @@
 using namespace std;
 
 int nThreads;
-string cqname;
 samFile *in, *out;
 bam_hdr_t *header;
-bam1_t *b;
-vector<bam1_t*> arr;
+BamReader *reader;
+vector<bam1_t*> arr; // record pool, arr[0, n) hold the alignments of the current read and arr[n] the next record
+int n;
 bool unaligned;
 
 void output() {
-	if (unaligned || arr.size() == 0) return;
+	if (unaligned || n == 0) return;
 	bool isPaired = bam_is_paired(arr[0]);
-	if ((isPaired && arr.size() != 2) || (!isPaired && arr.size() != 1)) return;
-	for (size_t i = 0; i < arr.size(); ++i) sam_write1(out, header, arr[i]);
+	if ((isPaired && n != 2) || (!isPaired && n != 1)) return;
+	for (int i = 0; i < n; ++i) sam_write1(out, header, arr[i]);
 }
 
 int main(int argc, char* argv[]) {
@@ -43,26 +44,27 @@ int main(int argc, char* argv[]) {
 	out = sam_open(argv[3], "wb");
 	assert(out != 0);
 	sam_hdr_write(out, header);
+	int nInflate = bamReaderThreads(nThreads);
+	nThreads -= nInflate;
 	if (nThreads > 1) general_assert(hts_set_threads(out, nThreads) == 0, "Fail to create threads for writing the BAM file!");
 
 	HIT_INT_TYPE cnt = 0;
 
-	cqname = "";
-	arr.clear();
-	b = bam_init1();
+	reader = new BamReader(in, header, nInflate);
+	arr.assign(1, bam_init1());
+	n = 0;
 	unaligned = false;
 
-	while (sam_read1(in, header, b) >= 0) {
-		if (cqname != bam_get_qname(b)) {
+	while (reader->read(arr[n]) >= 0) {
+		if (n > 0 && strcmp(bam_get_qname(arr[0]), bam_get_qname(arr[n]))) {
 			output();
-			cqname = bam_get_qname(b);
-			for (size_t i = 0; i < arr.size(); ++i) bam_destroy1(arr[i]);
-			arr.clear();
+			swap(arr[0], arr[n]);
+			n = 0;
 			unaligned = false;
 		}
 
-		unaligned = unaligned || bam_is_unmapped(b);
-		arr.push_back(bam_dup1(b));
+		unaligned = unaligned || bam_is_unmapped(arr[n]);
+		if (++n == (int)arr.size()) arr.push_back(bam_init1());
 
 		++cnt;
 		if (cnt % 1000000 == 0) { printf("."); fflush(stdout); }
@@ -72,7 +74,8 @@ int main(int argc, char* argv[]) {
 
 	output();
 
-	bam_destroy1(b);
+	for (size_t i = 0; i < arr.size(); ++i) bam_destroy1(arr[i]);
+	delete reader;
 	bam_hdr_destroy(header);
 	sam_close(in);
 	sam_close(out);
@@ -0,0 +1,152 @@
+#ifndef PACK_UTILS_H_
+#define PACK_UTILS_H_
+
+#include<cstring>
+#include<string>
+#include<stdint.h>
+
+/*
+  Building blocks of the binary read records, see ReadFile.h. Each pack_* appends to buf and the
+  matching unpack_* advances p past the field; a NULL destination skips the field.
+ */
+
+inline void pack_varint(std::string& buf, uint64_t value) {
+	while (value >= 128) {
+		buf.push_back(char((value & 127) | 128));
+		value >>= 7;
+	}
+	buf.push_back(char(value));
+}
+
+inline uint64_t unpack_varint(const char*& p) {
+	uint64_t value = 0;
+	int shift = 0;
+	while (*p & 128) {
+		value |= uint64_t(*p++ & 127) << shift;
+		shift += 7;
+	}
+	return value | uint64_t(*p++) << shift;
+}
+
+inline void pack_string(std::string& buf, const std::string& s) {
+	pack_varint(buf, s.length());
+	buf.append(s);
+}
+
+inline void unpack_string(const char*& p, std::string* s) {
+	size_t len = unpack_varint(p);
+	if (s != NULL) s->assign(p, len);
+	p += len;
+}
+
+/*
+  Bases: varint length, 2 bits per base (A 0, C 1, G 2, T 3) with 4 bases per byte, then the runs of
+  any other character as a varint count followed by (varint gap since the previous run, varint run
+  length, the character) triples.
+ */
+inline void pack_bases(std::string& buf, const std::string& seq) {
+	int len = seq.length(), nruns = 0;
+
+	pack_varint(buf, len);
+	size_t pos = buf.size();
+	buf.resize(pos + (len + 3) / 4, 0);
+	for (int i = 0; i < len; i++) {
+		int code = 0;
+		switch(seq[i]) {
+		case 'A': break;
+		case 'C': code = 1; break;
+		case 'G': code = 2; break;
+		case 'T': code = 3; break;
+		default: if (i == 0 || seq[i - 1] != seq[i]) ++nruns;
+		}
+		buf[pos + i / 4] |= char(code << (i % 4 * 2));
+	}
+
+	pack_varint(buf, nruns);
+	if (nruns == 0) return;
+	for (int i = 0, last = 0; i < len; ) {
+		char c = seq[i];
+		if (c == 'A' || c == 'C' || c == 'G' || c == 'T') { ++i; continue; }
+		int j = i + 1;
+		while (j < len && seq[j] == c) ++j;
+		pack_varint(buf, i - last);
+		pack_varint(buf, j - i);
+		buf.push_back(c);
+		last = i = j;
+	}
+}
+
+// Return the sequence length
+inline int unpack_bases(const char*& p, std::string* seq) {
+	static const char codes[4] = { 'A', 'C', 'G', 'T' };
+	int len = unpack_varint(p);
+
+	if (seq != NULL) {
+		seq->resize(len);
+		for (int i = 0; i < len; i++) (*seq)[i] = codes[(p[i / 4] >> (i % 4 * 2)) & 3];
+	}
+	p += (len + 3) / 4;
+
+	int nruns = unpack_varint(p), last = 0;
+	for (int k = 0; k < nruns; k++) {
+		int start = last + unpack_varint(p);
+		int runlen = unpack_varint(p);
+		char c = *p++;
+		if (seq != NULL) memset(&(*seq)[start], c, runlen);
+		last = start + runlen;
+	}
+
+	return len;
+}
+
+/*
+  Quality scores of a sequence of known length: varint byte size of the field, a mode byte, then
+  either the raw scores (mode 0) or (score, varint run length) pairs (mode 1), whichever is smaller.
+ */
+inline void pack_quals(std::string& buf, const std::string& qual) {
+	int len = qual.length(), nruns = 0;
+
+	for (int i = 0; i < len; i++)
+		if (i == 0 || qual[i] != qual[i - 1]) ++nruns;
+
+	if (nruns * 2 >= len) {
+		pack_varint(buf, len + 1);
+		buf.push_back(0);
+		buf.append(qual);
+		return;
+	}
+
+	std::string runs;
+	runs.push_back(1);
+	for (int i = 0; i < len; ) {
+		int j = i + 1;
+		while (j < len && qual[j] == qual[i]) ++j;
+		runs.push_back(qual[i]);
+		pack_varint(runs, j - i);
+		i = j;
+	}
+	pack_varint(buf, runs.length());
+	buf.append(runs);
+}
+
+inline void unpack_quals(const char*& p, int len, std::string* qual) {
+	size_t size = unpack_varint(p);
+	const char *end = p + size;
+
+	if (qual != NULL) {
+		if (*p == 0) qual->assign(p + 1, len);
+		else {
+			const char *q = p + 1;
+			qual->resize(len);
+			for (int i = 0; i < len; ) {
+				char c = *q++;
+				int runlen = unpack_varint(q);
+				memset(&(*qual)[i], c, runlen);
+				i += runlen;
+			}
+		}
+	}
+	p = end;
+}
+
+#endif /* PACK_UTILS_H_ */
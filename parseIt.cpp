@@ -7,8 +7,10 @@
 #include<cassert>
 #include<iostream>
 #include<fstream>
+#include<sstream>
 #include<string>
-#include<map>
+#include<vector>
+#include<pthread.h>
 
 #include "utils.h"
 #include "my_assert.h"
@@ -25,6 +27,7 @@
 
 #include "HitContainer.h"
 #include "SamParser.h"
+#include "ReadFile.h"
 
 using namespace std;
 
@@ -36,7 +39,7 @@ HIT_INT_TYPE nHits; // # of hits
 READ_INT_TYPE nUnique, nMulti, nIsoMulti;
 char *aux;
 char groupF[STRLEN], tiF[STRLEN];
-char datF[STRLEN], cntF[STRLEN];
+char datF[STRLEN], cntF[STRLEN], pstatF[STRLEN];
 
 GroupInfo gi;
 Transcripts transcripts;
@@ -44,140 +47,326 @@ Transcripts transcripts;
 SamParser *parser;
 ofstream hit_out;
 
-int n_os; // number of ostreams
-ostream *cat[3][2]; // cat : category  1-dim 0 N0 1 N1 2 N2; 2-dim  0 mate1 1 mate2
-char readOutFs[3][2][STRLEN];
+ReadFileWriter cat[3]; // cat : category 0 N0 1 N1 2 N2
+char readOutFs[3][STRLEN];
 
-map<int, READ_INT_TYPE> counter;
-map<int, READ_INT_TYPE>::iterator iter;
+vector<READ_INT_TYPE> counter; // counter[i], number of alignable reads with i alignments
 
-void init(const char* imdName, const char* alignF) {
-	parser = new SamParser(alignF, aux, transcripts, imdName);
+int nThreads; // number of parsing threads, -p minus the threads inflating the input
 
-	memset(cat, 0, sizeof(cat));
-	memset(readOutFs, 0, sizeof(readOutFs));
+/*
+  The input is cut into chunks of whole reads (SamParser::readChunk), which are parsed independently
+  of each other. The main thread reads chunks into a ring of nChunks slots, nThreads parsing threads
+  each take the next unparsed chunk, and a writer thread writes the parsed chunks out in input order
+  and merges their statistics. With one thread, the three steps take turns on the main thread.
+ */
+const size_t CHUNK_SIZE = 1 << 20; // bytes of alignments per chunk
 
-	int tmp_n_os = -1;
+struct Chunk {
+	BamChunk records;
+	READ_INT_TYPE nEntries;
 
-	for (int i = 0; i < 3; i++) {
-		genReadFileNames(imdName, i, read_type, n_os, readOutFs[i]);
+	ostringstream hits;
+	ReadBlocks cat[3]; // reads are packed and compressed by the parsing threads
+
+	READ_INT_TYPE N[3];
+	HIT_INT_TYPE nHits;
+	READ_INT_TYPE nMulti, nIsoMulti;
+	vector<READ_INT_TYPE> counter;
+
+	bool parsed;
+
+	Chunk() {
+		parsed = false;
+	}
+};
+
+int nChunks;
+Chunk *chunks;
+long long nRead, nClaimed, nWritten; // chunks read from the input, taken by parsing threads and written out
+bool readingDone;
+READ_INT_TYPE cnt; // entries written out
 
-		assert(tmp_n_os < 0 || tmp_n_os == n_os); tmp_n_os = n_os;
+pthread_mutex_t chunkLock;
+pthread_cond_t chunkRead, chunkParsed, chunkWritten;
 
-		for (int j = 0; j < n_os; j++)
-			cat[i][j] = new ofstream(readOutFs[i][j]);
+void init(const char* imdName, const char* alignF) {
+	int nInflate = bamReaderThreads(nThreads);
+	nThreads -= nInflate;
+	parser = new SamParser(alignF, aux, transcripts, imdName, nInflate);
+
+	for (int i = 0; i < 3; i++) {
+		genReadFileName(imdName, i, readOutFs[i]);
+		cat[i].open(readOutFs[i]);
 	}
 
 	counter.clear();
 }
 
+void addToHistogram(vector<READ_INT_TYPE>& counter, HIT_INT_TYPE nhits) {
+	if (counter.size() <= nhits) counter.resize(nhits + 1, 0);
+	++counter[nhits];
+}
+
 //Do not allow duplicate for unalignable reads and supressed reads in SAM input
 template<class ReadType, class HitType>
-void parseIt(SamParser *parser) {
-	// record_val & record_read are copies of val & read for record purpose
+void parseChunk(SamParser *parser, Chunk& chunk) {
+	// record_val & record_read are val & read of the read being recorded; read and record_read swap buffers
 	int val, record_val;
-	ReadType read, record_read;
+	ReadType reads[2];
+	ReadType *read = &reads[0], *record_read = &reads[1], *tmp;
 	HitType hit;
 	HitContainer<HitType> hits;
 
-	nHits = 0;
-	nUnique = nMulti = nIsoMulti = 0;
-	memset(N, 0, sizeof(N));
+	chunk.nEntries = 0;
+	chunk.nHits = 0;
+	chunk.nMulti = chunk.nIsoMulti = 0;
+	memset(chunk.N, 0, sizeof(chunk.N));
+	chunk.counter.clear();
 
-	READ_INT_TYPE cnt = 0;
+	parser->setChunk(&chunk.records);
 
 	record_val = -2; //indicate no recorded read now
-	while ((val = parser->parseNext(read, hit)) >= 0) {
+	while ((val = parser->parseNext(*read, hit)) >= 0) {
 		if (val >= 0 && val <= 2) {
 			// flush out previous read's info if needed
 			if (record_val >= 0) {
-				record_read.write(n_os, cat[record_val]);
-				++N[record_val];
+				chunk.cat[record_val].add(*record_read);
+				++chunk.N[record_val];
 			}
 
-			general_assert(record_val == 1 || hits.getNHits() == 0, "Read " + record_read.getName() + " is both unalignable and alignable according to the input file!");
+			general_assert(record_val == 1 || hits.getNHits() == 0, "Read " + record_read->getName() + " is both unalignable and alignable according to the input file!");
 
 			// flush out previous read's hits if the read is alignable reads
 			if (record_val == 1) {
 				hits.updateRI();
-				nHits += hits.getNHits();
-				nMulti += hits.calcNumGeneMultiReads(gi);
-				nIsoMulti += hits.calcNumIsoformMultiReads();
-				hits.write(hit_out);
-
-				iter = counter.find(hits.getNHits());
-				if (iter != counter.end()) {
-					iter->second++;
-				}
-				else {
-					counter[hits.getNHits()] = 1;
-				}
+				chunk.nHits += hits.getNHits();
+				chunk.nMulti += hits.calcNumGeneMultiReads(gi);
+				chunk.nIsoMulti += hits.calcNumIsoformMultiReads();
+				hits.write(chunk.hits);
+				addToHistogram(chunk.counter, hits.getNHits());
 			}
 
 			hits.clear();
 			record_val = val;
-			record_read = read; // no pointer, thus safe
+			tmp = record_read; record_read = read; read = tmp; // parseNext does not look at read, thus safe
 		}
 
 		if (val == 1 || val == 5) {
 			hits.push_back(hit);
 		}
 
-		++cnt;
-		if (verbose && (cnt % 1000000 == 0)) { cout<< "Parsed "<< cnt<< " entries"<< endl; }
+		++chunk.nEntries;
 	}
 
 	if (record_val >= 0) {
-		record_read.write(n_os, cat[record_val]);
-		++N[record_val];
+		chunk.cat[record_val].add(*record_read);
+		++chunk.N[record_val];
 	}
 
 	if (record_val == 1) {
 		hits.updateRI();
-		nHits += hits.getNHits();
-		nMulti += hits.calcNumGeneMultiReads(gi);
-		nIsoMulti += hits.calcNumIsoformMultiReads();
-		hits.write(hit_out);
-
-		iter = counter.find(hits.getNHits());
-		if (iter != counter.end()) {
-			iter->second++;
+		chunk.nHits += hits.getNHits();
+		chunk.nMulti += hits.calcNumGeneMultiReads(gi);
+		chunk.nIsoMulti += hits.calcNumIsoformMultiReads();
+		hits.write(chunk.hits);
+		addToHistogram(chunk.counter, hits.getNHits());
+	}
+
+	for (int i = 0; i < 3; i++) chunk.cat[i].flush();
+}
+
+void writeChunk(Chunk& chunk) {
+	string text;
+
+	text = chunk.hits.str();
+	hit_out.write(text.data(), text.size());
+	chunk.hits.str("");
+
+	for (int i = 0; i < 3; i++) {
+		cat[i].write(chunk.cat[i]);
+		chunk.cat[i].clear();
+	}
+
+	for (int i = 0; i < 3; i++) N[i] += chunk.N[i];
+	nHits += chunk.nHits;
+	nMulti += chunk.nMulti;
+	nIsoMulti += chunk.nIsoMulti;
+	if (counter.size() < chunk.counter.size()) counter.resize(chunk.counter.size(), 0);
+	for (size_t i = 0; i < chunk.counter.size(); i++) counter[i] += chunk.counter[i];
+
+	READ_INT_TYPE prev = cnt;
+	cnt += chunk.nEntries;
+	if (verbose)
+		for (READ_INT_TYPE k = prev / 1000000 + 1; k <= cnt / 1000000; k++) { cout<< "Parsed "<< k * 1000000<< " entries"<< endl; }
+}
+
+template<class ReadType, class HitType>
+void* parseChunks(void* arg) {
+	SamParser *parser = (SamParser*)arg;
+
+	pthread_mutex_lock(&chunkLock);
+	for (;;) {
+		while (nClaimed == nRead && !readingDone) pthread_cond_wait(&chunkRead, &chunkLock);
+		if (nClaimed == nRead) break;
+		Chunk &chunk = chunks[nClaimed++ % nChunks];
+		pthread_mutex_unlock(&chunkLock);
+
+		parseChunk<ReadType, HitType>(parser, chunk);
+
+		pthread_mutex_lock(&chunkLock);
+		chunk.parsed = true;
+		pthread_cond_broadcast(&chunkParsed);
+	}
+	pthread_mutex_unlock(&chunkLock);
+
+	return NULL;
+}
+
+void* writeChunks(void* arg) {
+	pthread_mutex_lock(&chunkLock);
+	for (;;) {
+		Chunk &chunk = chunks[nWritten % nChunks];
+		while (!(nWritten < nRead && chunk.parsed) && !(readingDone && nWritten == nRead)) pthread_cond_wait(&chunkParsed, &chunkLock);
+		if (nWritten == nRead) break;
+		pthread_mutex_unlock(&chunkLock);
+
+		writeChunk(chunk);
+
+		pthread_mutex_lock(&chunkLock);
+		chunk.parsed = false;
+		++nWritten;
+		pthread_cond_signal(&chunkWritten);
+	}
+	pthread_mutex_unlock(&chunkLock);
+
+	return NULL;
+}
+
+template<class ReadType, class HitType>
+void parseIt(SamParser *parser) {
+	bool paired = (read_type >= 2);
+
+	nHits = 0;
+	nUnique = nMulti = nIsoMulti = 0;
+	memset(N, 0, sizeof(N));
+	cnt = 0;
+
+	if (nThreads <= 1) {
+		Chunk chunk;
+		SamParser chunkParser(parser);
+
+		while (parser->readChunk(chunk.records, CHUNK_SIZE, paired)) {
+			parseChunk<ReadType, HitType>(&chunkParser, chunk);
+			writeChunk(chunk);
+		}
+	}
+	else {
+		int rc;
+		SamParser **parsers = new SamParser*[nThreads];
+		pthread_t *threads = new pthread_t[nThreads + 1];
+
+		nChunks = 2 * nThreads + 2;
+		chunks = new Chunk[nChunks];
+		nRead = nClaimed = nWritten = 0;
+		readingDone = false;
+
+		pthread_mutex_init(&chunkLock, NULL);
+		pthread_cond_init(&chunkRead, NULL);
+		pthread_cond_init(&chunkParsed, NULL);
+		pthread_cond_init(&chunkWritten, NULL);
+
+		for (int i = 0; i < nThreads; i++) {
+			parsers[i] = new SamParser(parser);
+			rc = pthread_create(&threads[i], NULL, parseChunks<ReadType, HitType>, parsers[i]);
+			pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0)!");
 		}
-		else {
-			counter[hits.getNHits()] = 1;
+		rc = pthread_create(&threads[nThreads], NULL, writeChunks, NULL);
+		pthread_assert(rc, "pthread_create", "Cannot create the writer thread!");
+
+		bool success;
+		do {
+			Chunk &chunk = chunks[nRead % nChunks];
+
+			pthread_mutex_lock(&chunkLock);
+			while (nRead - nWritten == nChunks) pthread_cond_wait(&chunkWritten, &chunkLock);
+			pthread_mutex_unlock(&chunkLock);
+
+			success = parser->readChunk(chunk.records, CHUNK_SIZE, paired);
+
+			pthread_mutex_lock(&chunkLock);
+			if (success) ++nRead;
+			else {
+				readingDone = true;
+				pthread_cond_broadcast(&chunkParsed);
+			}
+			pthread_cond_broadcast(&chunkRead);
+			pthread_mutex_unlock(&chunkLock);
+		} while (success);
+
+		for (int i = 0; i <= nThreads; i++) {
+			rc = pthread_join(threads[i], NULL);
+			pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0)!");
 		}
+
+		pthread_mutex_destroy(&chunkLock);
+		pthread_cond_destroy(&chunkRead);
+		pthread_cond_destroy(&chunkParsed);
+		pthread_cond_destroy(&chunkWritten);
+
+		for (int i = 0; i < nThreads; i++) delete parsers[i];
+		delete[] parsers;
+		delete[] threads;
+		delete[] chunks;
 	}
 
 	nUnique = N[1] - nMulti;
 }
 
+// One "name<TAB>value" line per statistic, for monitoring
+void writeParseStats(const char* pstatF) {
+	ofstream fout(pstatF);
+
+	fout<<"read_type\t"<<read_type<<endl;
+	fout<<"alignment_entries\t"<<cnt<<endl;
+	fout<<"unalignable_reads\t"<<N[0]<<endl;
+	fout<<"alignable_reads\t"<<N[1]<<endl;
+	fout<<"filtered_reads\t"<<N[2]<<endl;
+	fout<<"total_reads\t"<<(N[0] + N[1] + N[2])<<endl;
+	fout<<"unique_gene_reads\t"<<nUnique<<endl;
+	fout<<"multi_gene_reads\t"<<nMulti<<endl;
+	fout<<"multi_mapping_reads\t"<<nIsoMulti<<endl;
+	fout<<"alignments\t"<<nHits<<endl;
+	fout<<"max_alignments_per_read\t"<<(counter.size() > 0 ? counter.size() - 1 : 0)<<endl;
+	fout<<"mean_alignments_per_read\t"<<(N[1] > 0 ? double(nHits) / N[1] : 0.0)<<endl;
+	fout<<"mate_name_mismatches\t"<<parser->getNumWarnings()<<endl;
+
+	fout.close();
+}
+
 void release() {
 	for (int i = 0; i < 3; i++) {
-		for (int j = 0; j < n_os; j++) {
-			((ofstream*)cat[i][j])->close();
-			delete cat[i][j];
-		}
-		if (N[i] > 0) continue;
-		for (int j = 0; j < n_os; j++) {
-			remove(readOutFs[i][j]); //delete if the file is empty
-		}
+		cat[i].close();
+		if (N[i] == 0) remove(readOutFs[i]); //delete if the file is empty
 	}
 	delete parser;
 }
 
 int main(int argc, char* argv[]) {
 	if (argc < 6) {
-		printf("Usage : rsem-parse-alignments refName imdName statName alignF read_type [-t fai_file] [-tag tagName] [-q]\n");
+		printf("Usage : rsem-parse-alignments refName imdName statName alignF read_type [-t fai_file] [-tag tagName] [-p #threads] [-q]\n");
 		exit(-1);
 	}
 
 	read_type = atoi(argv[5]);
 	
 	aux = NULL;
+	nThreads = 1;
 	if (argc > 6) {
 	  for (int i = 6; i < argc; ++i) {
 	    if (!strcmp(argv[i], "-t")) aux = argv[i + 1];
 	    if (!strcmp(argv[i], "-tag")) SamParser::setReadTypeTag(argv[i + 1]);
+	    if (!strcmp(argv[i], "-p")) nThreads = atoi(argv[i + 1]);
 	    if (!strcmp(argv[i], "-q")) verbose = false;
 	  }
 	}
@@ -189,6 +378,7 @@ int main(int argc, char* argv[]) {
 
 	sprintf(datF, "%s.dat", argv[2]);
 	sprintf(cntF, "%s.cnt", argv[3]);
+	sprintf(pstatF, "%s.parse_stats", argv[3]);
 
 	init(argv[2], argv[4]);
 
@@ -216,12 +406,13 @@ int main(int argc, char* argv[]) {
 	fout<<nUnique<<" "<<nMulti<<" "<<nIsoMulti<<endl;
 	fout<<nHits<<" "<<read_type<<endl;
 	fout<<"0\t"<<N[0]<<endl;
-	for (iter = counter.begin(); iter != counter.end(); iter++) {
-		fout<<iter->first<<'\t'<<iter->second<<endl;
-	}
+	for (size_t i = 1; i < counter.size(); i++)
+		if (counter[i] > 0) fout<<i<<'\t'<<counter[i]<<endl;
 	fout<<"Inf\t"<<N[2]<<endl;
 	fout.close();
 
+	writeParseStats(pstatF);
+
 	release();
 
 	if (verbose) { printf("Done!\n"); }
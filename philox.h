@@ -0,0 +1,84 @@
+#ifndef PHILOX_H_
+#define PHILOX_H_
+
+#include<stdint.h>
+
+/*
+  Philox4x32-10 counter-based random number engine (Salmon et al., SC'11).
+
+  Each engine is addressed by (seed, stream id). The seed is the cipher key and
+  the stream id forms the upper 64 bits of the 128-bit counter, so the numbers
+  drawn from stream k do not depend on which thread or process draws them, nor
+  on how many other streams exist. Jumping ahead is a counter update.
+
+  The class models boost's UniformRandomNumberGenerator concept and can be used
+  with variate_generator, uniform_01, gamma_distribution etc.
+ */
+class philox_engine {
+public:
+	typedef uint32_t result_type;
+	typedef uint64_t stream_type;
+
+	static const bool has_fixed_range = false;
+
+	explicit philox_engine(uint32_t seed = 0, stream_type stream = 0) { this->seed(seed, stream); }
+
+	void seed(uint32_t seed, stream_type stream = 0) {
+		key[0] = seed; key[1] = 0;
+		set_stream(stream);
+	}
+
+	// Restart the engine at the beginning of another stream, keeping the seed
+	void set_stream(stream_type stream) {
+		ctr[0] = ctr[1] = 0;
+		ctr[2] = uint32_t(stream);
+		ctr[3] = uint32_t(stream >> 32);
+		idx = 4;
+	}
+
+	static result_type min() { return 0; }
+	static result_type max() { return 0xffffffffU; }
+
+	result_type operator() () {
+		if (idx == 4) { next_block(); idx = 0; }
+		return out[idx++];
+	}
+
+	// Skip n outputs in O(1)
+	void discard(uint64_t n) {
+		uint64_t avail = 4 - idx;
+		if (n < avail) { idx += n; return; }
+		n -= avail;
+		uint64_t block = (uint64_t(ctr[1]) << 32 | ctr[0]) + n / 4;
+		ctr[0] = uint32_t(block); ctr[1] = uint32_t(block >> 32);
+		idx = 4;
+		if (n % 4 > 0) { next_block(); idx = n % 4; }
+	}
+
+private:
+	static const uint32_t M0 = 0xD2511F53U, M1 = 0xCD9E8D57U;
+	static const uint32_t W0 = 0x9E3779B9U, W1 = 0xBB67AE85U;
+
+	uint32_t key[2], ctr[4], out[4];
+	int idx; // next unused word in out, 4 means out is exhausted
+
+	// Encrypt the current counter into out and advance the block counter
+	void next_block() {
+		uint32_t k0 = key[0], k1 = key[1];
+		uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+
+		for (int r = 0; r < 10; r++) {
+			uint64_t p0 = uint64_t(M0) * c0, p1 = uint64_t(M1) * c2;
+			uint32_t hi0 = uint32_t(p0 >> 32), lo0 = uint32_t(p0);
+			uint32_t hi1 = uint32_t(p1 >> 32), lo1 = uint32_t(p1);
+			c0 = hi1 ^ c1 ^ k0; c1 = lo1;
+			c2 = hi0 ^ c3 ^ k1; c3 = lo0;
+			k0 += W0; k1 += W1;
+		}
+		out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+
+		if (++ctr[0] == 0) ++ctr[1];
+	}
+};
+
+#endif /* PHILOX_H_ */
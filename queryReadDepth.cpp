@@ -0,0 +1,63 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "utils.h"
+#include "my_assert.h"
+#include "ReadDepthFile.h"
+
+using namespace std;
+
+void printUsage() {
+  printf("Usage: rsem-query-readdepth readdepth_file [--list] [transcript_id ...]\n");
+  printf("readdepth_file\t: Binary read depth file generated by rsem-bam2readdepth\n");
+  printf("--list\t\t: Only list the transcripts, one \"transcript_id<tab>length\" line per transcript\n");
+  printf("transcript_id\t: Transcripts to output. If none is given, all transcripts are output\n");
+  printf("Each transcript is output as \"transcript_id<tab>length<tab>depths\", where depths are its per-base read depths separated by spaces, or NA if no read aligns to it.\n");
+  exit(-1);
+}
+
+void output(ReadDepthReader& reader, int i) {
+  vector<float> depths;
+
+  cout<< reader.getName(i)<< '\t'<< reader.getLength(i)<< '\t';
+  if (!reader.hasDepths(i)) { cout<< "NA\n"; return; }
+
+  reader.getDepths(i, depths);
+  for (size_t j = 0; j < depths.size(); ++j) {
+    if (j > 0) cout<< ' ';
+    cout<< depths[j];
+  }
+  cout<< '\n';
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) printUsage();
+
+  bool list = false;
+  vector<string> ids;
+  for (int i = 2; i < argc; ++i)
+    if (!strcmp(argv[i], "--list")) list = true;
+    else ids.push_back(argv[i]);
+
+  ReadDepthReader reader(argv[1]);
+
+  if (list) {
+    for (int i = 0; i < reader.getNumTranscripts(); ++i) cout<< reader.getName(i)<< '\t'<< reader.getLength(i)<< '\n';
+  }
+  else if (ids.empty()) {
+    for (int i = 0; i < reader.getNumTranscripts(); ++i) output(reader, i);
+  }
+  else {
+    for (size_t k = 0; k < ids.size(); ++k) {
+      int i = reader.find(ids[k]);
+      if (i < 0) fprintf(stderr, "Warning: %s is not in %s!\n", ids[k].c_str(), argv[1]);
+      else output(reader, i);
+    }
+  }
+
+  return 0;
+}
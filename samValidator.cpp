@@ -1,193 +1,440 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cstdarg>
 #include <cassert>
 #include <string>
-#include <set>
+#include <vector>
 #include <algorithm>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <stdint.h>
 #include "htslib/sam.h"
 #include "sam_utils.h"
+#include "BamReader.h"
 
 #include "utils.h"
 #include "my_assert.h"
 
 using namespace std;
 
+/*
+  Records are read in batches of about BATCH_SIZE. The checks that involve a single read (one record, or the two mates of a
+  paired-end alignment) run on nThreads threads over disjoint ranges of the batch; the checks across reads (mixed read types,
+  missing mates, grouping, read lengths) run on the main thread, in input order, so the first error reported is the one the
+  sequential scan would find.
+ */
+const int BATCH_SIZE = 1 << 16;
+
+// An error found in the input
+struct Error {
+	string code, name, message; // code, e.g. not_grouped; name, the read; message, for users
+	HIT_INT_TYPE record; // 1-based index of the first record of the read
+	int unit; // unit of the batch it is found at, -1 if none
+
+	Error() : record(0), unit(-1) {}
+};
+
+/*
+  Set of read name fingerprints, in place of the names themselves: an open-addressing table of 64-bit name hashes, 8 bytes
+  per name. Two names share a hash with a chance of about 2^-64, so a match is only a suspect and is confirmed against the
+  input file. Standard input and pipes cannot be read twice, so there a match is taken as a duplicate without confirmation.
+ */
+class NameHashSet {
+public:
+	NameHashSet() : bits(16), size(0) { slots.assign((size_t)1 << bits, 0); }
+
+	static uint64_t hash(const char* s, int len) {
+		uint64_t h = 14695981039346656037ULL;
+		for (int i = 0; i < len; i++) { h ^= (uint8_t)s[i]; h *= 1099511628211ULL; }
+		h ^= h >> 33; h *= 0xff51afd7ed558ccdULL; h ^= h >> 33; // spread the bits to the top, which choose the slot
+		return h != 0 ? h : 1; // 0 marks an empty slot
+	}
+
+	bool contains(uint64_t h) const {
+		for (size_t i = home(h); slots[i] != 0; i = (i + 1) & (slots.size() - 1))
+			if (slots[i] == h) return true;
+		return false;
+	}
+
+	void insert(uint64_t h) {
+		if (contains(h)) return;
+		if ((size + 1) * 4 > slots.size() * 3) grow();
+		place(h);
+		++size;
+	}
+
+private:
+	int bits;
+	size_t size;
+	vector<uint64_t> slots;
+
+	size_t home(uint64_t h) const { return h >> (64 - bits); }
+
+	void place(uint64_t h) {
+		size_t i = home(h);
+		while (slots[i] != 0) i = (i + 1) & (slots.size() - 1);
+		slots[i] = h;
+	}
+
+	void grow() {
+		vector<uint64_t> old;
+		old.swap(slots);
+		slots.assign(old.size() * 2, 0);
+		++bits;
+		for (size_t i = 0; i < old.size(); i++)
+			if (old[i] != 0) place(old[i]);
+	}
+};
+
+int nThreads;
+char *inpF;
+bool rereadable; // whether inpF is a regular file, which appears_before can read again
 samFile *in;
 bam_hdr_t *header;
-bam1_t *b, *b2;
+BamReader *reader;
+
+vector<bam1_t*> records; // records of the batch
+vector<int> units; // units[i], index of the first record of the ith read (alignment) of the batch; mates of a pair are adjacent
+char ispaired = -1;
 
-set<string> used;
+string format(const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
 
-bool isValid;
+	vector<char> buf(len + 1);
+	va_start(args, fmt);
+	vsnprintf(&buf[0], len + 1, fmt, args);
+	va_end(args);
 
-bool check_read(bam1_t *b, bam_hdr_t *header) {
+	return string(&buf[0], len);
+}
+
+bool check_read(bam1_t *b, bam_hdr_t *header, Error& error) {
 	uint32_t* cigar = bam_get_cigar(b);
 	for (int i = 0; i < b->core.n_cigar; ++i) {
 		char op = bam_cigar_opchr(*cigar);
 		if (op == 'N') {
-			printf("\nSkipped region is detected (cigar N) for read %s!\nTo use RSEM, please align your reads to a set of transcript sequences instead of a genome.\n", bam_get_qname(b));
+			error.code = "skipped_region";
+			error.message = format("\nSkipped region is detected (cigar N) for read %s!\nTo use RSEM, please align your reads to a set of transcript sequences instead of a genome.\n", bam_get_qname(b));
 			return false;
 		}
 		else if (op == 'I' || op == 'D') {
-			printf("\nIndel alignment is detected (cigar %c) for read %s!\nRSEM currently does not support indel alignments.\n", op, bam_get_qname(b));
+			error.code = "indel";
+			error.message = format("\nIndel alignment is detected (cigar %c) for read %s!\nRSEM currently does not support indel alignments.\n", op, bam_get_qname(b));
 			return false;
 		}
 		else if (op == 'S' || op == 'H' || op == 'P') {
-			printf("\nClipping or padding is detected (cigar %c) for read %s!\nRSEM currently doest not support clipping or padding.\n", op, bam_get_qname(b));
+			error.code = "clipping";
+			error.message = format("\nClipping or padding is detected (cigar %c) for read %s!\nRSEM currently doest not support clipping or padding.\n", op, bam_get_qname(b));
 			return false;
 		}
 		++cigar;
 	}
 
-	if (b->core.pos < 0 || bam_endpos(b) > header->target_len[b->core.tid]) {
-		printf("\n");
-		if (bam_is_paired(b)) {
-			printf("Mate %d of paired-end read %s", (bam_is_read1(b) ? 1 : 2), bam_get_qname(b));
+	if (b->core.pos < 0 || bam_endpos(b) > (int32_t)header->target_len[b->core.tid]) {
+		error.code = "out_of_bounds";
+		error.message = "\n";
+		if (bam_is_paired(b)) error.message += format("Mate %d of paired-end read %s", (bam_is_read1(b) ? 1 : 2), bam_get_qname(b));
+		else error.message += format("Read %s", bam_get_qname(b));
+		error.message += format(" aligns to [%d, %d) of transcript %s, which exceeds the transcript's boundary [0, %d)!\n",
+					b->core.pos, bam_endpos(b), header->target_name[b->core.tid], header->target_len[b->core.tid]);
+		return false;
+	}
+
+	return true;
+}
+
+// Checks that involve only one alignment of a read
+bool check_unit(bam1_t *b, bam1_t *b2, Error& error) {
+	if (b2 == NULL) return bam_is_unmapped(b) || check_read(b, header, error);
+
+	if (!((bam_is_read1(b) && bam_is_read2(b2)) || (bam_is_read1(b2) && bam_is_read2(b)))) {
+		error.code = "mate_flags";
+		error.message = format("\nThe two mates of paired-end read %s are marked as both mate1 or both mate2!\n", bam_get_qname(b));
+		return false;
+	}
+
+	int value = int(bam_is_mapped(b)) + int(bam_is_mapped(b2));
+	if (value == 1) {
+		error.code = "partial_alignment";
+		error.message = format("\nPaired-end read %s has an alignment with only one mate aligned!\nCurrently RSEM does not handle mixed alignments for paired-end reads.\n", bam_get_qname(b));
+		return false;
+	}
+
+	if (!bam_is_read1(b)) { bam1_t *tmp = b; b = b2; b2 = tmp; }
+
+	if (value == 2) {
+		if (b->core.tid != b2->core.tid) {
+			error.code = "discordant_alignment";
+			error.message = format("\nPaired-end read %s has a discordant alignment (two mates aligned to different reference sequences)!\n", bam_get_qname(b));
+			error.message += format("Mate 1 aligns to %s and mate 2 aligns to %s\n", header->target_name[b->core.tid], header->target_name[b2->core.tid]);
+			error.message += "Currently RSEM does not handle discordant alignments.\n";
+			return false;
 		}
-		else {
-			printf("Read %s", bam_get_qname(b));
+
+		int strandedness = (int(bam_is_rev(b)) << 1) + int(bam_is_rev(b2));
+		if (strandedness != 1 && strandedness != 2) {
+			error.code = "same_strand";
+			error.message = format("\nPaired-end read %s has an alignment in which two mates aligned to the same strand!\n", bam_get_qname(b));
+			error.message += format("Its two mates aligned to %s in %s direction.\n", header->target_name[b->core.tid], (strandedness == 0 ? "forward" : "reverse"));
+			return false;
 		}
-		printf(" aligns to [%d, %d) of transcript %s, which exceeds the transcript's boundary [0, %d)!\n",
-				b->core.pos, bam_endpos(b), header->target_name[b->core.tid], header->target_len[b->core.tid]);
-		return false;
+
+		bam1_t *tb = (b->core.pos < b2->core.pos ? b : b2);
+		if (!(tb->core.pos >= 0 && tb->core.pos + abs(tb->core.isize) <= (int32_t)header->target_len[tb->core.tid])) {
+			error.code = "pair_out_of_bounds";
+			error.message = format("\nPaired-end read %s aligns to [%d, %d) of transcript %s, which exceeds the transcript's boundary [0, %d)!\n",
+					       bam_get_qname(b), tb->core.pos, tb->core.pos + abs(tb->core.isize), header->target_name[tb->core.tid], header->target_len[tb->core.tid]);
+			return false;
+		}
+
+		if (!check_read(b, header, error) || !check_read(b2, header, error)) return false;
 	}
 
 	return true;
 }
 
+// Units [fr, to) of the batch; error, the first one found
+struct Params {
+	int fr, to;
+	Error error;
+};
+
+void* check_units(void* arg) {
+	Params *params = (Params*)arg;
+
+	for (int i = params->fr; i < params->to; i++) {
+		bam1_t *b = records[units[i]], *b2 = (ispaired ? records[units[i] + 1] : NULL);
+		if (!check_unit(b, b2, params->error)) { params->error.unit = i; break; }
+	}
+
+	return NULL;
+}
+
+// Whether a read named name has a record among the first n records of the input, to confirm a fingerprint match
+bool appears_before(const string& name, HIT_INT_TYPE n) {
+	if (!rereadable) return true;
+
+	samFile *fp = sam_open(inpF, "r");
+	general_assert(fp != 0, "Cannot open input file!");
+	bam_hdr_t *h = sam_hdr_read(fp);
+	bam1_t *b = bam_init1();
+	bool found = false;
+
+	for (HIT_INT_TYPE i = 0; i < n && !found && sam_read1(fp, h, b) >= 0; i++)
+		found = bam_has_canonical_name(b, name);
+
+	bam_destroy1(b);
+	bam_hdr_destroy(h);
+	sam_close(fp);
+
+	return found;
+}
+
+void write_report(const char* reportF, const Error& error, bool isValid, HIT_INT_TYPE nRecords, HIT_INT_TYPE cnt) {
+	FILE *fo = fopen(reportF, "w");
+	general_assert(fo != NULL, "Cannot write to " + cstrtos(reportF) + "!");
+
+	string message = error.message;
+	for (size_t i = 0; i < message.length(); i++)
+		if (message[i] == '\n' || message[i] == '\t') message[i] = ' ';
+	size_t fr = message.find_first_not_of(' '), to = message.find_last_not_of(' ');
+	message = (fr == string::npos ? "" : message.substr(fr, to - fr + 1));
+
+	fprintf(fo, "file\t%s\n", inpF);
+	fprintf(fo, "valid\t%d\n", int(isValid));
+	fprintf(fo, "records_read\t%lld\n", (long long)nRecords);
+	fprintf(fo, "alignments_checked\t%lld\n", (long long)cnt);
+	if (!isValid) {
+		fprintf(fo, "error\t%s\n", error.code.c_str());
+		fprintf(fo, "read\t%s\n", error.name.c_str());
+		fprintf(fo, "record\t%lld\n", (long long)error.record);
+		fprintf(fo, "message\t%s\n", message.c_str());
+	}
+
+	fclose(fo);
+}
+
+void printUsage() {
+	printf("Usage: rsem-sam-validator <input.sam/input.bam/input.cram> [-p num_threads] [--report report_file]\n");
+	printf("-p num_threads\t\t: Number of threads used for validation (default: 1)\n");
+	printf("--report report_file\t: Also write the result as tab-separated key-value lines: file, valid (1 or 0), records_read, alignments_checked and, for an invalid input, error (an error code), read, record (1-based index of the first record of the read) and message\n");
+	exit(-1);
+}
+
 int main(int argc, char* argv[]) {
-	if (argc != 2) {
-		printf("Usage: rsem-sam-validator <input.sam/input.bam/input.cram>\n");
-		exit(-1);
+	if (argc < 2) printUsage();
+
+	char *reportF = NULL;
+	nThreads = 1;
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "-p") && i + 1 < argc) nThreads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--report") && i + 1 < argc) reportF = argv[++i];
+		else { printf("Cannot recognize option %s!\n", argv[i]); printUsage(); }
 	}
-	
-	in = sam_open(argv[1], "r");
+	if (nThreads < 1) nThreads = 1;
+
+	inpF = argv[1];
+	struct stat st;
+	rereadable = strcmp(inpF, "-") && stat(inpF, &st) == 0 && S_ISREG(st.st_mode);
+	in = sam_open(inpF, "r");
 	general_assert(in != 0, "Cannot open input file!");
 	header = sam_hdr_read(in);
 	general_assert(header != 0, "Cannot load SAM header!");
-	used.clear();
-	b = bam_init1(); b2 = bam_init1();
-	
-	isValid = true;
-	
-	HIT_INT_TYPE cnt = 0;
+	int nInflate = bamReaderThreads(nThreads);
+	nThreads -= nInflate;
+	reader = new BamReader(in, header, nInflate);
+
+	NameHashSet used;
+	uint64_t chash = 0; // hash of the current read's name
 	string cqname(""), qname;
-	int creadlen = 0, readlen, creadlen2, readlen2;
-	char ispaired = -1;
-	
+	int creadlen = 0, readlen, creadlen2 = 0, readlen2 = 0;
+
+	bool isValid = true, go_on = true;
+	Error error;
+	HIT_INT_TYPE cnt = 0, nRecords = 0, batchStart; // batchStart, index of the first record of the batch
+	vector<Params> params(nThreads);
+
+	used.insert(NameHashSet::hash("", 0));
+
 	printf("."); fflush(stdout);
-	do {
-		int ret = sam_read1(in, header, b);
-		if (ret == -1) break;
-		else if (ret < 0) { isValid = false; continue; }
-		assert(b->core.l_qseq > 0);
-		
-		qname = bam_get_canonical_name(b);
-		
-		// if this is a paired-end read
-		if (ispaired == -1) ispaired = bam_is_paired(b);
-		else {
-			isValid = (ispaired == bam_is_paired(b));
-			if (!isValid) {
-				printf("\nWe detected both single-end and paired-end reads in the data!\nRSEM currently does not support a mixture of single-end/paired-end reads.\n");
-				continue;
+	while (isValid && go_on) {
+		// read a batch, stopping at the first error found across reads
+		int n = 0;
+		units.clear();
+		batchStart = nRecords;
+		while (n < BATCH_SIZE) {
+			if ((int)records.size() < n + 2) { records.push_back(bam_init1()); records.push_back(bam_init1()); }
+			bam1_t *b = records[n], *b2 = records[n + 1];
+
+			int ret = reader->read(b);
+			if (ret == -1) { go_on = false; break; }
+			if (ret < 0) { error.code = "truncated"; error.record = nRecords + 1; error.unit = units.size(); break; }
+			assert(b->core.l_qseq > 0);
+			++nRecords;
+
+			if (ispaired == -1) ispaired = bam_is_paired(b);
+			else if (ispaired != bam_is_paired(b)) {
+				error.code = "mixed_read_types";
+				error.name = bam_get_canonical_name(b);
+				error.record = nRecords;
+				error.message = "\nWe detected both single-end and paired-end reads in the data!\nRSEM currently does not support a mixture of single-end/paired-end reads.\n";
+				error.unit = units.size();
+				break;
 			}
-		}
 
-		if (ispaired) {
-			isValid = (sam_read1(in, header, b2) >= 0) && (qname == bam_get_canonical_name(b2)) && bam_is_paired(b2);
-			if (!isValid) { 
-				printf("\nOnly find one mate for paired-end read %s!\nPlease make sure that the two mates of a paired-end read are adjacent to each other.\n", bam_get_qname(b)); 
-				continue; 
+			if (ispaired) {
+				if (!(reader->read(b2) >= 0 && bam_same_canonical_name(b, b2) && bam_is_paired(b2))) {
+					error.code = "missing_mate";
+					error.name = bam_get_canonical_name(b);
+					error.record = nRecords;
+					error.message = format("\nOnly find one mate for paired-end read %s!\nPlease make sure that the two mates of a paired-end read are adjacent to each other.\n", bam_get_qname(b));
+					error.unit = units.size();
+					break;
+				}
+				assert(b2->core.l_qseq > 0);
+				++nRecords;
 			}
 
-			assert(b2->core.l_qseq > 0);
+			units.push_back(n);
+			n += (ispaired ? 2 : 1);
+		}
 
-			isValid = (bam_is_read1(b) && bam_is_read2(b2)) || (bam_is_read1(b2) && bam_is_read2(b));
-			if (!isValid) { 
-				printf("\nThe two mates of paired-end read %s are marked as both mate1 or both mate2!\n", bam_get_qname(b)); 
-				continue; 
+		// checks within reads
+		int nUnits = units.size();
+		int nt = max(min(nThreads, nUnits), 1);
+		for (int i = 0; i < nt; i++) {
+			params[i].fr = (long long)nUnits * i / nt;
+			params[i].to = (long long)nUnits * (i + 1) / nt;
+			params[i].error = Error();
+		}
+		if (nt == 1) check_units(&params[0]);
+		else {
+			int rc;
+			vector<pthread_t> threads(nt);
+			for (int i = 0; i < nt; i++) {
+				rc = pthread_create(&threads[i], NULL, check_units, &params[i]);
+				pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) when validating alignments!");
 			}
-
-			int value = int(bam_is_mapped(b)) + int(bam_is_mapped(b2));
-			isValid = (value != 1);
-			if (!isValid) {
-				printf("\nPaired-end read %s has an alignment with only one mate aligned!\n", bam_get_qname(b));
-				printf("Currently RSEM does not handle mixed alignments for paired-end reads.\n");
-				continue;
+			for (int i = 0; i < nt; i++) {
+				rc = pthread_join(threads[i], NULL);
+				pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) when validating alignments!");
 			}
+		}
 
-			if (!bam_is_read1(b)) { bam1_t *tmp = b; b = b2; b2 = tmp; }
+		// checks across reads, in input order
+		HIT_INT_TYPE record = batchStart;
+		for (int i = 0, t = 0; i < nUnits && isValid; i++) {
+			bam1_t *b = records[units[i]], *b2 = (ispaired ? records[units[i] + 1] : NULL);
+			++record;
 
-			if (value == 2) {
-				isValid = (b->core.tid == b2->core.tid);
-				if (!isValid) {
-					printf("\nPaired-end read %s has a discordant alignment (two mates aligned to different reference sequences)!\n", bam_get_qname(b));
-					printf("Mate 1 aligns to %s and mate 2 aligns to %s\n", header->target_name[b->core.tid], header->target_name[b2->core.tid]);
-					printf("Currently RSEM does not handle discordant alignments.\n");
-					continue;
-				}
+			while (params[t].to <= i) ++t;
+			if (params[t].error.unit == i) {
+				error = params[t].error;
+				error.name = bam_get_canonical_name(b);
+				error.record = record;
+				isValid = false;
+				break;
+			}
 
-				int strandedness = (int(bam_is_rev(b)) << 1) + int(bam_is_rev(b2));
-				isValid = (strandedness == 1 || strandedness == 2);
-				if (!isValid) {
-					printf("\nPaired-end read %s has an alignment in which two mates aligned to the same strand!\n", bam_get_qname(b));
-					printf("Its two mates aligned to %s in %s direction.\n", header->target_name[b->core.tid], (strandedness == 0 ? "forward" : "reverse"));
-					continue;
-				}
+			if (ispaired) {
+				if (!bam_is_read1(b)) { bam1_t *tmp = b; b = b2; b2 = tmp; }
+				readlen = b->core.l_qseq;
+				readlen2 = b2->core.l_qseq;
+				++record;
+			}
+			else readlen = b->core.l_qseq;
 
-				bam1_t *tb = (b->core.pos < b2->core.pos ? b : b2);
-				isValid = tb->core.pos >= 0 && tb->core.pos + abs(tb->core.isize) <= header->target_len[tb->core.tid];
-				if (!isValid) {
-					printf("\nPaired-end read %s aligns to [%d, %d) of transcript %s, which exceeds the transcript's boundary [0, %d)!\n", 
-						bam_get_qname(b), tb->core.pos, tb->core.pos + abs(tb->core.isize), header->target_name[tb->core.tid], header->target_len[tb->core.tid]);
-					continue;
+			if (!bam_has_canonical_name(b, cqname)) {
+				bam_get_canonical_name(b, qname);
+				uint64_t h = NameHashSet::hash(qname.data(), qname.length());
+				if (used.contains(h) && appears_before(qname, (ispaired ? record - 2 : record - 1))) {
+					error.code = "not_grouped";
+					error.name = qname;
+					error.record = (ispaired ? record - 1 : record);
+					error.message = format("\nThe alignments of read %s are not grouped together!\n", qname.c_str());
+					isValid = false;
+					break;
 				}
-				isValid = check_read(b, header);
-				if (!isValid) continue;
-				isValid = check_read(b2, header);
-				if (!isValid) continue;
+				used.insert(chash);
+				cqname = qname;
+				chash = h;
+				creadlen = readlen;
+				if (ispaired) creadlen2 = readlen2;
 			}
-			
-			readlen = b->core.l_qseq;
-			readlen2 = b2->core.l_qseq;
-		}
-		else {
-			if (bam_is_mapped(b)) {
-				isValid = check_read(b, header);
-				if (!isValid) continue;
+			else {
+				if (!(creadlen == readlen && (!ispaired || creadlen2 == readlen2))) {
+					error.code = "inconsistent_read_length";
+					error.name = cqname;
+					error.record = (ispaired ? record - 1 : record);
+					error.message = format("\nRead %s have alignments showing different read/mate lengths!\n", cqname.c_str());
+					isValid = false;
+					break;
+				}
 			}
-			readlen = b->core.l_qseq;
-		}
 
-		if (cqname != qname) {
-			isValid = used.find(qname) == used.end();
-			if (!isValid) { printf("\nThe alignments of read %s are not grouped together!\n", qname.c_str()); continue; }
-			used.insert(cqname);
-			cqname = qname;
-			creadlen = readlen;
-			if (ispaired) creadlen2 = readlen2;			
+			++cnt;
+			if (cnt % 1000000 == 0) { printf("."); fflush(stdout); }
 		}
-		else {
-			assert(cqname != "");
-			isValid = (creadlen == readlen && (!ispaired || creadlen2 == readlen2));
-			if (!isValid) { printf("\nRead %s have alignments showing different read/mate lengths!\n", qname.c_str()); continue; }
-		}
-		
-		++cnt;
-		if (cnt % 1000000 == 0) { printf("."); fflush(stdout); }
-		
-	} while(isValid);
-	
-	bam_destroy1(b); bam_destroy1(b2);
+
+		// an error found while reading comes after all units of the batch
+		if (isValid && error.unit >= 0) isValid = false;
+	}
+
+	if (!isValid) printf("%s", error.message.c_str());
+	if (reportF != NULL) write_report(reportF, error, isValid, nRecords, cnt);
+
+	for (size_t i = 0; i < records.size(); i++) bam_destroy1(records[i]);
+	delete reader;
 	bam_hdr_destroy(header);
 	sam_close(in);
-	
+
 	if (isValid) printf("\nThe input file is valid!\n");
 	else printf("The input file is not valid!\n");
-	
+
 	return 0;
 }
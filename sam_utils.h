@@ -60,6 +60,26 @@ inline std::string bam_get_canonical_name(const bam1_t* b) {
   return (whitespace_pos == NULL ? std::string(raw_query_name) : std::string(raw_query_name, whitespace_pos - raw_query_name));
 }
 
+inline int bam_get_canonical_name_len(const bam1_t* b) {
+  return strcspn(bam_get_qname(b), whitespaces);
+}
+
+// Same as above, but reuses the buffer of name
+inline void bam_get_canonical_name(const bam1_t* b, std::string& name) {
+  name.assign(bam_get_qname(b), bam_get_canonical_name_len(b));
+}
+
+// Compare the canonical names in place
+inline bool bam_has_canonical_name(const bam1_t* b, const std::string& name) {
+  int len = bam_get_canonical_name_len(b);
+  return (int)name.length() == len && !memcmp(name.data(), bam_get_qname(b), len);
+}
+
+inline bool bam_same_canonical_name(const bam1_t* b, const bam1_t* b2) {
+  int len = bam_get_canonical_name_len(b);
+  return len == bam_get_canonical_name_len(b2) && !memcmp(bam_get_qname(b), bam_get_qname(b2), len);
+}
+
 // Current RSEM only accept matches
 inline bool bam_check_cigar(bam1_t *b) {
   uint32_t *cigar = bam_get_cigar(b);
@@ -75,136 +95,52 @@ uint8_t bam_prb_to_mapq(double val) {
   return (uint8_t)(-10 * log10(err) + .5); // round it
 }
 
-inline std::string bam_get_read_seq(const bam1_t* b) {
+// Decode the read sequence into readseq, reusing its buffer. RSEM only accepts A, C, G, T and N
+inline void bam_get_read_seq(const bam1_t* b, std::string& readseq) {
+  static const char fwd[16] = { 0, 'A', 'C', 0, 'G', 0, 0, 0, 'T', 0, 0, 0, 0, 0, 0, 'N' };
+  static const char rev[16] = { 0, 'T', 'G', 0, 'C', 0, 0, 0, 'A', 0, 0, 0, 0, 0, 0, 'N' };
   uint8_t *p = bam_get_seq(b);
-  std::string readseq = "";
-  char base = 0;
+  int len = b->core.l_qseq;
 
+  readseq.resize(len);
   if (bam_is_rev(b)) {
-    for (int i = b->core.l_qseq - 1; i >= 0; i--) {
-      switch(bam_seqi(p, i)) {
-	//case 0 : base = '='; break;
-      case 1 : base = 'T'; break;
-      case 2 : base = 'G'; break;
-      case 4 : base = 'C'; break;
-      case 8 : base = 'A'; break;
-      case 15 : base = 'N'; break;
-      default : assert(false);
-      }
-      readseq.append(1, base);
+    for (int i = 0; i < len; ++i) {
+      readseq[i] = rev[bam_seqi(p, len - 1 - i)];
+      assert(readseq[i] != 0);
     }
   }
   else {
-    for (int i = 0; i < b->core.l_qseq; ++i) {
-      switch(bam_seqi(p, i)) {
-	//case 0 : base = '='; break;
-      case 1 : base = 'A'; break;
-      case 2 : base = 'C'; break;
-      case 4 : base = 'G'; break;
-      case 8 : base = 'T'; break;
-      case 15 : base = 'N'; break;
-      default : assert(false);
-      }
-      readseq.append(1, base);
+    for (int i = 0; i < len; ++i) {
+      readseq[i] = fwd[bam_seqi(p, i)];
+      assert(readseq[i] != 0);
     }
   }
-  
+}
+
+inline std::string bam_get_read_seq(const bam1_t* b) {
+  std::string readseq;
+  bam_get_read_seq(b, readseq);
   return readseq;
 }
 
-inline std::string bam_get_qscore(const bam1_t* b) {
+// Phred+33 quality scores, reusing the buffer of qscore
+inline void bam_get_qscore(const bam1_t* b, std::string& qscore) {
   uint8_t *p = bam_get_qual(b);
-  std::string qscore = "";
-  
+  int len = b->core.l_qseq;
+
+  qscore.resize(len);
   if (bam_is_rev(b)) {
-    p = p + b->core.l_qseq - 1;
-    for (int i = 0; i < b->core.l_qseq; ++i) {
-      qscore.append(1, (char)(*p + 33));
-      --p;
-    }
+    for (int i = 0; i < len; ++i) qscore[i] = (char)(p[len - 1 - i] + 33);
   }
   else {
-    for (int i = 0; i < b->core.l_qseq; ++i) {
-      qscore.append(1, (char)(*p + 33));
-      ++p;
-    }
+    for (int i = 0; i < len; ++i) qscore[i] = (char)(p[i] + 33);
   }
-  
-  return qscore;
 }
 
-//convert transcript coordinate to chromosome coordinate and generate CIGAR string
-void tr2chr(const Transcript& transcript, int sp, int ep, int& pos, int& n_cigar, std::vector<uint32_t>& data) {
-	int length = transcript.getLength();
-	char strand = transcript.getStrand();
-	const std::vector<Interval>& structure = transcript.getStructure();
-
-	int s, i;
-	int oldlen, curlen;
-
-	uint32_t operation;
-
-	n_cigar = 0;
-	s = structure.size();
-
-	if (strand == '-') {
-		int tmp = sp;
-		sp = length - ep + 1;
-		ep = length - tmp + 1;
-	}
-
-	if (ep < 1 || sp > length) { // a read which align to polyA tails totally!
-	  pos = (sp > length ? structure[s - 1].end : structure[0].start - 1); // 0 based
-
-	  n_cigar = 1;
-	  operation = (ep - sp + 1) << BAM_CIGAR_SHIFT | BAM_CINS; //BAM_CSOFT_CLIP;
-	  data.push_back(operation);
-
-	  return;
-	}
-
-	if (sp < 1) {
-		n_cigar++;
-		operation = (1 - sp) << BAM_CIGAR_SHIFT | BAM_CINS; //BAM_CSOFT_CLIP;
-		data.push_back(operation);
-		sp = 1;
-	}
-
-	oldlen = curlen = 0;
-
-	for (i = 0; i < s; i++) {
-		oldlen = curlen;
-		curlen += structure[i].end - structure[i].start + 1;
-		if (curlen >= sp) break;
-	}
-	assert(i < s);
-	pos = structure[i].start + (sp - oldlen - 1) - 1; // 0 based
-
-	while (curlen < ep && i < s) {
-		n_cigar++;
-		operation = (curlen - sp + 1) << BAM_CIGAR_SHIFT | BAM_CMATCH;
-		data.push_back(operation);
-		++i;
-		if (i >= s) continue;
-		n_cigar++;
-		operation = (structure[i].start - structure[i - 1].end - 1) << BAM_CIGAR_SHIFT | BAM_CREF_SKIP;
-		data.push_back(operation);
-
-		oldlen = curlen;
-		sp = oldlen + 1;
-		curlen += structure[i].end - structure[i].start + 1;
-	}
-
-	if (i >= s) {
-		n_cigar++;
-		operation = (ep - length) << BAM_CIGAR_SHIFT | BAM_CINS; //BAM_CSOFT_CLIP;
-		data.push_back(operation);
-	}
-	else {
-		n_cigar++;
-		operation = (ep - sp + 1) << BAM_CIGAR_SHIFT | BAM_CMATCH;
-		data.push_back(operation);
-	}
+inline std::string bam_get_qscore(const bam1_t* b) {
+  std::string qscore;
+  bam_get_qscore(b, qscore);
+  return qscore;
 }
 
 #endif /* SAM_RSEM_AUX_H_ */
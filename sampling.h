@@ -1,47 +1,99 @@
 #ifndef SAMPLING
 #define SAMPLING
 
+#include<cmath>
 #include<ctime>
 #include<cstdio>
 #include<cassert>
 #include<vector>
-#include<set>
 
 #include "boost/random.hpp"
+#include "philox.h"
 
 typedef unsigned int seedType;
-typedef boost::random::mt19937 engine_type;
+typedef philox_engine::stream_type streamType;
+typedef philox_engine engine_type;
 typedef boost::random::uniform_01<> uniform_01_dist;
-typedef boost::random::gamma_distribution<> gamma_dist;
 typedef boost::random::variate_generator<engine_type&, uniform_01_dist> uniform_01_generator;
-typedef boost::random::variate_generator<engine_type&, gamma_dist> gamma_generator;
 
+// Engines are addressed by (seed, stream id). A stream always produces the same numbers,
+// no matter how many threads are used or in which order the engines are created.
 class engineFactory {
 public:
-  static void init() { seedEngine = new engine_type(time(NULL)); }
-  static void init(seedType seed) { seedEngine = new engine_type(seed); }
+  static void init() { seed = time(NULL); }
+  static void init(seedType seed) { engineFactory::seed = seed; }
 
-  static void finish() { if (seedEngine != NULL) delete seedEngine; }
+  static engine_type *new_engine(streamType stream) { return new engine_type(seed, stream); }
 
-	static engine_type *new_engine() {
-		seedType seed;
-		static std::set<seedType> seedSet;			// empty set of seeds
-		std::set<seedType>::iterator iter;
+ private:
+	static seedType seed;
+};
 
-		do {
-			seed = (*seedEngine)();
-			iter = seedSet.find(seed);
-		} while (iter != seedSet.end());
-		seedSet.insert(seed);
+seedType engineFactory::seed = 0;
 
-		return new engine_type(seed);
-	}
+// Constants of Marsaglia and Tsang's method for gamma(alpha, 1), computed once per shape
+struct gamma_shape {
+  double d, c;
+  double inv_alpha; // > 0 if alpha < 1, then gamma(alpha) = gamma(alpha + 1) * U^(1 / alpha)
 
- private:
-	static engine_type *seedEngine;
+  gamma_shape() : d(0.0), c(0.0), inv_alpha(0.0) {}
+
+  explicit gamma_shape(double alpha) {
+    inv_alpha = 0.0;
+    if (alpha < 1.0) { inv_alpha = 1.0 / alpha; alpha += 1.0; }
+    d = alpha - 1.0 / 3.0;
+    c = 1.0 / sqrt(9.0 * d);
+  }
 };
 
-engine_type* engineFactory::seedEngine = NULL;
+// Draws gamma variates with any shape from one engine without allocating memory
+class gamma_sampler {
+public:
+  explicit gamma_sampler(engine_type& engine) : engine(engine), has_normal(false) {}
+
+  // Forget the cached normal variate, call it after the engine switches to another stream
+  void reset() { has_normal = false; }
+
+  double operator() (const gamma_shape& gs) {
+    double x, v, u;
+    for (;;) {
+      do {
+        x = normal();
+        v = 1.0 + gs.c * x;
+      } while (v <= 0.0);
+      v = v * v * v;
+      u = uniform();
+      x *= x;
+      if (u < 1.0 - 0.0331 * x * x || log(u) < 0.5 * x + gs.d * (1.0 - v + log(v))) break;
+    }
+    return gs.inv_alpha > 0.0 ? gs.d * v * pow(uniform(), gs.inv_alpha) : gs.d * v;
+  }
+
+private:
+  engine_type& engine;
+  bool has_normal;
+  double cached_normal;
+
+  // uniform in (0, 1) with 53 random bits
+  double uniform() {
+    uint32_t a = engine() >> 5, b = engine() >> 6;
+    return (a * 67108864.0 + b + 0.5) / 9007199254740992.0;
+  }
+
+  // standard normal by Marsaglia's polar method, the second variate is kept for the next call
+  double normal() {
+    if (has_normal) { has_normal = false; return cached_normal; }
+    double x, y, r;
+    do {
+      x = 2.0 * uniform() - 1.0;
+      y = 2.0 * uniform() - 1.0;
+      r = x * x + y * y;
+    } while (r >= 1.0);
+    r = sqrt(-2.0 * log(r) / r);
+    cached_normal = y * r; has_normal = true;
+    return x * r;
+  }
+};
 
 // arr should be cumulative!
 // interval : [,)
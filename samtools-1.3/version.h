@@ -0,0 +1 @@
+#define SAMTOOLS_VERSION "1.3"
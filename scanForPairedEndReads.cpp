@@ -5,30 +5,50 @@
 #include<string>
 #include<vector>
 #include<algorithm>
+#include<pthread.h>
 
 #include <stdint.h>
 #include "htslib/sam.h"
 #include "sam_utils.h"
+#include "BamReader.h"
 
 #include "utils.h"
 #include "my_assert.h"
 
 using namespace std;
 
+/*
+  Reads are handled in batches of about BATCH_SIZE records, cut at read boundaries. The main thread reads a batch into a pool
+  of records that is reused across batches (inflated in parallel by BamReader); nThreads threads then reorder the alignments
+  of disjoint ranges of reads, each into its own output list of the pooled records, and the lists are written in input order.
+ */
+const int BATCH_SIZE = 1 << 16;
+
+struct Params {
+  int fr, to; // reads [fr, to) of the batch
+  vector<bam1_t*> outputs;
+};
+
 int nThreads;
 samFile *in, *out;
 bam_hdr_t *header;
-bam1_t *b, *b2;
-vector<bam1_t*> arr_both, arr_partial_1, arr_partial_2, arr_partial_unknown;
+BamReader *reader;
+vector<bam1_t*> records; // records of the batch
+vector<int> starts; // starts[i], index of the first record of the ith read of the batch
+
+// the pooled records of one read, see reorder()
+struct ReadArrays {
+  vector<bam1_t*> arr_both, arr_partial_1, arr_partial_2, arr_partial_unknown;
+};
 
-inline void add_to_appropriate_arr(bam1_t *b) {
+inline void add_to_appropriate_arr(bam1_t *b, ReadArrays& arrs) {
   if (bam_is_mapped(b) && bam_is_proper(b)) {
-    arr_both.push_back(bam_dup1(b)); return;
+    arrs.arr_both.push_back(b); return;
   }
 
-  if (bam_is_read1(b)) arr_partial_1.push_back(bam_dup1(b));
-  else if (bam_is_read2(b)) arr_partial_2.push_back(bam_dup1(b));
-  else arr_partial_unknown.push_back(bam_dup1(b));
+  if (bam_is_read1(b)) arrs.arr_partial_1.push_back(b);
+  else if (bam_is_read2(b)) arrs.arr_partial_2.push_back(b);
+  else arrs.arr_partial_unknown.push_back(b);
 }
 
 char get_pattern_code(uint32_t flag) {
@@ -50,6 +70,95 @@ bool less_than(bam1_t *a, bam1_t *b) {
 	return apat < bpat;
 }
 
+// A paired-end read goes on while the canonical name stays the same; a single-end read while the whole name equals its canonical name
+inline bool same_read(const bam1_t *first, const bam1_t *b) {
+  if (bam_is_paired(first)) return bam_same_canonical_name(first, b);
+  int len = bam_get_canonical_name_len(first);
+  return b->core.l_qname == len + 1 && !memcmp(bam_get_qname(first), bam_get_qname(b), len);
+}
+
+inline void move_back(vector<bam1_t*>& arr, vector<bam1_t*>& outputs) {
+  outputs.push_back(arr.back()); arr.pop_back();
+}
+
+// Append the records [fr, to) of a read to outputs: full alignments sorted, then partial alignments with the mates paired up
+void reorder(int fr, int to, ReadArrays& arrs, vector<bam1_t*>& outputs) {
+  if (!bam_is_paired(records[fr])) {
+    for (int i = fr; i < to; i++) outputs.push_back(records[i]);
+    return;
+  }
+
+  for (int i = fr; i < to; i++) {
+    general_assert_1(bam_is_paired(records[i]), "Read " + bam_get_canonical_name(records[fr]) + " is detected as both single-end and paired-end read!");
+    add_to_appropriate_arr(records[i], arrs);
+  }
+
+  general_assert_1(arrs.arr_both.size() % 2 == 0, "Number of first and second mates in read " + bam_get_canonical_name(records[fr]) + "'s full alignments (both mates are aligned) are not matched!");
+  general_assert_1((arrs.arr_partial_1.size() + arrs.arr_partial_2.size() + arrs.arr_partial_unknown.size()) % 2 == 0, "Number of first and second mates in read " + bam_get_canonical_name(records[fr]) + "'s partial alignments (at most one mate is aligned) are not matched!");
+
+  if (!arrs.arr_both.empty()) {
+    sort(arrs.arr_both.begin(), arrs.arr_both.end(), less_than);
+    outputs.insert(outputs.end(), arrs.arr_both.begin(), arrs.arr_both.end());
+    arrs.arr_both.clear();
+  }
+
+  while (!arrs.arr_partial_1.empty() || !arrs.arr_partial_2.empty()) {
+    if (!arrs.arr_partial_1.empty() && !arrs.arr_partial_2.empty()) {
+      move_back(arrs.arr_partial_1, outputs);
+      move_back(arrs.arr_partial_2, outputs);
+    }
+    else if (!arrs.arr_partial_1.empty()) {
+      move_back(arrs.arr_partial_1, outputs);
+      move_back(arrs.arr_partial_unknown, outputs);
+    }
+    else {
+      move_back(arrs.arr_partial_2, outputs);
+      move_back(arrs.arr_partial_unknown, outputs);
+    }
+  }
+
+  while (!arrs.arr_partial_unknown.empty()) move_back(arrs.arr_partial_unknown, outputs);
+}
+
+void* reorder_reads(void* arg) {
+  Params *params = (Params*)arg;
+  ReadArrays arrs;
+
+  for (int i = params->fr; i < params->to; i++) reorder(starts[i], starts[i + 1], arrs, params->outputs);
+
+  return NULL;
+}
+
+void process_batch() {
+  int nReads = starts.size() - 1;
+  int nt = min(nThreads, nReads);
+  if (nt < 1) nt = 1;
+
+  vector<Params> params(nt);
+  for (int i = 0; i < nt; i++) {
+    params[i].fr = (long long)nReads * i / nt;
+    params[i].to = (long long)nReads * (i + 1) / nt;
+  }
+
+  if (nt == 1) reorder_reads(&params[0]);
+  else {
+    int rc;
+    vector<pthread_t> threads(nt);
+
+    for (int i = 0; i < nt; i++) {
+      rc = pthread_create(&threads[i], NULL, reorder_reads, &params[i]);
+      pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) when reordering alignments!");
+    }
+    for (int i = 0; i < nt; i++) {
+      rc = pthread_join(threads[i], NULL);
+      pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) when reordering alignments!");
+    }
+  }
+
+  for (int i = 0; i < nt; i++)
+    for (size_t j = 0; j < params[i].outputs.size(); j++) sam_write1(out, header, params[i].outputs[j]);
+}
+
 int main(int argc, char* argv[]) {
 	if (argc != 4) {
 		printf("Usage: rsem-scan-for-paired-end-reads number_of_threads input.[sam/bam/cram] output.bam\n");
@@ -64,70 +173,50 @@ int main(int argc, char* argv[]) {
 	out = sam_open(argv[3], "wb");
 	general_assert(out != 0, "Cannot open " + cstrtos(argv[3]) + " !");
 	sam_hdr_write(out, header);
+	int nInflate = bamReaderThreads(nThreads);
+	nThreads -= nInflate;
 	if (nThreads > 1) general_assert(hts_set_threads(out, nThreads) == 0, "Fail to create threads for writing the BAM file!");
+	reader = new BamReader(in, header, nInflate);
 
-	b = bam_init1(); b2 = bam_init1();
-
-	string qname;
-	bool go_on = (sam_read1(in, header, b) >= 0);
-	bool isPaired;
+	bool go_on = true, carry = false; // carry, records[n] starts the next batch
+	int n = 0;
 	HIT_INT_TYPE cnt = 0;
 
 	printf("."); fflush(stdout);
 
-	while (go_on) {
-	  qname = bam_get_canonical_name(b);
-	  isPaired = bam_is_paired(b);
-
-	  if (isPaired) {
-	    add_to_appropriate_arr(b);
-	    while ((go_on = (sam_read1(in, header, b) >= 0)) && (qname == bam_get_canonical_name(b))) {
-	      general_assert_1(bam_is_paired(b), "Read " + qname + " is detected as both single-end and paired-end read!");
-	      add_to_appropriate_arr(b);
-	    }
-
-	    general_assert_1(arr_both.size() % 2 == 0, "Number of first and second mates in read " + qname + "'s full alignments (both mates are aligned) are not matched!");
-	    general_assert_1((arr_partial_1.size() + arr_partial_2.size() + arr_partial_unknown.size()) % 2 == 0, "Number of first and second mates in read " + qname + "'s partial alignments (at most one mate is aligned) are not matched!");
-
-	    if (!arr_both.empty()) {
-	      sort(arr_both.begin(), arr_both.end(), less_than);
-	      for (size_t i = 0; i < arr_both.size(); i++) { sam_write1(out, header, arr_both[i]); bam_destroy1(arr_both[i]); }
-	      arr_both.clear();
-	    }
-	    
-	    while (!arr_partial_1.empty() || !arr_partial_2.empty()) {
-	      if (!arr_partial_1.empty() && !arr_partial_2.empty()) {
-		sam_write1(out, header, arr_partial_1.back()); bam_destroy1(arr_partial_1.back()); arr_partial_1.pop_back();
-		sam_write1(out, header, arr_partial_2.back()); bam_destroy1(arr_partial_2.back()); arr_partial_2.pop_back();
-	      }
-	      else if (!arr_partial_1.empty()) {
-		sam_write1(out, header, arr_partial_1.back()); bam_destroy1(arr_partial_1.back()); arr_partial_1.pop_back();
-		sam_write1(out, header, arr_partial_unknown.back()); bam_destroy1(arr_partial_unknown.back()); arr_partial_unknown.pop_back();
-	      }
-	      else {
-		sam_write1(out, header, arr_partial_2.back()); bam_destroy1(arr_partial_2.back()); arr_partial_2.pop_back();
-		sam_write1(out, header, arr_partial_unknown.back()); bam_destroy1(arr_partial_unknown.back()); arr_partial_unknown.pop_back();
-	      }
-	    }
-	    
-	    while (!arr_partial_unknown.empty()) {
-	      sam_write1(out, header, arr_partial_unknown.back()); bam_destroy1(arr_partial_unknown.back()); arr_partial_unknown.pop_back();
-	    }
+	while (go_on || carry) {
+	  starts.clear();
+	  if (carry) {
+	    swap(records[0], records[n]);
+	    starts.push_back(0);
+	    n = 1;
+	    carry = false;
+	    ++cnt;
+	    if (cnt % 1000000 == 0) { printf("."); fflush(stdout); }
 	  }
-	  else {
-	    sam_write1(out, header, b);
-	    while ((go_on = (sam_read1(in, header, b) >= 0)) && (qname == bam_get_qname(b))) {
-	      sam_write1(out, header, b);
+	  else n = 0;
+
+	  while (go_on) {
+	    if (n == (int)records.size()) records.push_back(bam_init1());
+	    if (!(go_on = (reader->read(records[n]) >= 0))) break;
+	    if (starts.empty() || !same_read(records[starts.back()], records[n])) {
+	      if (n >= BATCH_SIZE) { carry = true; break; }
+	      starts.push_back(n);
+	      ++cnt;
+	      if (cnt % 1000000 == 0) { printf("."); fflush(stdout); }
 	    }
+	    ++n;
 	  }
-	  
-	  ++cnt;
-	  if (cnt % 1000000 == 0) { printf("."); fflush(stdout); }
+
+	  if (starts.empty()) break;
+	  starts.push_back(n);
+	  process_batch();
 	}
 	
 	printf("\nFinished!\n");
 	
-	bam_destroy1(b); bam_destroy1(b2);
+	for (size_t i = 0; i < records.size(); i++) bam_destroy1(records[i]);
+	delete reader;
 	bam_hdr_destroy(header);
 	
 	sam_close(in);
@@ -2,13 +2,16 @@
 #define SIMUL_H_
 
 #include<cassert>
+#include<vector>
+#include<algorithm>
 
 #include "boost/random.hpp"
+#include "philox.h"
 
 class simul {
 public:
 
- simul(unsigned int seed) : engine(seed), rg(engine, boost::random::uniform_01<>()) {
+ simul(unsigned int seed, philox_engine::stream_type stream = 0) : engine(seed, stream), rg(engine, boost::random::uniform_01<>()) {
   }
 
 	// interval : [,)
@@ -37,8 +40,62 @@ public:
 	double random() { return rg(); };
 
 private:
-	boost::random::mt19937 engine;
-	boost::random::variate_generator<boost::random::mt19937&, boost::random::uniform_01<> > rg;
+	philox_engine engine;
+	boost::random::variate_generator<philox_engine&, boost::random::uniform_01<> > rg;
+};
+
+/*
+  Walker's alias table (built by Vose's method) over weights w[0 .. n - 1]: a draw takes one random number and O(1) time,
+  returning i with probability w[i] / sum(w). Entries of weight 0 are never returned.
+ */
+class AliasTable {
+public:
+	AliasTable() {}
+
+	AliasTable(const double* w, int n) { build(w, n); }
+
+	void build(const double* w, int n) {
+		std::vector<int> small, large;
+		double sum = 0.0;
+
+		assert(n > 0);
+		for (int i = 0; i < n; i++) sum += w[i];
+		assert(sum > 0.0);
+
+		probs.resize(n); aliases.resize(n);
+		for (int i = 0; i < n; i++) {
+			probs[i] = w[i] * n / sum;
+			aliases[i] = i;
+			if (probs[i] < 1.0) small.push_back(i); else large.push_back(i);
+		}
+
+		while (!small.empty() && !large.empty()) {
+			int s = small.back(), l = large.back();
+			small.pop_back();
+			aliases[s] = l;
+			probs[l] -= 1.0 - probs[s];
+			if (probs[l] < 1.0) { large.pop_back(); small.push_back(l); }
+		}
+		// what is left has probability 1 up to rounding errors, unless it has weight 0
+		int heaviest = std::max_element(w, w + n) - w;
+		for (size_t i = 0; i < small.size(); i++)
+			if (w[small[i]] > 0.0) probs[small[i]] = 1.0;
+			else { probs[small[i]] = 0.0; aliases[small[i]] = heaviest; }
+		for (size_t i = 0; i < large.size(); i++) probs[large[i]] = 1.0;
+	}
+
+	int size() const { return probs.size(); }
+
+	int sample(simul* sampler) const {
+		int n = probs.size();
+		double u = sampler->random() * n;
+		int i = std::min(int(u), n - 1);
+		return (u - i < probs[i] ? i : aliases[i]);
+	}
+
+private:
+	std::vector<double> probs; // probs[i], the chance of keeping i when slot i is drawn
+	std::vector<int> aliases; // aliases[i], returned otherwise
 };
 
 #endif /* SIMUL_H_ */
@@ -9,6 +9,11 @@
 #include<fstream>
 #include<sstream>
 #include<vector>
+#include<pthread.h>
+#include<stdint.h>
+
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
 
 #include "utils.h"
 #include "my_assert.h"
@@ -25,8 +30,11 @@
 #include "PairedEndQModel.h"
 
 #include "Refs.h"
+#include "GroupInfo.h"
 #include "Transcript.h"
 #include "Transcripts.h"
+#include "BamSorter.h"
+#include "SimulatedAlignments.h"
 
 #include "WriteResults.h"
 
@@ -49,13 +57,38 @@ vector<double> eel;
 vector<double> theta, counts;
 
 int n_os;
-ostream *os[2];
+FILE *fo[2];
 char outReadF[2][STRLEN];
 
 char refName[STRLEN];
 char refF[STRLEN], tiF[STRLEN];
 
-simul *sampler;
+unsigned int seed;
+int nThreads;
+bool gzipOut; // write BGZF-compressed reads, which any gzip reader accepts
+
+bool genBam, genMultimap; // write the alignments of the reads to a transcript BAM, with hits to isoforms sharing the fragment if genMultimap
+char bamF[STRLEN];
+GroupInfo gi;
+SimulatedAlignments *aligner;
+
+/*
+  Reads are simulated in shards of SHARD_SIZE consecutive read indices; shard k draws from stream k of the seed, so the
+  reads do not depend on the number of threads. Each round, thread i simulates (and compresses) one shard into memory, and
+  the shards are written out in order.
+ */
+const READ_INT_TYPE SHARD_SIZE = 1 << 16;
+
+struct Params {
+	void *model;
+	READ_INT_TYPE fr, to; // the shard, reads [fr, to)
+	ostream *texts[2]; // simulated reads of the shard, per output file, each an ostringstream
+	string outs[2]; // what goes to each output file
+	vector<bam1_t*> records; // records[0 .. nRecords - 1], alignments of the shard
+	int nRecords;
+	vector<double> counts;
+	READ_INT_TYPE resimulation_count;
+};
 
 void genOutReadStreams(int type, char *outFN) {
 	switch(type) {
@@ -79,16 +112,56 @@ void genOutReadStreams(int type, char *outFN) {
 		break;
 	}
 
-	for (int i = 0; i < n_os; i++)
-		os[i] = new ofstream(outReadF[i]);
+	for (int i = 0; i < n_os; i++) {
+		if (gzipOut) strcat(outReadF[i], ".gz");
+		fo[i] = fopen(outReadF[i], "wb");
+		general_assert(fo[i] != NULL, "Cannot create " + cstrtos(outReadF[i]) + "!");
+	}
+}
+
+// Compress text into BGZF blocks, appended to out
+void compressBGZF(const string& text, string& out) {
+	vector<uint8_t> block(BGZF_MAX_BLOCK_SIZE);
+
+	for (size_t fr = 0, len; fr < text.length(); fr += len) {
+		len = min((size_t)BGZF_BLOCK_SIZE, text.length() - fr);
+		size_t clen = BGZF_MAX_BLOCK_SIZE;
+		general_assert(bgzf_compress(&block[0], &clen, text.data() + fr, len, -1) == 0, "Fail to compress simulated reads!");
+		out.append((const char*)&block[0], clen);
+	}
 }
 
 template<class ReadType, class ModelType>
-void simulate(char* modelF, char* resultsF) {
-	ModelType model(&refs);
+void* simulateShard(void* arg) {
+	Params *params = (Params*)arg;
+	ModelType *model = (ModelType*)(params->model);
+	simul sampler(seed, params->fr / SHARD_SIZE);
 	ReadType read;
 	int sid;
 
+	for (int i = 0; i < n_os; i++) static_cast<ostringstream*>(params->texts[i])->str("");
+	params->nRecords = 0;
+	for (READ_INT_TYPE i = params->fr; i < params->to; i++) {
+		while (!model->simulate(&sampler, i, read, sid)) { ++params->resimulation_count; }
+		read.write(n_os, params->texts);
+		if (genBam) aligner->add(read, sid, params->records, params->nRecords);
+		++params->counts[sid];
+	}
+
+	for (int i = 0; i < n_os; i++) {
+		params->outs[i].clear();
+		string text = static_cast<ostringstream*>(params->texts[i])->str();
+		if (gzipOut) compressBGZF(text, params->outs[i]);
+		else params->outs[i].swap(text);
+	}
+
+	return NULL;
+}
+
+template<class ReadType, class ModelType>
+void simulate(char* modelF, char* resultsF) {
+	ModelType model(&refs);
+
 	model.read(modelF);
 	
 	//calculate eel
@@ -117,22 +190,78 @@ void simulate(char* modelF, char* resultsF) {
 	READ_INT_TYPE resimulation_count = 0;
 
 	//simulating...
-	model.startSimulation(sampler, theta);
-	for (READ_INT_TYPE i = 0; i < N; i++) {
-		while (!model.simulate(i, read, sid)) { ++resimulation_count; }
-		read.write(n_os, os);
-		++counts[sid];
-		if ((i + 1) % 1000000 == 0 && verbose) cout<<"GEN "<< i + 1<< endl;
+	model.startSimulation(theta);
+
+	vector<Params> params(nThreads);
+	vector<pthread_t> threads(nThreads);
+	for (int i = 0; i < nThreads; i++) {
+		params[i].model = (void*)(&model);
+		for (int j = 0; j < n_os; j++) params[i].texts[j] = new ostringstream();
+		params[i].counts.assign(M + 1, 0.0);
+		params[i].nRecords = 0;
+		params[i].resimulation_count = 0;
+	}
+
+	BgzfWriter *writer = NULL;
+	bam_hdr_t *header = NULL;
+	if (genBam) {
+		header = aligner->createHeader();
+		writer = new BgzfWriter(bamF, nThreads, false);
+		writer->writeHeader(header);
+	}
+
+	int rc, nt;
+	for (READ_INT_TYPE fr = 0; fr < N; fr += nt * SHARD_SIZE) {
+		nt = 0;
+		for (READ_INT_TYPE to = fr; nt < nThreads && to < N; nt++, to += SHARD_SIZE) {
+			params[nt].fr = to;
+			params[nt].to = min(N, to + SHARD_SIZE);
+		}
+
+		if (nt == 1) simulateShard<ReadType, ModelType>(&params[0]);
+		else {
+			for (int i = 0; i < nt; i++) {
+				rc = pthread_create(&threads[i], NULL, simulateShard<ReadType, ModelType>, (void*)(&params[i]));
+				pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) when simulating reads!");
+			}
+			for (int i = 0; i < nt; i++) {
+				rc = pthread_join(threads[i], NULL);
+				pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) when simulating reads!");
+			}
+		}
+
+		for (int i = 0; i < nt; i++) {
+			for (int j = 0; j < n_os; j++)
+				general_assert(fwrite(params[i].outs[j].data(), 1, params[i].outs[j].length(), fo[j]) == params[i].outs[j].length(), "Fail to write " + cstrtos(outReadF[j]) + "!");
+			for (int j = 0; j < params[i].nRecords; j++) writer->write(params[i].records[j]);
+			if (verbose && params[i].to / 1000000 > params[i].fr / 1000000) cout<<"GEN "<< params[i].to / 1000000 * 1000000<< endl;
+		}
+	}
+
+	for (int i = 0; i < nThreads; i++) {
+		for (int j = 0; j < n_os; j++) delete params[i].texts[j];
+		for (size_t j = 0; j < params[i].records.size(); j++) bam_destroy1(params[i].records[j]);
+		for (int j = 0; j <= M; j++) counts[j] += params[i].counts[j];
+		resimulation_count += params[i].resimulation_count;
 	}
+
+	if (genBam) {
+		writer->close();
+		delete writer;
+		bam_hdr_destroy(header);
+	}
+
 	model.finishSimulation();
 
 	cout<< "Total number of resimulation is "<< resimulation_count<< endl;
 }
 
 void releaseOutReadStreams() {
+	static const uint8_t eof[28] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
 	for (int i = 0; i < n_os; i++) {
-		((ofstream*)os[i])->close();
-		delete os[i];
+		if (gzipOut) general_assert(fwrite(eof, 1, 28, fo[i]) == 28, "Fail to write " + cstrtos(outReadF[i]) + "!");
+		general_assert(fclose(fo[i]) == 0, "Fail to write " + cstrtos(outReadF[i]) + "!");
 	}
 }
 
@@ -140,8 +269,8 @@ int main(int argc, char* argv[]) {
 	bool quiet = false;
 	FILE *fi = NULL;
 
-	if (argc < 7 || argc > 10) {
-		printf("Usage: rsem-simulate-reads reference_name estimated_model_file estimated_isoform_results theta0 N output_name [--seed seed] [-q]\n\n");
+	if (argc < 7) {
+		printf("Usage: rsem-simulate-reads reference_name estimated_model_file estimated_isoform_results theta0 N output_name [--seed seed] [-p num_threads] [--gzip] [--bam [--multimap]] [-q]\n\n");
 		printf("Parameters:\n\n");
 		printf("reference_name: The name of RSEM references, which should be already generated by 'rsem-prepare-reference'\n");
 		printf("estimated_model_file: This file describes how the RNA-Seq reads will be sequenced given the expression levels. It determines what kind of reads will be simulated (single-end/paired-end, w/o quality score) and includes parameters for fragment length distribution, read start position distribution, sequencing error models, etc. Normally, this file should be learned from real data using 'rsem-calculate-expression'. The file can be found under the 'sample_name.stat' folder with the name of 'sample_name.model'\n");
@@ -149,12 +278,16 @@ int main(int argc, char* argv[]) {
 		printf("theta0: This parameter determines the fraction of reads that are coming from background \"noise\" (instead of from a transcript). It can also be estimated using 'rsem-calculate-expression' from real data. Users can find it as the first value of the third line of the file 'sample_name.stat/sample_name.theta'.\n");
 		printf("N: The total number of reads to be simulated. If 'rsem-calculate-expression' is executed on a real data set, the total number of reads can be found as the 4th number of the first line of the file 'sample_name.stat/sample_name.cnt'.\n");
 		printf("output_name: Prefix for all output files.\n");
-		printf("--seed seed: Set seed for the random number generator used in simulation. The seed should be a 32-bit unsigned integer.\n");
+		printf("--seed seed: Set seed for the random number generator used in simulation. The seed should be a 32-bit unsigned integer. Given a seed, the simulated reads are the same regardless of the number of threads.\n");
+		printf("-p num_threads: Number of threads used to simulate reads. (Default: 1)\n");
+		printf("--gzip: Write the reads compressed, in BGZF format, to files ending with '.gz'.\n");
+		printf("--bam: Also write the true alignments of the reads to output_name.sim.bam, a transcript BAM file grouped by read name which can be given to 'rsem-calculate-expression --alignments' directly. Noise reads are unaligned. Every record carries the read's origin in tags ZT (sid), ZD (dir), ZP (pos) and, for paired-end reads, ZI (insertL), with the meanings in the header line format below.\n");
+		printf("--multimap: With --bam, also align each read to every other isoform of its gene that contains the read's fragment exactly, as an aligner would. NH gives the number of alignments of a read.\n");
 		printf("-q: Set it will stop outputting intermediate information.\n\n");
 		printf("Outputs:\n\n");
 		printf("output_name.sim.isoforms.results, output_name.sim.genes.results: Expression levels estimated by counting where each simulated read comes from.\n");
 		printf("output_name.sim.alleles.results: Allele-specific expression levels estimated by counting where each simulated read comes from.\n\n");
-		printf("output_name.fa if single-end without quality score;\noutput_name.fq if single-end with quality score;\noutput_name_1.fa & output_name_2.fa if paired-end without quality score;\noutput_name_1.fq & output_name_2.fq if paired-end with quality score.\n\n");
+		printf("output_name.fa if single-end without quality score;\noutput_name.fq if single-end with quality score;\noutput_name_1.fa & output_name_2.fa if paired-end without quality score;\noutput_name_1.fq & output_name_2.fq if paired-end with quality score. With --gzip, these files end with '.gz'.\n\n");
 		printf("Format of the header line: Each simulated read's header line encodes where it comes from. The header line has the format:\n\n");
 		printf("\t{>/@}_rid_dir_sid_pos[_insertL]\n\n");
 		printf("{>/@}: Either '>' or '@' must appear. '>' appears if FASTA files are generated and '@' appears if FASTQ files are generated\n");
@@ -170,20 +303,27 @@ int main(int argc, char* argv[]) {
 	}
 
 	quiet = false;
-	sampler = NULL;
+	seed = time(NULL);
+	nThreads = 1;
+	gzipOut = genBam = genMultimap = false;
 	for (int i = 7; i < argc; i++) {
 	  if (!strcmp(argv[i], "-q")) quiet = true;
+	  if (!strcmp(argv[i], "--gzip")) gzipOut = true;
+	  if (!strcmp(argv[i], "--bam")) genBam = true;
+	  if (!strcmp(argv[i], "--multimap")) genMultimap = true;
 	  if (!strcmp(argv[i], "--seed")) {
 	    assert(i + 1 < argc);
 	    istringstream reader(argv[i + 1]);
-	    unsigned int seed;
 	    assert(reader>> seed);
-	    sampler = new simul(seed);
+	  }
+	  if (!strcmp(argv[i], "-p")) {
+	    assert(i + 1 < argc);
+	    nThreads = atoi(argv[i + 1]);
+	    general_assert(nThreads > 0, "Number of threads should be positive!");
 	  }
 	}
 
 	verbose = !quiet;
-	if (sampler == NULL) sampler = new simul(time(NULL));
 
 	strcpy(refName, argv[1]);
 	alleleS = isAlleleSpecific(refName);
@@ -208,6 +348,17 @@ int main(int argc, char* argv[]) {
 
 	genOutReadStreams(model_type, argv[6]);
 
+	aligner = NULL;
+	if (genBam) {
+		if (genMultimap) {
+			char groupF[STRLEN];
+			sprintf(groupF, "%s.grp", argv[1]);
+			gi.load(groupF);
+		}
+		aligner = new SimulatedAlignments(refs, genMultimap ? &gi : NULL);
+		sprintf(bamF, "%s.sim.bam", argv[6]);
+	}
+
 	counts.assign(M + 1, 0.0);
 
 	switch(model_type) {
@@ -219,7 +370,7 @@ int main(int argc, char* argv[]) {
 
 	writeResultsSimulation(M, refName, argv[6], transcripts, eel, counts);
 	releaseOutReadStreams();
-	delete sampler;
+	if (aligner != NULL) delete aligner;
 
 	return 0;
 }
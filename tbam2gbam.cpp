@@ -4,6 +4,7 @@
 #include<cassert>
 
 #include "utils.h"
+#include "my_assert.h"
 #include "Transcripts.h"
 #include "BamConverter.h"
 
@@ -11,26 +12,54 @@ using namespace std;
 
 int nThreads;
 char tiF[STRLEN], chr_list[STRLEN];
+char *sortedF;
+size_t sortMem;
 Transcripts transcripts;
 
+// memory size with an optional K/M/G suffix, as in 'samtools sort -m'
+size_t parseMemory(const char* str) {
+	char *end;
+	double value = strtod(str, &end);
+	bool ok = (end != str);
+	switch (*end) {
+	case '\0': break;
+	case 'k': case 'K': value *= 1024.0; ++end; break;
+	case 'm': case 'M': value *= 1024.0 * 1024.0; ++end; break;
+	case 'g': case 'G': value *= 1024.0 * 1024.0 * 1024.0; ++end; break;
+	default: ok = false;
+	}
+	general_assert(ok && *end == '\0' && value >= 1.0, "Cannot parse memory size " + cstrtos(str) + "! It must be a positive number with an optional K/M/G suffix.");
+	return (size_t)value;
+}
+
 int main(int argc, char* argv[]) {
-	if (argc != 4 && argc != 6) {
-		printf("Usage: rsem-tbam2gbam reference_name unsorted_transcript_bam_input genome_bam_output [-p number_of_threads]\n");
+	if (argc < 4) {
+		printf("Usage: rsem-tbam2gbam reference_name unsorted_transcript_bam_input genome_bam_output [-p number_of_threads] [--sort sorted_genome_bam_output] [-m memory_per_thread]\n");
+		printf("  --sort: also write a coordinate-sorted copy of the genome bam, together with its .bai index\n");
+		printf("  -m: memory per thread for sorting, accepting suffices 'K/M/G' (Default: 1G)\n");
 		exit(-1);
 	}
 
-        nThreads = 1; // default is 1
-        if (argc == 6) { assert(strcmp(argv[4], "-p") == 0); nThreads = atoi(argv[5]); }
+	nThreads = 1; // default is 1
+	sortedF = NULL;
+	sortMem = size_t(1) << 30;
+	for (int i = 4; i < argc; i++) {
+		general_assert(i + 1 < argc, "Option " + cstrtos(argv[i]) + " needs a value!");
+		if (!strcmp(argv[i], "-p")) nThreads = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "--sort")) sortedF = argv[i + 1];
+		else if (!strcmp(argv[i], "-m")) sortMem = parseMemory(argv[i + 1]);
+		else general_assert(false, "Unknown option " + cstrtos(argv[i]) + "!");
+		++i;
+	}
 
 	sprintf(tiF, "%s.ti", argv[1]);
 	sprintf(chr_list, "%s.chrlist", argv[1]);
 	transcripts.readFrom(tiF);
 
 	printf("Start converting:\n");
-	BamConverter bc(argv[2], argv[3], chr_list, transcripts, nThreads, assemble_command(argc, argv));
+	BamConverter bc(argv[2], argv[3], chr_list, transcripts, nThreads, assemble_command(argc, argv), sortedF, sortMem * (nThreads > 1 ? nThreads : 1));
 	bc.process();
 	printf("Genome bam file is generated!\n");
 
 	return 0;
 }
-
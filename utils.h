@@ -126,26 +126,10 @@ inline std::string cleanStr(const std::string& str) {
   return (fr <= to ? str.substr(fr, to - fr + 1) : "");
 }
 
-inline void genReadFileNames(const char* readFN, int tagType, int read_type, int& s, char readFs[][STRLEN]){
+// Binary read file of one category, see ReadFile.h
+inline void genReadFileName(const char* readFN, int tagType, char* readF) {
 	const char tags[3][STRLEN] = {"un", "alignable", "max"};
-	char suffix[STRLEN];
-
-	if (read_type == 0 || read_type == 2) {
-		strcpy(suffix, "fa");
-	}
-	else {
-		strcpy(suffix, "fq");
-	}
-
-	if (read_type == 0 || read_type == 1) {
-		s = 1;
-		sprintf(readFs[0], "%s_%s.%s", readFN, tags[tagType], suffix);
-	}
-	else {
-		s = 2;
-		sprintf(readFs[0], "%s_%s_1.%s", readFN, tags[tagType], suffix);
-		sprintf(readFs[1], "%s_%s_2.%s", readFN, tags[tagType], suffix);
-	}
+	sprintf(readF, "%s_%s.reads", readFN, tags[tagType]);
 }
 
 inline void printTimeUsed(const time_t& a, const time_t& b, const char* program_name) {
@@ -1,7 +1,12 @@
 #include <cstring>
 #include <cstdlib>
 #include <cassert>
+#include <cmath>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <zlib.h>
+#include <pthread.h>
 
 #include <stdint.h>
 #include "htslib/sam.h"
@@ -10,62 +15,208 @@
 #include "utils.h"
 #include "my_assert.h"
 #include "wiggle.h"
+#include "ReadDepthFile.h"
 
 bool no_fractional_weight = false;
 
-void add_bam_record_to_wiggle(const bam1_t *b, Wiggle& wiggle) {
-    double w;
+/*
+  Coverage is accumulated as a difference array: each M operation adds its weight at its first base and subtracts it
+  right after its last base, and a prefix-sum pass turns the differences into read depths. Weights are kept in int64_t
+  as integer multiples of 2^-32 (exact for any ZW weight of at least 1/256), so the sums are exact up to a depth of 2^31 and
+  independent of the order of the operations, and uncovered bases come out as exactly 0. Only the final depths are doubles.
+ */
+static const double WEIGHT_SCALE = 4294967296.0; // 2^32
 
-    if (no_fractional_weight) w = 1.0;
+static const double MIN_WIGGLE_DEPTH = 0.0095; // smallest depth shown, 0.01 after rounding
+
+static void add_bam_record_to_wiggle(const bam1_t *b, std::vector<int64_t>& diffs) {
+    int64_t w;
+
+    if (no_fractional_weight) w = (int64_t)WEIGHT_SCALE;
     else {
       uint8_t *p_tag = bam_aux_get(b, "ZW");
       if (p_tag == NULL) return;
-      w = bam_aux2f(p_tag);
+      w = (int64_t)floor(bam_aux2f(p_tag) * WEIGHT_SCALE + 0.5);
     }
 
-    int pos = b->core.pos;
+    int pos = b->core.pos, length = diffs.size();
     uint32_t *p = bam_get_cigar(b);
     
     for (int i = 0; i < (int)b->core.n_cigar; ++i, ++p) {
       char op = bam_cigar_op(*p);
       int op_len = bam_cigar_oplen(*p);
 
-      if (op == BAM_CMATCH)
-	for (int j = 0; j < op_len; ++j, ++pos) wiggle.read_depth[pos] += w;
+      if (op == BAM_CMATCH) {
+	if (pos < length) diffs[pos] += w;
+	pos += op_len;
+	if (pos < length) diffs[pos] -= w;
+      }
       else pos += ((bam_cigar_type(op) & 2) ? op_len : 0);
     }
 }
 
+// the depths of the previous wiggle are freed, so that a chromosome is only held once
+static void start_wiggle(const bam_hdr_t *header, int tid, Wiggle& wiggle, std::vector<int64_t>& diffs) {
+    wiggle.name = header->target_name[tid];
+    wiggle.length = header->target_len[tid];
+    std::vector<double>().swap(wiggle.read_depth);
+    diffs.assign(wiggle.length, 0);
+}
+
+// turn the differences into read depths, then free them
+static void finish_wiggle(std::vector<int64_t>& diffs, Wiggle& wiggle) {
+    int64_t depth = 0;
+    wiggle.read_depth.resize(wiggle.length);
+    for (size_t i = 0; i < wiggle.length; ++i) {
+      depth += diffs[i];
+      wiggle.read_depth[i] = depth / WEIGHT_SCALE;
+    }
+    std::vector<int64_t>().swap(diffs);
+}
+
+static void report_progress(HIT_INT_TYPE from, HIT_INT_TYPE to) {
+    for (HIT_INT_TYPE cnt = (from / 1000000 + 1) * 1000000; cnt <= to; cnt += 1000000) std::cout<< cnt<< std::endl;
+}
+
+/*
+  With an index, nthreads workers build the wiggles of different chromosomes, each through its own file handle and region
+  iterator. A worker takes the next chromosome, builds its wiggle, then waits for its turn to hand it to the processor, so
+  the wiggles are processed in chromosome order and at most nthreads of them are held in memory, i.e. up to nthreads times
+  the memory of a single thread when the longest chromosomes are built together.
+ */
+struct WiggleBuilder {
+    const std::string *bam_filename;
+    WiggleProcessor *processor;
+    int n_targets;
+
+    pthread_mutex_t lock;
+    pthread_cond_t turn_changed;
+    int next_tid, turn; // next chromosome to build, next chromosome to process
+    HIT_INT_TYPE cnt;
+    std::vector<bool> used;
+};
+
+static void* build_wiggles_in_thread(void* arg) {
+    WiggleBuilder *builder = (WiggleBuilder*)arg;
+
+    samFile *bam_in = sam_open(builder->bam_filename->c_str(), "r");
+    general_assert(bam_in != NULL, "Cannot open " + *builder->bam_filename + "!");
+    bam_hdr_t *header = sam_hdr_read(bam_in);
+    general_assert(header != 0, "Cannot load SAM header!");
+    hts_idx_t *idx = sam_index_load(bam_in, builder->bam_filename->c_str());
+    general_assert(idx != NULL, "Cannot load the index of " + *builder->bam_filename + "!");
+
+    bam1_t *b = bam_init1();
+    Wiggle wiggle;
+    std::vector<int64_t> diffs;
+    int tid;
+    HIT_INT_TYPE cnt;
+
+    while (true) {
+      pthread_mutex_lock(&builder->lock);
+      tid = builder->next_tid++;
+      pthread_mutex_unlock(&builder->lock);
+      if (tid >= builder->n_targets) break;
+
+      cnt = 0;
+      start_wiggle(header, tid, wiggle, diffs);
+      hts_itr_t *iter = sam_itr_queryi(idx, tid, 0, header->target_len[tid]);
+      general_assert(iter != NULL, "Cannot query " + cstrtos(header->target_name[tid]) + " in " + *builder->bam_filename + "!");
+      while (sam_itr_next(bam_in, iter, b) >= 0) {
+	if (bam_is_unmapped(b)) continue;
+	add_bam_record_to_wiggle(b, diffs);
+	++cnt;
+      }
+      hts_itr_destroy(iter);
+      finish_wiggle(diffs, wiggle);
+
+      pthread_mutex_lock(&builder->lock);
+      while (builder->turn != tid) pthread_cond_wait(&builder->turn_changed, &builder->lock);
+      pthread_mutex_unlock(&builder->lock);
+
+      // only the thread holding the turn gets here
+      if (cnt > 0) {
+	builder->used[tid] = true;
+	builder->processor->process(wiggle);
+	report_progress(builder->cnt, builder->cnt + cnt);
+	builder->cnt += cnt;
+      }
+
+      pthread_mutex_lock(&builder->lock);
+      ++builder->turn;
+      pthread_cond_broadcast(&builder->turn_changed);
+      pthread_mutex_unlock(&builder->lock);
+    }
+
+    bam_destroy1(b);
+    hts_idx_destroy(idx);
+    bam_hdr_destroy(header);
+    sam_close(bam_in);
+
+    return NULL;
+}
+
 void build_wiggles(const std::string& bam_filename,
-                   WiggleProcessor& processor) {
+                   WiggleProcessor& processor, int num_threads) {
   
     samFile *bam_in = sam_open(bam_filename.c_str(), "r");
     general_assert(bam_in != NULL, "Cannot open " + bam_filename + "!");
 
     bam_hdr_t *header = sam_hdr_read(bam_in);
     general_assert(header != 0, "Cannot load SAM header!");
-    bool *used = new bool[header->n_targets];
-    memset(used, 0, sizeof(bool) * header->n_targets);
 
-    int cur_tid = -1; //current tid;
-    HIT_INT_TYPE cnt = 0;
-    bam1_t *b = bam_init1();
+    std::vector<bool> used(header->n_targets, false);
     Wiggle wiggle;
-    while (sam_read1(bam_in, header, b) >= 0) {
-      if (bam_is_unmapped(b)) continue;
+    std::vector<int64_t> diffs;
+
+    hts_idx_t *idx = (num_threads > 1 ? sam_index_load(bam_in, bam_filename.c_str()) : NULL);
+    if (idx != NULL) {
+      hts_idx_destroy(idx);
+
+      WiggleBuilder builder;
+      builder.bam_filename = &bam_filename;
+      builder.processor = &processor;
+      builder.n_targets = header->n_targets;
+      pthread_mutex_init(&builder.lock, NULL);
+      pthread_cond_init(&builder.turn_changed, NULL);
+      builder.next_tid = builder.turn = 0;
+      builder.cnt = 0;
+      builder.used.assign(header->n_targets, false);
+
+      int rc;
+      std::vector<pthread_t> threads(num_threads);
+      for (int i = 0; i < num_threads; ++i) {
+	rc = pthread_create(&threads[i], NULL, build_wiggles_in_thread, &builder);
+	pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) when building wiggles!");
+      }
+      for (int i = 0; i < num_threads; ++i) {
+	rc = pthread_join(threads[i], NULL);
+	pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) when building wiggles!");
+      }
+
+      pthread_mutex_destroy(&builder.lock);
+      pthread_cond_destroy(&builder.turn_changed);
+      used = builder.used;
+    }
+    else {
+      int cur_tid = -1; //current tid;
+      HIT_INT_TYPE cnt = 0;
+      bam1_t *b = bam_init1();
+      while (sam_read1(bam_in, header, b) >= 0) {
+	if (bam_is_unmapped(b)) continue;
       
-      if (b->core.tid != cur_tid) {
-	if (cur_tid >= 0) { used[cur_tid] = true; processor.process(wiggle); }
-	cur_tid = b->core.tid;
-	wiggle.name = header->target_name[cur_tid];
-	wiggle.length = header->target_len[cur_tid];
-	wiggle.read_depth.assign(wiggle.length, 0.0);
+	if (b->core.tid != cur_tid) {
+	  if (cur_tid >= 0) { used[cur_tid] = true; finish_wiggle(diffs, wiggle); processor.process(wiggle); }
+	  cur_tid = b->core.tid;
+	  start_wiggle(header, cur_tid, wiggle, diffs);
+	}
+	add_bam_record_to_wiggle(b, diffs);
+	++cnt;
+	if (cnt % 1000000 == 0) std::cout<< cnt<< std::endl;
       }
-      add_bam_record_to_wiggle(b, wiggle);
-      ++cnt;
-      if (cnt % 1000000 == 0) std::cout<< cnt<< std::endl;
+      if (cur_tid >= 0) { used[cur_tid] = true; finish_wiggle(diffs, wiggle); processor.process(wiggle); }
+      bam_destroy1(b);
     }
-    if (cur_tid >= 0) { used[cur_tid] = true; processor.process(wiggle); }
     
     for (int32_t i = 0; i < header->n_targets; i++)
       if (!used[i]) {
@@ -75,11 +226,8 @@ void build_wiggles(const std::string& bam_filename,
 	processor.process(wiggle);
       }
 
-    bam_destroy1(b);
     bam_hdr_destroy(header);
     sam_close(bam_in);
-
-    delete[] used;
 }
 
 UCSCWiggleTrackWriter::UCSCWiggleTrackWriter(const std::string& output_filename,
@@ -101,7 +249,7 @@ void UCSCWiggleTrackWriter::process(const Wiggle& wiggle) {
     
     sp = ep = -1;
     for (size_t i = 0; i < wiggle.length; i++) {
-        if (wiggle.read_depth[i] >= 0.0095) {
+        if (wiggle.read_depth[i] >= MIN_WIGGLE_DEPTH) {
             ep = i;
         }
         else {
@@ -120,20 +268,371 @@ void UCSCWiggleTrackWriter::process(const Wiggle& wiggle) {
     }
 }
 
-ReadDepthWriter::ReadDepthWriter(std::ostream& stream) 
-    : stream_(stream) {
+/*
+  bigWig layout: the header, BW_MAX_ZOOM_LEVELS zoom headers and the total summary come first and are filled in last; the
+  sections, the chromosome tree, the main index, then each zoom level's data and index follow. Zoom level k summarizes
+  bins of BW_BASE_REDUCTION * 4^k bases; only levels that shrink the data are kept.
+ */
+static const uint32_t BW_MAGIC = 0x888FFC26;
+static const uint32_t BPT_MAGIC = 0x78CA8C91;
+static const uint32_t CIR_TREE_MAGIC = 0x2468ACE0;
+static const int BW_VERSION = 4;
+static const int BW_HEADER_SIZE = 64;
+static const int BW_ZOOM_HEADER_SIZE = 24;
+static const int BW_SUMMARY_SIZE = 40;
+static const int BW_MAX_ZOOM_LEVELS = 10;
+static const uint32_t BW_BASE_REDUCTION = 32;
+static const uint32_t BW_ITEMS_PER_SLOT = 1024;
+static const uint32_t BW_BLOCK_SIZE = 256; // children per index node
+
+template<class T>
+static void append_value(std::string& buf, T value) {
+    buf.append((const char*)&value, sizeof(T));
+}
+
+BigWigWriter::BigWigWriter(const std::string& output_filename) : output_filename(output_filename) {
+    fo = fopen(output_filename.c_str(), "wb");
+    general_assert(fo != NULL, "Cannot create " + output_filename + "!");
+
+    // reserve the header, zoom headers, total summary and the section count
+    std::string placeholder(BW_HEADER_SIZE + BW_ZOOM_HEADER_SIZE * BW_MAX_ZOOM_LEVELS + BW_SUMMARY_SIZE + 8, 0);
+    general_assert(fwrite(placeholder.data(), 1, placeholder.size(), fo) == placeholder.size(), "Fail to write " + output_filename + "!");
+
+    n_runs = 0;
+    zooms.resize(BW_MAX_ZOOM_LEVELS);
+    memset(&total, 0, sizeof(total));
+    uncompress_buf_size = 0;
 }
 
-void ReadDepthWriter::process(const Wiggle& wiggle) {
+uint64_t BigWigWriter::tell() {
+    off_t pos = ftello(fo);
+    general_assert(pos >= 0, "Fail to write " + output_filename + "!");
+    return pos;
+}
 
-    stream_ << wiggle.name << '\t'
-            << wiggle.length << '\t';
+BigWigWriter::Block BigWigWriter::write_block(uint32_t chrom_id, uint32_t start, uint32_t end, const std::string& data) {
+    Block block = { chrom_id, start, end, tell(), 0 };
 
-    if (wiggle.read_depth.empty()) { stream_ << "NA\n"; return; }
+    uLongf clen = compressBound(data.size());
+    std::string cdata(clen, 0);
+    general_assert(compress((Bytef*)&cdata[0], &clen, (const Bytef*)data.data(), data.size()) == Z_OK, "Fail to compress a block of " + output_filename + "!");
+    general_assert(fwrite(cdata.data(), 1, clen, fo) == clen, "Fail to write " + output_filename + "!");
+    block.size = clen;
+    if (data.size() > uncompress_buf_size) uncompress_buf_size = data.size();
 
-    for (size_t i = 0; i < wiggle.length; ++i) {
-        if (i > 0) stream_ << ' ';
-        stream_ << wiggle.read_depth[i];
+    return block;
+}
+
+// a bedGraph section of the runs collected
+void BigWigWriter::write_section(uint32_t chrom_id) {
+    if (runs.empty()) return;
+
+    std::string data;
+    append_value<uint32_t>(data, chrom_id);
+    append_value<uint32_t>(data, runs[0].start);
+    append_value<uint32_t>(data, runs.back().end);
+    append_value<uint32_t>(data, 0); // item step
+    append_value<uint32_t>(data, 0); // item span
+    append_value<uint8_t>(data, 1); // bedGraph
+    append_value<uint8_t>(data, 0);
+    append_value<uint16_t>(data, runs.size());
+    for (size_t i = 0; i < runs.size(); ++i) {
+      append_value<uint32_t>(data, runs[i].start);
+      append_value<uint32_t>(data, runs[i].end);
+      append_value<float>(data, runs[i].value);
+    }
+
+    sections.push_back(write_block(chrom_id, runs[0].start, runs.back().end, data));
+    runs.clear();
+}
+
+void BigWigWriter::add_to_summary(Summary& summary, uint32_t start, uint32_t end, double value) {
+    uint32_t len = end - start;
+    if (summary.valid_count == 0) { summary.start = start; summary.min_val = summary.max_val = value; }
+    else {
+      if (value < summary.min_val) summary.min_val = value;
+      if (value > summary.max_val) summary.max_val = value;
     }
-    stream_ << '\n';
+    summary.end = end;
+    summary.valid_count += len;
+    summary.sum_data += value * len;
+    summary.sum_squares += value * value * len;
+}
+
+void BigWigWriter::add_run(uint32_t chrom_id, const Run& run) {
+    runs.push_back(run);
+    ++n_runs;
+    if (runs.size() == BW_ITEMS_PER_SLOT) write_section(chrom_id);
+
+    add_to_summary(total, run.start, run.end, run.value);
+
+    uint32_t reduction = BW_BASE_REDUCTION;
+    for (int k = 0; k < BW_MAX_ZOOM_LEVELS; ++k, reduction *= 4) {
+      std::vector<Summary>& zoom = zooms[k];
+      for (uint32_t start = run.start, end; start < run.end; start = end) {
+	uint32_t bin_start = start / reduction * reduction;
+	end = (run.end - bin_start > reduction ? bin_start + reduction : run.end);
+	if (zoom.empty() || zoom.back().chrom_id != chrom_id || zoom.back().end <= bin_start) {
+	  Summary summary;
+	  memset(&summary, 0, sizeof(summary));
+	  summary.chrom_id = chrom_id;
+	  zoom.push_back(summary);
+	}
+	add_to_summary(zoom.back(), start, end, run.value);
+      }
+    }
+}
+
+void BigWigWriter::process(const Wiggle& wiggle) {
+    uint32_t chrom_id = chrom_names.size();
+
+    chrom_names.push_back(wiggle.name);
+    chrom_sizes.push_back(wiggle.length);
+    if (wiggle.read_depth.empty()) return;
+
+    // runs of equal depth over the bases the wiggle track shows
+    for (size_t i = 0, j; i < wiggle.length; i = j) {
+      if (wiggle.read_depth[i] < MIN_WIGGLE_DEPTH) { j = i + 1; continue; }
+      Run run;
+      run.start = i; run.value = wiggle.read_depth[i];
+      for (j = i + 1; j < wiggle.length && wiggle.read_depth[j] >= MIN_WIGGLE_DEPTH && (float)wiggle.read_depth[j] == run.value; ++j);
+      run.end = j;
+      add_run(chrom_id, run);
+    }
+    write_section(chrom_id);
+}
+
+/*
+  Both trees hold n leaf items in nodes of up to block_size items. items[L], the number of items of level L, leaves at level
+  0 and the root at the top; item i of level L > 0 points to node i of level L - 1, which covers the leaf items
+  [i * block_size^L, (i + 1) * block_size^L). Nodes are written from the root down and all but the last node of a level are
+  full, so node offsets follow from the item counts.
+ */
+static std::vector<uint64_t> count_tree_items(uint64_t n, uint32_t block_size) {
+    std::vector<uint64_t> items(1, n);
+    while (items.back() > block_size) items.push_back((items.back() + block_size - 1) / block_size);
+    return items;
+}
+
+// level_start[L], offset of the first node of level L
+static std::vector<uint64_t> locate_tree_levels(const std::vector<uint64_t>& items, uint32_t block_size, uint64_t offset, int leaf_item_size, int item_size) {
+    int height = items.size();
+    std::vector<uint64_t> level_start(height);
+    for (int L = height - 1; L >= 0; --L) {
+      uint64_t n_nodes = std::max((items[L] + block_size - 1) / block_size, (uint64_t)1);
+      level_start[L] = offset;
+      offset += 4 * n_nodes + items[L] * (L == 0 ? leaf_item_size : item_size);
+    }
+    return level_start;
+}
+
+// B+ tree mapping chromosome names to ids and sizes
+void BigWigWriter::write_chrom_tree() {
+    uint32_t n = chrom_names.size(), key_size = 1;
+    uint32_t block_size = std::max(std::min(n, BW_BLOCK_SIZE), (uint32_t)1);
+
+    std::vector<std::pair<std::string, uint32_t> > keys(n);
+    for (uint32_t i = 0; i < n; ++i) {
+      keys[i] = std::make_pair(chrom_names[i], i);
+      if (chrom_names[i].length() > key_size) key_size = chrom_names[i].length();
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::string data;
+    append_value<uint32_t>(data, BPT_MAGIC);
+    append_value<uint32_t>(data, block_size);
+    append_value<uint32_t>(data, key_size);
+    append_value<uint32_t>(data, 8);
+    append_value<uint64_t>(data, n);
+    append_value<uint64_t>(data, 0);
+
+    std::vector<uint64_t> items = count_tree_items(n, block_size);
+    std::vector<uint64_t> level_start = locate_tree_levels(items, block_size, tell() + data.size(), key_size + 8, key_size + 8);
+
+    uint64_t span = 1;
+    for (size_t L = 1; L < items.size(); ++L) span *= block_size;
+    for (int L = items.size() - 1; L >= 0; --L, span /= block_size) {
+      for (uint64_t fr = 0; fr < items[L] || fr == 0; fr += block_size) {
+	uint64_t to = std::min(fr + block_size, items[L]);
+	append_value<uint8_t>(data, L == 0);
+	append_value<uint8_t>(data, 0);
+	append_value<uint16_t>(data, to - fr);
+	for (uint64_t i = fr; i < to; ++i) {
+	  const std::string& key = keys[i * span].first;
+	  data.append(key);
+	  data.append(key_size - key.length(), '\0');
+	  if (L == 0) {
+	    append_value<uint32_t>(data, keys[i].second);
+	    append_value<uint32_t>(data, chrom_sizes[keys[i].second]);
+	  }
+	  else append_value<uint64_t>(data, level_start[L - 1] + i * (4 + (uint64_t)block_size * (key_size + 8)));
+	}
+      }
+    }
+
+    general_assert(fwrite(data.data(), 1, data.size(), fo) == data.size(), "Fail to write " + output_filename + "!");
+}
+
+// R-tree over blocks sorted by region
+void BigWigWriter::write_rtree(const std::vector<Block>& blocks) {
+    uint64_t n = blocks.size();
+    std::string data;
+
+    append_value<uint32_t>(data, CIR_TREE_MAGIC);
+    append_value<uint32_t>(data, BW_BLOCK_SIZE);
+    append_value<uint64_t>(data, n);
+    append_value<uint32_t>(data, n > 0 ? blocks[0].chrom_id : 0);
+    append_value<uint32_t>(data, n > 0 ? blocks[0].start : 0);
+    append_value<uint32_t>(data, n > 0 ? blocks.back().chrom_id : 0);
+    append_value<uint32_t>(data, n > 0 ? blocks.back().end : 0);
+    append_value<uint64_t>(data, tell());
+    append_value<uint32_t>(data, BW_ITEMS_PER_SLOT);
+    append_value<uint32_t>(data, 0);
+
+    std::vector<uint64_t> items = count_tree_items(n, BW_BLOCK_SIZE);
+    std::vector<uint64_t> level_start = locate_tree_levels(items, BW_BLOCK_SIZE, tell() + data.size(), 32, 24);
+
+    uint64_t span = 1;
+    for (size_t L = 1; L < items.size(); ++L) span *= BW_BLOCK_SIZE;
+    for (int L = items.size() - 1; L >= 0; --L, span /= BW_BLOCK_SIZE) {
+      for (uint64_t fr = 0; fr < items[L] || fr == 0; fr += BW_BLOCK_SIZE) {
+	uint64_t to = std::min(fr + BW_BLOCK_SIZE, items[L]);
+	append_value<uint8_t>(data, L == 0);
+	append_value<uint8_t>(data, 0);
+	append_value<uint16_t>(data, to - fr);
+	for (uint64_t i = fr; i < to; ++i) {
+	  // blocks do not overlap, so the last block under an item ends last
+	  const Block& first = blocks[i * span];
+	  const Block& last = blocks[std::min((i + 1) * span, n) - 1];
+	  append_value<uint32_t>(data, first.chrom_id);
+	  append_value<uint32_t>(data, first.start);
+	  append_value<uint32_t>(data, last.chrom_id);
+	  append_value<uint32_t>(data, last.end);
+	  if (L == 0) {
+	    append_value<uint64_t>(data, first.offset);
+	    append_value<uint64_t>(data, first.size);
+	  }
+	  else append_value<uint64_t>(data, level_start[L - 1] + i * (4 + (uint64_t)BW_BLOCK_SIZE * (L == 1 ? 32 : 24)));
+	}
+      }
+    }
+
+    general_assert(fwrite(data.data(), 1, data.size(), fo) == data.size(), "Fail to write " + output_filename + "!");
+}
+
+BigWigWriter::~BigWigWriter() {
+    uint64_t chrom_tree_offset = tell();
+    write_chrom_tree();
+
+    uint64_t index_offset = tell();
+    write_rtree(sections);
+
+    // keep the zoom levels that shrink the data, up to the first one that no longer does
+    std::vector<uint32_t> reductions;
+    std::vector<uint64_t> zoom_data_offsets, zoom_index_offsets;
+    uint64_t prev = n_runs;
+    uint32_t reduction = BW_BASE_REDUCTION;
+    for (int k = 0; k < BW_MAX_ZOOM_LEVELS; ++k, reduction *= 4) {
+      const std::vector<Summary>& zoom = zooms[k];
+      if (zoom.empty()) break;
+      if (zoom.size() * 2 > prev) {
+	if (reductions.empty()) continue;
+	break;
+      }
+      prev = zoom.size();
+
+      reductions.push_back(reduction);
+      zoom_data_offsets.push_back(tell());
+      uint32_t count = zoom.size();
+      general_assert(fwrite(&count, 4, 1, fo) == 1, "Fail to write " + output_filename + "!");
+
+      std::vector<Block> blocks;
+      for (size_t fr = 0; fr < zoom.size(); ) {
+	std::string data;
+	size_t to = fr;
+	while (to < zoom.size() && to - fr < BW_ITEMS_PER_SLOT && zoom[to].chrom_id == zoom[fr].chrom_id) {
+	  const Summary& summary = zoom[to++];
+	  append_value<uint32_t>(data, summary.chrom_id);
+	  append_value<uint32_t>(data, summary.start);
+	  append_value<uint32_t>(data, summary.end);
+	  append_value<uint32_t>(data, (uint32_t)summary.valid_count);
+	  append_value<float>(data, summary.min_val);
+	  append_value<float>(data, summary.max_val);
+	  append_value<float>(data, summary.sum_data);
+	  append_value<float>(data, summary.sum_squares);
+	}
+	blocks.push_back(write_block(zoom[fr].chrom_id, zoom[fr].start, zoom[to - 1].end, data));
+	fr = to;
+      }
+
+      zoom_index_offsets.push_back(tell());
+      write_rtree(blocks);
+    }
+
+    std::string header;
+    append_value<uint32_t>(header, BW_MAGIC);
+    append_value<uint16_t>(header, BW_VERSION);
+    append_value<uint16_t>(header, reductions.size());
+    append_value<uint64_t>(header, chrom_tree_offset);
+    append_value<uint64_t>(header, BW_HEADER_SIZE + BW_ZOOM_HEADER_SIZE * BW_MAX_ZOOM_LEVELS + BW_SUMMARY_SIZE); // data
+    append_value<uint64_t>(header, index_offset);
+    append_value<uint16_t>(header, 0); // field count
+    append_value<uint16_t>(header, 0); // defined field count
+    append_value<uint64_t>(header, 0); // autoSql
+    append_value<uint64_t>(header, BW_HEADER_SIZE + BW_ZOOM_HEADER_SIZE * BW_MAX_ZOOM_LEVELS); // total summary
+    append_value<uint32_t>(header, uncompress_buf_size);
+    append_value<uint64_t>(header, 0); // extension
+
+    for (size_t k = 0; k < reductions.size(); ++k) {
+      append_value<uint32_t>(header, reductions[k]);
+      append_value<uint32_t>(header, 0);
+      append_value<uint64_t>(header, zoom_data_offsets[k]);
+      append_value<uint64_t>(header, zoom_index_offsets[k]);
+    }
+    header.append(BW_ZOOM_HEADER_SIZE * (BW_MAX_ZOOM_LEVELS - reductions.size()), '\0');
+
+    append_value<uint64_t>(header, total.valid_count);
+    append_value<double>(header, total.min_val);
+    append_value<double>(header, total.max_val);
+    append_value<double>(header, total.sum_data);
+    append_value<double>(header, total.sum_squares);
+
+    append_value<uint64_t>(header, sections.size());
+
+    general_assert(fseeko(fo, 0, SEEK_SET) == 0 && fwrite(header.data(), 1, header.size(), fo) == header.size() && fclose(fo) == 0, "Fail to write " + output_filename + "!");
+}
+
+ReadDepthWriter::ReadDepthWriter(const std::string& output_filename)
+    : output_filename(output_filename) {
+    fo = fopen(output_filename.c_str(), "wb");
+    general_assert(fo != NULL, "Cannot write to " + output_filename + "!");
+    general_assert(fwrite(READ_DEPTH_MAGIC, 1, READ_DEPTH_MAGIC_LEN, fo) == (size_t)READ_DEPTH_MAGIC_LEN, "Fail to write " + output_filename + "!");
+    offset = READ_DEPTH_MAGIC_LEN;
+    n_transcripts = 0;
+}
+
+ReadDepthWriter::~ReadDepthWriter() {
+    uint64_t trailer[2] = { n_transcripts, offset };
+    general_assert(fwrite(index.data(), 1, index.size(), fo) == index.size() && fwrite(trailer, 8, 2, fo) == 2 && \
+		   fwrite(READ_DEPTH_INDEX_MAGIC, 1, READ_DEPTH_MAGIC_LEN, fo) == (size_t)READ_DEPTH_MAGIC_LEN && fclose(fo) == 0, \
+		   "Fail to write " + output_filename + "!");
+}
+
+void ReadDepthWriter::process(const Wiggle& wiggle) {
+    uint32_t name_len = wiggle.name.length(), length = wiggle.length;
+    uint64_t record_offset = 0;
+
+    if (!wiggle.read_depth.empty()) {
+      std::string record;
+      encodeReadDepth(wiggle.read_depth, record);
+      general_assert(fwrite(record.data(), 1, record.size(), fo) == record.size(), "Fail to write " + output_filename + "!");
+      record_offset = offset;
+      offset += record.size();
+    }
+
+    index.append((const char*)&name_len, 4);
+    index.append(wiggle.name);
+    index.append((const char*)&length, 4);
+    index.append((const char*)&record_offset, 8);
+    ++n_transcripts;
 }
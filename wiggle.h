@@ -4,7 +4,7 @@
 #include <cstdio>
 #include <string>
 #include <vector>
-#include <ostream>
+#include <stdint.h>
 
 extern bool no_fractional_weight; // if no_frac_weight == true, each alignment counts as weight 1
 
@@ -33,17 +33,78 @@ private:
     FILE *fo;
 };
 
+/*
+  Writes a bigWig file: bases with the depth the wiggle track shows are stored as runs of equal depth in zlib-compressed
+  bedGraph sections, followed by a chromosome B+ tree, an R-tree index over the sections and zoom levels of summaries,
+  each with its own R-tree. The file is completed when the writer is destroyed.
+ */
+class BigWigWriter : public WiggleProcessor {
+public:
+    BigWigWriter(const std::string& output_filename);
+
+    ~BigWigWriter();
+
+    void process(const Wiggle& wiggle);
+
+private:
+    // a compressed block of the file and the region it covers
+    struct Block {
+        uint32_t chrom_id, start, end;
+        uint64_t offset, size;
+    };
+
+    struct Summary {
+        uint32_t chrom_id, start, end;
+        uint64_t valid_count;
+        double min_val, max_val, sum_data, sum_squares;
+    };
+
+    struct Run {
+        uint32_t start, end;
+        float value;
+    };
+
+    FILE *fo;
+    std::string output_filename;
+
+    std::vector<std::string> chrom_names;
+    std::vector<uint32_t> chrom_sizes;
+
+    std::vector<Run> runs; // runs of the section being filled
+    std::vector<Block> sections;
+    uint64_t n_runs;
+    std::vector<std::vector<Summary> > zooms; // summaries of every candidate zoom level
+    Summary total;
+    uint32_t uncompress_buf_size;
+
+    static void add_to_summary(Summary& summary, uint32_t start, uint32_t end, double value);
+    void add_run(uint32_t chrom_id, const Run& run);
+    void write_section(uint32_t chrom_id);
+    Block write_block(uint32_t chrom_id, uint32_t start, uint32_t end, const std::string& data);
+    void write_chrom_tree();
+    void write_rtree(const std::vector<Block>& blocks);
+    uint64_t tell();
+};
+
+// Writes a binary read depth file, see ReadDepthFile.h; the index is written when the writer is destroyed
 class ReadDepthWriter : public WiggleProcessor {
 public:
-    ReadDepthWriter(std::ostream& stream);
+    ReadDepthWriter(const std::string& output_filename);
+
+    ~ReadDepthWriter();
 
     void process(const Wiggle& wiggle);
 
 private:
-    std::ostream& stream_;
+    FILE *fo;
+    std::string output_filename;
+    uint64_t offset;
+    std::string index;
+    uint64_t n_transcripts;
 };
 
+// num_threads > 1 builds chromosomes in parallel if the alignment file is indexed
 void build_wiggles(const std::string& bam_filename,
-                   WiggleProcessor& processor);
+                   WiggleProcessor& processor, int num_threads = 1);
 
 #endif